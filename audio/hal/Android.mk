@@ -5,7 +5,13 @@ include $(CLEAR_VARS)
 LOCAL_ARM_MODE := arm
 
 LOCAL_SRC_FILES := \
-	audio_hw.c
+	audio_hw.c \
+	audio_dsp.c \
+	audio_stats.c \
+	capture_ring.c \
+	fixed_resampler.c \
+	route_cache.c \
+	thread_placement.c
 
 # TODO: remove resampler if possible when AudioFlinger supports downsampling from 48 to 8
 LOCAL_SHARED_LIBRARIES := \
@@ -14,15 +20,15 @@ LOCAL_SHARED_LIBRARIES := \
 	libaudioutils \
 	libtinyalsa \
 	libtinycompress \
-	libaudioroute \
+	libexpat \
 	libdl
 
 
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
 	external/tinycompress/include \
+	external/expat/lib \
 	$(call include-path-for, audio-utils) \
-	$(call include-path-for, audio-route) \
 	$(call include-path-for, audio-effects)
 
 LOCAL_CFLAGS += -DPREPROCESSING_ENABLED
@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DSP_HAVE_NEON
+#endif
+
+#include "audio_dsp.h"
+
+/* Q15 gains. 5.1 to stereo: L = 0.4142 FL + 0.2929 FC + 0.2929 BL, the sum of
+ * the gains stays below 1.0 so the output never clips.
+ */
+#define DSP_GAIN_FRONT  13573
+#define DSP_GAIN_MIX    9597
+/* 7.1 to 5.1: BL = 0.7071 BL + 0.7071 SL, saturated */
+#define DSP_GAIN_SIDE   23170
+
+/* frames processed per pass when a conversion needs an intermediate layout */
+#define DSP_REMIX_CHUNK_FRAMES 256
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31))
+        sample = 0x7FFF ^ (sample >> 31);
+    return sample;
+}
+
+static inline int32_t mul_q15(int32_t sample, int32_t gain)
+{
+    return (sample * gain + (1 << 14)) >> 15;
+}
+
+void dsp_downmix_5_1_to_stereo_s16(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef DSP_HAVE_NEON
+    /* 4 frames per iteration, loaded as channel pairs: (FL FR) (FC LFE) (BL BR) */
+    while (frames >= 4) {
+        int32x4x3_t in = vld3q_s32((const int32_t *)src);
+        int16x8_t front = vreinterpretq_s16_s32(in.val[0]);
+        /* duplicate FC over the LFE lane so that it lines up with FL and FR */
+        int16x8_t center = vreinterpretq_s16_s32(vsliq_n_s32(in.val[1], in.val[1], 16));
+        int16x8_t back = vreinterpretq_s16_s32(in.val[2]);
+        int16x8_t out;
+
+        out = vqrdmulhq_n_s16(front, DSP_GAIN_FRONT);
+        out = vqaddq_s16(out, vqrdmulhq_n_s16(center, DSP_GAIN_MIX));
+        out = vqaddq_s16(out, vqrdmulhq_n_s16(back, DSP_GAIN_MIX));
+        vst1q_s16(dst, out);
+
+        src += 4 * 6;
+        dst += 4 * 2;
+        frames -= 4;
+    }
+#endif
+    while (frames > 0) {
+        int32_t center = src[2] * DSP_GAIN_MIX;
+
+        dst[0] = clamp16((src[0] * DSP_GAIN_FRONT + center + src[4] * DSP_GAIN_MIX +
+                          (1 << 14)) >> 15);
+        dst[1] = clamp16((src[1] * DSP_GAIN_FRONT + center + src[5] * DSP_GAIN_MIX +
+                          (1 << 14)) >> 15);
+        src += 6;
+        dst += 2;
+        frames--;
+    }
+}
+
+void dsp_downmix_7_1_to_5_1_s16(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef DSP_HAVE_NEON
+    /* channel pairs: (FL FR) (FC LFE) (BL BR) (SL SR) */
+    while (frames >= 4) {
+        int32x4x4_t in = vld4q_s32((const int32_t *)src);
+        int32x4x3_t out;
+        int16x8_t back;
+
+        back = vqaddq_s16(vqrdmulhq_n_s16(vreinterpretq_s16_s32(in.val[2]), DSP_GAIN_SIDE),
+                          vqrdmulhq_n_s16(vreinterpretq_s16_s32(in.val[3]), DSP_GAIN_SIDE));
+        out.val[0] = in.val[0];
+        out.val[1] = in.val[1];
+        out.val[2] = vreinterpretq_s32_s16(back);
+        vst3q_s32((int32_t *)dst, out);
+
+        src += 4 * 8;
+        dst += 4 * 6;
+        frames -= 4;
+    }
+#endif
+    while (frames > 0) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = clamp16(mul_q15(src[4], DSP_GAIN_SIDE) + mul_q15(src[6], DSP_GAIN_SIDE));
+        dst[5] = clamp16(mul_q15(src[5], DSP_GAIN_SIDE) + mul_q15(src[7], DSP_GAIN_SIDE));
+        src += 8;
+        dst += 6;
+        frames--;
+    }
+}
+
+void dsp_upmix_s16(int16_t *dst, unsigned int dst_channels,
+                   const int16_t *src, unsigned int src_channels, size_t frames)
+{
+    unsigned int ch;
+
+#ifdef DSP_HAVE_NEON
+    /* stereo into the front pair of 5.1 or 7.1 */
+    if (src_channels == 2 && (dst_channels == 6 || dst_channels == 8)) {
+        int32x4_t zero = vdupq_n_s32(0);
+
+        while (frames >= 4) {
+            int32x4_t front = vld1q_s32((const int32_t *)src);
+
+            if (dst_channels == 6) {
+                int32x4x3_t out = { { front, zero, zero } };
+                vst3q_s32((int32_t *)dst, out);
+            } else {
+                int32x4x4_t out = { { front, zero, zero, zero } };
+                vst4q_s32((int32_t *)dst, out);
+            }
+            src += 4 * 2;
+            dst += 4 * dst_channels;
+            frames -= 4;
+        }
+    }
+#endif
+    while (frames > 0) {
+        for (ch = 0; ch < src_channels; ch++)
+            dst[ch] = src[ch];
+        for (; ch < dst_channels; ch++)
+            dst[ch] = 0;
+        src += src_channels;
+        dst += dst_channels;
+        frames--;
+    }
+}
+
+void dsp_remix_s16(int16_t *dst, unsigned int dst_channels,
+                   const int16_t *src, unsigned int src_channels, size_t frames)
+{
+    int16_t tmp[DSP_REMIX_CHUNK_FRAMES * 6];
+    size_t count;
+    unsigned int ch;
+
+    if (dst_channels == src_channels) {
+        memcpy(dst, src, frames * src_channels * sizeof(int16_t));
+    } else if (src_channels == 6 && dst_channels == 2) {
+        dsp_downmix_5_1_to_stereo_s16(dst, src, frames);
+    } else if (src_channels == 8 && dst_channels == 6) {
+        dsp_downmix_7_1_to_5_1_s16(dst, src, frames);
+    } else if (src_channels == 8 && dst_channels == 2) {
+        while (frames > 0) {
+            count = frames < DSP_REMIX_CHUNK_FRAMES ? frames : DSP_REMIX_CHUNK_FRAMES;
+            dsp_downmix_7_1_to_5_1_s16(tmp, src, count);
+            dsp_downmix_5_1_to_stereo_s16(dst, tmp, count);
+            src += count * 8;
+            dst += count * 2;
+            frames -= count;
+        }
+    } else if (src_channels < dst_channels) {
+        dsp_upmix_s16(dst, dst_channels, src, src_channels, frames);
+    } else {
+        /* no fold down rule for this layout: keep the first channels */
+        while (frames > 0) {
+            for (ch = 0; ch < dst_channels; ch++)
+                dst[ch] = src[ch];
+            src += src_channels;
+            dst += dst_channels;
+            frames--;
+        }
+    }
+}
+
+void dsp_extract_channels_s16(int16_t *dst, unsigned int dst_channels,
+                              const int16_t *src, unsigned int src_channels,
+                              const uint8_t *map, size_t frames)
+{
+    unsigned int ch;
+
+#ifdef DSP_HAVE_NEON
+    unsigned int first = map != NULL ? map[0] : 0;
+
+    if (src_channels == 2 && dst_channels == 1) {
+        while (frames >= 8) {
+            int16x8x2_t in = vld2q_s16(src);
+
+            vst1q_s16(dst, in.val[first]);
+            src += 8 * 2;
+            dst += 8;
+            frames -= 8;
+        }
+    } else if (src_channels == 4 && dst_channels == 1) {
+        while (frames >= 8) {
+            int16x8x4_t in = vld4q_s16(src);
+
+            vst1q_s16(dst, in.val[first]);
+            src += 8 * 4;
+            dst += 8;
+            frames -= 8;
+        }
+    } else if (src_channels == 4 && dst_channels == 2 && (first & 1) == 0 &&
+               (map == NULL || map[1] == first + 1)) {
+        /* the pair is moved as one 32 bit lane */
+        while (frames >= 4) {
+            int32x4x2_t in = vld2q_s32((const int32_t *)src);
+
+            vst1q_s32((int32_t *)dst, in.val[first / 2]);
+            src += 4 * 4;
+            dst += 4 * 2;
+            frames -= 4;
+        }
+    }
+#endif
+    if (map == NULL && dst_channels == 1) {
+        while (frames > 0) {
+            *dst++ = *src;
+            src += src_channels;
+            frames--;
+        }
+    } else if (map == NULL) {
+        while (frames > 0) {
+            for (ch = 0; ch < dst_channels; ch++)
+                dst[ch] = src[ch];
+            src += src_channels;
+            dst += dst_channels;
+            frames--;
+        }
+    } else {
+        while (frames > 0) {
+            for (ch = 0; ch < dst_channels; ch++)
+                dst[ch] = src[map[ch]];
+            src += src_channels;
+            dst += dst_channels;
+            frames--;
+        }
+    }
+}
+
+int32_t dsp_dot_s16(const int16_t *a, const int16_t *b, size_t count)
+{
+    int32_t sum = 0;
+
+#ifdef DSP_HAVE_NEON
+    if (count >= 8) {
+        int32x4_t acc = vdupq_n_s32(0);
+        int32x2_t acc2;
+
+        while (count >= 8) {
+            int16x8_t va = vld1q_s16(a);
+            int16x8_t vb = vld1q_s16(b);
+
+            acc = vmlal_s16(acc, vget_low_s16(va), vget_low_s16(vb));
+            acc = vmlal_s16(acc, vget_high_s16(va), vget_high_s16(vb));
+            a += 8;
+            b += 8;
+            count -= 8;
+        }
+        acc2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+        sum = vget_lane_s32(vpadd_s32(acc2, acc2), 0);
+    }
+#endif
+    while (count > 0) {
+        sum += *a++ * *b++;
+        count--;
+    }
+    return sum;
+}
+
+/* Numerical Recipes LCG, good enough for dither noise */
+#define DSP_LCG_MUL 1664525u
+#define DSP_LCG_ADD 1013904223u
+
+void dsp_dither_init(struct dsp_dither *dither, uint32_t seed)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        seed = seed * DSP_LCG_MUL + DSP_LCG_ADD;
+        dither->state[i] = seed;
+    }
+}
+
+/* Uniform 16 bit value from the high half of the next LCG state: bit n of a
+ * power of two LCG has a period of 2^(n+1), the low half is not random.
+ */
+static inline int32_t dither_draw(uint32_t *state)
+{
+    *state = *state * DSP_LCG_MUL + DSP_LCG_ADD;
+    return (int32_t)(*state >> 16);
+}
+
+/* Triangular noise of +/-1 LSB of a 16 bit sample in Q31: the difference of
+ * two consecutive draws.
+ */
+static inline int32_t dither_q31(struct dsp_dither *dither)
+{
+    int32_t a = dither_draw(&dither->state[0]);
+
+    return a - dither_draw(&dither->state[0]);
+}
+
+static inline int32_t float_to_q31(float sample)
+{
+    if (sample <= -1.0f)
+        return INT32_MIN;
+    if (sample >= 1.0f)
+        return INT32_MAX;
+    return (int32_t)(sample * 2147483648.0f);
+}
+
+/* Rounds a Q31 sample to 16 bit, adding the dither noise first */
+static inline int16_t q31_to_s16(int32_t sample, int32_t noise)
+{
+    int64_t acc = (int64_t)sample + noise + (1 << 15);
+
+    if (acc > INT32_MAX)
+        acc = INT32_MAX;
+    else if (acc < INT32_MIN)
+        acc = INT32_MIN;
+    return (int16_t)(acc >> 16);
+}
+
+void dsp_float_to_s16(int16_t *dst, const float *src, size_t count,
+                      struct dsp_dither *dither)
+{
+#ifdef DSP_HAVE_NEON
+    /* 8 samples per iteration. vcvtq_n_s32_f32() saturates, so clipping is free */
+    if (dither != NULL) {
+        uint32x4_t state = vld1q_u32(dither->state);
+        const uint32x4_t mul = vdupq_n_u32(DSP_LCG_MUL);
+        const uint32x4_t add = vdupq_n_u32(DSP_LCG_ADD);
+
+        while (count >= 8) {
+            int32x4_t lo = vcvtq_n_s32_f32(vld1q_f32(src), 31);
+            int32x4_t hi = vcvtq_n_s32_f32(vld1q_f32(src + 4), 31);
+            int32x4_t noise;
+
+            state = vmlaq_u32(add, state, mul);
+            noise = vreinterpretq_s32_u32(vshrq_n_u32(state, 16));
+            state = vmlaq_u32(add, state, mul);
+            noise = vsubq_s32(noise, vreinterpretq_s32_u32(vshrq_n_u32(state, 16)));
+            lo = vqaddq_s32(lo, noise);
+            state = vmlaq_u32(add, state, mul);
+            noise = vreinterpretq_s32_u32(vshrq_n_u32(state, 16));
+            state = vmlaq_u32(add, state, mul);
+            noise = vsubq_s32(noise, vreinterpretq_s32_u32(vshrq_n_u32(state, 16)));
+            hi = vqaddq_s32(hi, noise);
+            vst1q_s16(dst, vcombine_s16(vqrshrn_n_s32(lo, 16), vqrshrn_n_s32(hi, 16)));
+
+            src += 8;
+            dst += 8;
+            count -= 8;
+        }
+        vst1q_u32(dither->state, state);
+    } else {
+        while (count >= 8) {
+            int32x4_t lo = vcvtq_n_s32_f32(vld1q_f32(src), 31);
+            int32x4_t hi = vcvtq_n_s32_f32(vld1q_f32(src + 4), 31);
+
+            vst1q_s16(dst, vcombine_s16(vqrshrn_n_s32(lo, 16), vqrshrn_n_s32(hi, 16)));
+
+            src += 8;
+            dst += 8;
+            count -= 8;
+        }
+    }
+#endif
+    while (count > 0) {
+        *dst++ = q31_to_s16(float_to_q31(*src++), dither != NULL ? dither_q31(dither) : 0);
+        count--;
+    }
+}
+
+void dsp_p24_to_s16(int16_t *dst, const uint8_t *src, size_t count,
+                    struct dsp_dither *dither)
+{
+    int32_t sample;
+
+    if (dither != NULL) {
+        while (count > 0) {
+            sample = (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 |
+                               (uint32_t)src[2] << 24);
+            *dst++ = q31_to_s16(sample, dither_q31(dither));
+            src += 3;
+            count--;
+        }
+        return;
+    }
+
+#ifdef DSP_HAVE_NEON
+    /* 16 samples per iteration: the two upper bytes are the 16 bit sample and
+     * the MSB of the lower byte rounds it.
+     */
+    while (count >= 16) {
+        uint8x16x3_t in = vld3q_u8(src);
+        uint8x16x2_t word = vzipq_u8(in.val[1], in.val[2]);
+        uint8x16x2_t round = vzipq_u8(vshrq_n_u8(in.val[0], 7), vdupq_n_u8(0));
+
+        vst1q_s16(dst, vqaddq_s16(vreinterpretq_s16_u8(word.val[0]),
+                                  vreinterpretq_s16_u8(round.val[0])));
+        vst1q_s16(dst + 8, vqaddq_s16(vreinterpretq_s16_u8(word.val[1]),
+                                      vreinterpretq_s16_u8(round.val[1])));
+
+        src += 16 * 3;
+        dst += 16;
+        count -= 16;
+    }
+#endif
+    while (count > 0) {
+        sample = (int16_t)(src[1] | src[2] << 8);
+        *dst++ = clamp16(sample + (src[0] >> 7));
+        src += 3;
+        count--;
+    }
+}
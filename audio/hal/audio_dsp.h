@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_AUDIO_DSP_H
+#define FLOUNDER_AUDIO_DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample processing kernels of the audio HAL. They work on interleaved
+ * 16 bit PCM with the channels in Android order: FL FR FC LFE BL BR SL SR.
+ * The NEON versions are used when the HAL is built for a NEON capable CPU.
+ */
+
+/* Folds 5.1 into stereo. LFE is dropped and the gains are normalized so
+ * that the result never clips.
+ */
+void dsp_downmix_5_1_to_stereo_s16(int16_t *dst, const int16_t *src, size_t frames);
+
+/* Folds the side channels of 7.1 into the back channels of 5.1 */
+void dsp_downmix_7_1_to_5_1_s16(int16_t *dst, const int16_t *src, size_t frames);
+
+/* Copies the src_channels first channels and silences the others */
+void dsp_upmix_s16(int16_t *dst, unsigned int dst_channels,
+                   const int16_t *src, unsigned int src_channels, size_t frames);
+
+/* Converts between any two channel counts using the kernels above. dst and
+ * src must not overlap.
+ */
+void dsp_remix_s16(int16_t *dst, unsigned int dst_channels,
+                   const int16_t *src, unsigned int src_channels, size_t frames);
+
+/* Extracts channels of interleaved frames: channel i of dst is channel map[i]
+ * of src, or channel i when map is NULL. Each of 2 to 1, 4 to 2 (aligned pair)
+ * and 4 to 1 has a NEON version. dst and src must not overlap.
+ */
+void dsp_extract_channels_s16(int16_t *dst, unsigned int dst_channels,
+                              const int16_t *src, unsigned int src_channels,
+                              const uint8_t *map, size_t frames);
+
+/* Sum of the products of count samples, the FIR kernel of the fixed ratio
+ * resampler. The sum must fit 32 bits, e.g. Q15 coefficients whose absolute
+ * values add up to less than 2.0. The NEON version handles 8 samples per
+ * iteration and gives the same result.
+ */
+int32_t dsp_dot_s16(const int16_t *a, const int16_t *b, size_t count);
+
+/* State of the TPDF dither generator: one LCG per NEON lane, the scalar code
+ * only uses the first one.
+ */
+struct dsp_dither {
+    uint32_t state[4];
+};
+
+void dsp_dither_init(struct dsp_dither *dither, uint32_t seed);
+
+/* Requantize count samples to 16 bit. Samples are rounded to nearest, or
+ * dithered with +/-1 LSB triangular noise when dither is not NULL.
+ * Float samples are clipped to [-1.0, 1.0].
+ */
+void dsp_float_to_s16(int16_t *dst, const float *src, size_t count,
+                      struct dsp_dither *dither);
+void dsp_p24_to_s16(int16_t *dst, const uint8_t *src, size_t count,
+                    struct dsp_dither *dither);
+
+#endif // FLOUNDER_AUDIO_DSP_H
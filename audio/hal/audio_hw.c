@@ -27,12 +27,14 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
 #include <math.h>
 #include <dlfcn.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
+#include <sys/timerfd.h>
 
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
@@ -45,6 +47,9 @@
 #include <audio_effects/effect_aec.h>
 #include <audio_effects/effect_ns.h>
 #include "audio_hw.h"
+#include "audio_dsp.h"
+#include "fixed_resampler.h"
+#include "thread_placement.h"
 
 #include "sound/compress_params.h"
 
@@ -52,9 +57,14 @@
 #define MIXER_CTL_HEADPHONE_JACK_SWITCH "Headphone Jack Switch"
 #define MIXER_CTL_CODEC_VMIXER_CODEC_SWITCH "Codec VMixer Codec Switch"
 #define MIXER_CTL_SPK_VMIXER_SPK_SWITCH "SPK VMixer SPK Switch"
+#define MIXER_CTL_HDMI_ELD "ELD"
+#define MIXER_CTL_HDMI_CHANNEL_MAP "Playback Channel Map"
 
-/* TODO: the following PCM device profiles could be read from a config file */
+/* Compiled defaults of the PCM device profiles, tunable with
+ * PCM_PROFILES_CONF_FILE_PATH, see pcm_profiles_load().
+ */
 static struct pcm_device_profile pcm_device_playback = {
+    .name = "playback",
     .config = {
         .channels = PLAYBACK_DEFAULT_CHANNEL_COUNT,
         .rate = PLAYBACK_DEFAULT_SAMPLING_RATE,
@@ -75,6 +85,7 @@ static struct pcm_device_profile pcm_device_playback = {
 };
 
 static struct pcm_device_profile pcm_device_capture = {
+    .name = "capture",
     .config = {
         .channels = CAPTURE_DEFAULT_CHANNEL_COUNT,
         .rate = CAPTURE_DEFAULT_SAMPLING_RATE,
@@ -93,6 +104,7 @@ static struct pcm_device_profile pcm_device_capture = {
 };
 
 static struct pcm_device_profile pcm_device_capture_low_latency = {
+    .name = "capture-low-latency",
     .config = {
         .channels = CAPTURE_DEFAULT_CHANNEL_COUNT,
         .rate = CAPTURE_DEFAULT_SAMPLING_RATE,
@@ -111,6 +123,7 @@ static struct pcm_device_profile pcm_device_capture_low_latency = {
 };
 
 static struct pcm_device_profile pcm_device_capture_loopback_aec = {
+    .name = "capture-loopback-aec",
     .config = {
         .channels = CAPTURE_DEFAULT_CHANNEL_COUNT,
         .rate = CAPTURE_DEFAULT_SAMPLING_RATE,
@@ -129,6 +142,7 @@ static struct pcm_device_profile pcm_device_capture_loopback_aec = {
 };
 
 static struct pcm_device_profile pcm_device_playback_sco = {
+    .name = "playback-sco",
     .config = {
         .channels = SCO_DEFAULT_CHANNEL_COUNT,
         .rate = SCO_DEFAULT_SAMPLING_RATE,
@@ -149,6 +163,7 @@ static struct pcm_device_profile pcm_device_playback_sco = {
 };
 
 static struct pcm_device_profile pcm_device_capture_sco = {
+    .name = "capture-sco",
     .config = {
         .channels = SCO_DEFAULT_CHANNEL_COUNT,
         .rate = SCO_DEFAULT_SAMPLING_RATE,
@@ -167,6 +182,7 @@ static struct pcm_device_profile pcm_device_capture_sco = {
 };
 
 static struct pcm_device_profile pcm_device_hotword_streaming = {
+    .name = "hotword-streaming",
     .config = {
         .channels = 1,
         .rate = 16000,
@@ -184,8 +200,32 @@ static struct pcm_device_profile pcm_device_hotword_streaming = {
     .devices = AUDIO_DEVICE_IN_BUILTIN_MIC|AUDIO_DEVICE_IN_WIRED_HEADSET|AUDIO_DEVICE_IN_BACK_MIC
 };
 
+#ifdef HDMI_PCM_DEVICE
+static struct pcm_device_profile pcm_device_hdmi_multi = {
+    .name = "playback-hdmi-multi",
+    .config = {
+        .channels = PLAYBACK_HDMI_MULTI_DEFAULT_CHANNEL_COUNT,
+        .rate = PLAYBACK_DEFAULT_SAMPLING_RATE,
+        .period_size = PLAYBACK_HDMI_MULTI_PERIOD_SIZE,
+        .period_count = PLAYBACK_HDMI_MULTI_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = PLAYBACK_HDMI_MULTI_START_THRESHOLD,
+        .stop_threshold = PLAYBACK_HDMI_MULTI_STOP_THRESHOLD,
+        .silence_threshold = 0,
+        .avail_min = PLAYBACK_HDMI_MULTI_AVAILABLE_MIN,
+    },
+    .card = HDMI_SOUND_CARD,
+    .id = HDMI_PCM_DEVICE,
+    .type = PCM_PLAYBACK,
+    .devices = AUDIO_DEVICE_OUT_AUX_DIGITAL,
+};
+#endif
+
 static struct pcm_device_profile * const pcm_devices[] = {
     &pcm_device_playback,
+#ifdef HDMI_PCM_DEVICE
+    &pcm_device_hdmi_multi,
+#endif
     &pcm_device_capture,
     &pcm_device_capture_low_latency,
     &pcm_device_playback_sco,
@@ -199,6 +239,7 @@ static const char * const use_case_table[AUDIO_USECASE_MAX] = {
     [USECASE_AUDIO_PLAYBACK] = "playback",
     [USECASE_AUDIO_PLAYBACK_MULTI_CH] = "playback multi-channel",
     [USECASE_AUDIO_PLAYBACK_OFFLOAD] = "compress-offload-playback",
+    [USECASE_AUDIO_PLAYBACK_DEEP_BUFFER] = "deep-buffer-playback",
     [USECASE_AUDIO_CAPTURE] = "capture",
     [USECASE_AUDIO_CAPTURE_HOTWORD] = "capture-hotword",
     [USECASE_VOICE_CALL] = "voice-call",
@@ -220,6 +261,17 @@ static struct pcm_config pcm_config_deep_buffer = {
     .avail_min = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
 };
 
+static struct pcm_config pcm_config_deep_buffer_screen_off = {
+    .channels = 2,
+    .rate = DEEP_BUFFER_OUTPUT_SAMPLING_RATE,
+    .period_size = DEEP_BUFFER_SCREEN_OFF_PERIOD_SIZE,
+    .period_count = DEEP_BUFFER_SCREEN_OFF_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .stop_threshold = INT_MAX,
+    .avail_min = DEEP_BUFFER_SCREEN_OFF_AVAILABLE_MIN,
+};
+
 struct string_to_enum {
     const char *name;
     uint32_t value;
@@ -233,6 +285,92 @@ static const struct string_to_enum out_channels_name_to_enum_table[] = {
 
 static void dummybuf_thread_close(struct audio_device *adev);
 
+/* Silence queued after an underrun or ahead of the data, see out_pcm_recover_xrun()
+ * and out_write_silence_l() */
+static const int16_t pcm_xrun_silence[PCM_XRUN_SILENCE_SIZE];
+
+static int64_t get_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* CPU time of the calling thread, to tell computation from waits */
+static int64_t get_thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Locks the mutex and returns how long it waited for it, the clock is only
+ * read when the mutex is contended.
+ */
+static int64_t timed_mutex_lock(pthread_mutex_t *mutex)
+{
+    int64_t start_ns;
+
+    if (pthread_mutex_trylock(mutex) == 0)
+        return 0;
+    start_ns = get_monotonic_ns();
+    pthread_mutex_lock(mutex);
+    return get_monotonic_ns() - start_ns;
+}
+
+/* Accounts a PCM write or read of a stream. A gap longer than the PCM buffer
+ * since the end of the previous transfer means that the buffer ran empty, or
+ * full for a capture, in between.
+ */
+static void stream_stats_pcm_transfer(struct stream_stats *stats, const struct pcm_config *config,
+                                      int64_t start_ns, int status)
+{
+    int64_t end_ns = get_monotonic_ns();
+    int64_t buffer_ns = (int64_t)config->period_size * config->period_count *
+                        1000000000LL / config->rate;
+
+    audio_histogram_add(&stats->pcm, end_ns - start_ns);
+    if (stats->last_pcm_ns != 0 && start_ns - stats->last_pcm_ns > buffer_ns)
+        stats->xruns++;
+    if (status != 0)
+        stats->pcm_errors++;
+    stats->last_pcm_ns = end_ns;
+}
+
+static void stream_stats_dump(const struct stream_stats *stats, int fd)
+{
+    dprintf(fd, "    xruns %u recovered, %u estimated, PCM errors %u, standby %u (warm %u)\n",
+            stats->xrun_recoveries, stats->xruns, stats->pcm_errors, stats->standby_count,
+            stats->warm_standby_count);
+    audio_histogram_dump(&stats->io, "call", fd);
+    audio_histogram_dump(&stats->io_cpu, "call CPU", fd);
+    audio_histogram_dump(&stats->pcm, "PCM transfer", fd);
+    audio_histogram_dump(&stats->lock_wait, "stream lock wait", fd);
+    audio_histogram_dump(&stats->pre_lock_wait, "stream pre_lock wait", fd);
+}
+
+/* Integer ratios, e.g. 48 kHz to 16 kHz capture or 48 kHz to 8 kHz SCO, use the
+ * fixed ratio resampler, quality is only used by the audio_utils one.
+ */
+static int hal_create_resampler(uint32_t in_rate, uint32_t out_rate, uint32_t channels,
+                                uint32_t quality, struct resampler_buffer_provider *provider,
+                                struct resampler_itfe **resampler)
+{
+    if (create_fixed_resampler(in_rate, out_rate, channels, provider, resampler) == 0)
+        return 0;
+    return create_resampler(in_rate, out_rate, channels, quality, provider, resampler);
+}
+
+static void hal_release_resampler(struct resampler_itfe *resampler)
+{
+    if (is_fixed_resampler(resampler))
+        release_fixed_resampler(resampler);
+    else
+        release_resampler(resampler);
+}
+
 static bool is_supported_format(audio_format_t format)
 {
     if (format == AUDIO_FORMAT_MP3 ||
@@ -242,6 +380,21 @@ static bool is_supported_format(audio_format_t format)
     return false;
 }
 
+/* PCM formats accepted by the primary and deep buffer outputs. The PCM devices
+ * only take 16 bit so the other formats are converted by the HAL.
+ */
+static bool is_supported_pcm_format(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static int get_snd_codec_id(audio_format_t format)
 {
     int id = 0;
@@ -337,7 +490,7 @@ static void free_mixer_list(struct audio_device *adev)
     list_for_each_safe(node, next, &adev->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, adev_list_node);
         list_remove(node);
-        audio_route_free(mixer_card->audio_route);
+        route_cache_free(mixer_card->route_cache);
         free(mixer_card);
     }
 }
@@ -348,8 +501,9 @@ static int mixer_init(struct audio_device *adev)
     int card;
     int retry_num;
     struct mixer *mixer;
-    struct audio_route *audio_route;
+    struct route_cache *route_cache;
     char mixer_path[PATH_MAX];
+    char compiled_path[PATH_MAX];
     struct mixer_card *mixer_card;
     struct listnode *node;
 
@@ -371,9 +525,11 @@ static int mixer_init(struct audio_device *adev)
                 }
             } while (mixer == NULL);
 
-            sprintf(mixer_path, "/system/etc/mixer_paths_%d.xml", card);
-            audio_route = audio_route_init(card, mixer_path);
-            if (!audio_route) {
+            sprintf(mixer_path, MIXER_PATHS_XML_PATH, card);
+            sprintf(compiled_path, MIXER_PATHS_COMPILED_PATH, card);
+            route_cache = route_cache_init(mixer, mixer_path,
+                                           adev->compiled_mixer_paths ? compiled_path : NULL);
+            if (!route_cache) {
                 ALOGE("%s: Failed to init audio route controls for card %d, aborting.",
                       __func__, card);
                 goto error;
@@ -381,7 +537,7 @@ static int mixer_init(struct audio_device *adev)
             mixer_card = calloc(1, sizeof(struct mixer_card));
             mixer_card->card = card;
             mixer_card->mixer = mixer;
-            mixer_card->audio_route = audio_route;
+            mixer_card->route_cache = route_cache;
             list_add_tail(&adev->mixer_list, &mixer_card->adev_list_node);
         }
     }
@@ -512,6 +668,11 @@ static snd_device_t get_output_snd_device(struct audio_device *adev, audio_devic
         } else if (devices == (AUDIO_DEVICE_OUT_WIRED_HEADSET |
                                AUDIO_DEVICE_OUT_SPEAKER)) {
             snd_device = SND_DEVICE_OUT_SPEAKER_AND_HEADPHONES;
+#ifdef HDMI_PCM_DEVICE
+        } else if (devices == (AUDIO_DEVICE_OUT_AUX_DIGITAL |
+                               AUDIO_DEVICE_OUT_SPEAKER)) {
+            snd_device = SND_DEVICE_OUT_SPEAKER_AND_HDMI;
+#endif
         } else {
             ALOGE("%s: Invalid combo device(%#x)", __func__, devices);
             goto exit;
@@ -535,6 +696,10 @@ static snd_device_t get_output_snd_device(struct audio_device *adev, audio_devic
         snd_device = SND_DEVICE_OUT_BT_SCO;
     } else if (devices & AUDIO_DEVICE_OUT_EARPIECE) {
         snd_device = SND_DEVICE_OUT_HANDSET;
+#ifdef HDMI_PCM_DEVICE
+    } else if (devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) {
+        snd_device = SND_DEVICE_OUT_HDMI;
+#endif
     } else {
         ALOGE("%s: Unknown device(s) %#x", __func__, devices);
     }
@@ -690,35 +855,430 @@ exit:
     return snd_device;
 }
 
+#ifdef HDMI_PCM_DEVICE
+/* Android channel order: FL FR FC LFE BL BR SL SR, as ALSA channel positions */
+static const int hdmi_channel_map[HDMI_MAX_CHANNELS] = { 3, 4, 7, 8, 5, 6, 9, 10 };
+
+/* The HDMI codec derives the channel allocation from the PCM channel count, the
+ * channel map control only tells it where each channel goes.
+ * must be called with adev->lock held.
+ */
 static int set_hdmi_channels(struct audio_device *adev,  int channel_count)
 {
+    struct mixer_card *mixer_card;
     struct mixer_ctl *ctl;
-    const char *mixer_ctl_name = "";
-    (void)adev;
-    (void)channel_count;
-    /* TODO */
+    const char *mixer_ctl_name = MIXER_CTL_HDMI_CHANNEL_MAP;
+
+    if ((unsigned int)channel_count == adev->cur_hdmi_channels)
+        return 0;
+    if (channel_count <= 0 || channel_count > HDMI_MAX_CHANNELS)
+        return -EINVAL;
 
+    mixer_card = adev_get_mixer_for_card(adev, pcm_device_hdmi_multi.card);
+    if (mixer_card == NULL)
+        return -ENODEV;
+    ctl = mixer_get_ctl_by_name(mixer_card->mixer, mixer_ctl_name);
+    if (ctl == NULL) {
+        ALOGV("%s: no mixer control %s, using the default map", __func__, mixer_ctl_name);
+    } else if (mixer_ctl_set_array(ctl, hdmi_channel_map, channel_count) != 0) {
+        ALOGE("%s: cannot set %s for %d channels", __func__, mixer_ctl_name, channel_count);
+        return -EINVAL;
+    }
+    adev->cur_hdmi_channels = channel_count;
     return 0;
 }
 
+/* Parses the CEA-861 short audio descriptors of the ELD */
+static void hdmi_parse_eld(struct hdmi_caps *caps, const unsigned char *eld, size_t size)
+{
+    const unsigned char *sad;
+    size_t offset;
+    int sad_count;
+    int channels;
+    int i;
+
+    if (size < HDMI_ELD_MONITOR_NAME_OFFSET)
+        return;
+
+    sad_count = eld[HDMI_ELD_SAD_COUNT_OFFSET] >> 4;
+    offset = HDMI_ELD_MONITOR_NAME_OFFSET + (eld[HDMI_ELD_MNL_OFFSET] & 0x1f);
+    for (i = 0; i < sad_count && offset + HDMI_SAD_SIZE <= size; i++) {
+        sad = eld + offset;
+        offset += HDMI_SAD_SIZE;
+        caps->sad_count++;
+        if (((sad[0] >> 3) & 0xf) != HDMI_SAD_FORMAT_LPCM)
+            continue;
+        channels = (sad[0] & 0x7) + 1;
+        if (channels > caps->max_channels)
+            caps->max_channels = channels;
+        caps->lpcm_rates |= sad[1] & 0x7f;
+    }
+    if (caps->max_channels > HDMI_MAX_CHANNELS)
+        caps->max_channels = HDMI_MAX_CHANNELS;
+}
+
+/* Reads the sink capabilities once per hotplug. A sink without ELD is assumed
+ * to support stereo only.
+ * must be called with adev->lock held.
+ */
+static void hdmi_update_caps_l(struct audio_device *adev)
+{
+    struct hdmi_caps *caps = &adev->hdmi_caps;
+    struct mixer_card *mixer_card;
+    struct mixer_ctl *ctl = NULL;
+    unsigned char eld[HDMI_ELD_MAX_SIZE];
+    size_t size = 0;
+
+    if (caps->valid)
+        return;
+
+    memset(caps, 0, sizeof(*caps));
+    caps->max_channels = PLAYBACK_HDMI_DEFAULT_CHANNEL_COUNT;
+
+    mixer_card = adev_get_mixer_for_card(adev, pcm_device_hdmi_multi.card);
+    if (mixer_card != NULL)
+        ctl = mixer_get_ctl_by_name(mixer_card->mixer, MIXER_CTL_HDMI_ELD);
+    if (ctl != NULL) {
+        size = mixer_ctl_get_num_values(ctl);
+        if (size > sizeof(eld))
+            size = sizeof(eld);
+        if (mixer_ctl_get_array(ctl, eld, size) != 0)
+            size = 0;
+    }
+    hdmi_parse_eld(caps, eld, size);
+    caps->valid = true;
+
+    ALOGD("%s: %d SADs, max LPCM channels %d, rates %#x", __func__,
+          caps->sad_count, caps->max_channels, caps->lpcm_rates);
+}
+
+static void hdmi_invalidate_caps_l(struct audio_device *adev)
+{
+    adev->hdmi_caps.valid = false;
+    adev->cur_hdmi_channels = 0;
+}
+
+/* must be called with adev->lock held */
 static int edid_get_max_channels(struct audio_device *adev)
 {
-    int max_channels = 2;
-    struct mixer_ctl *ctl;
-    (void)adev;
+    hdmi_update_caps_l(adev);
+    return adev->hdmi_caps.max_channels;
+}
+
+/* must be called with adev->lock held */
+static int read_hdmi_channel_masks(struct stream_out *out)
+{
+    int channels = edid_get_max_channels(out->dev);
+
+    switch (channels) {
+    case 6:
+    case 7:
+        out->supported_channel_masks[0] = AUDIO_CHANNEL_OUT_5POINT1;
+        out->supported_channel_masks[1] = 0;
+        break;
+    case 8:
+        out->supported_channel_masks[0] = AUDIO_CHANNEL_OUT_5POINT1;
+        out->supported_channel_masks[1] = AUDIO_CHANNEL_OUT_7POINT1;
+        break;
+    default:
+        ALOGE("%s: the HDMI sink supports %d channels, no multichannel output",
+              __func__, channels);
+        return -ENOSYS;
+    }
+    return 0;
+}
+#endif /* HDMI_PCM_DEVICE */
+
+/* Sets a field of a PCM device profile from its name in the profiles file */
+static int pcm_profile_set(struct pcm_device_profile *profile, const char *key,
+                           unsigned int value)
+{
+    if (strcmp(key, "card") == 0)
+        profile->card = value;
+    else if (strcmp(key, "device") == 0)
+        profile->id = value;
+    else if (strcmp(key, "channels") == 0)
+        profile->config.channels = value;
+    else if (strcmp(key, "rate") == 0)
+        profile->config.rate = value;
+    else if (strcmp(key, "period_size") == 0)
+        profile->config.period_size = value;
+    else if (strcmp(key, "period_count") == 0)
+        profile->config.period_count = value;
+    else if (strcmp(key, "start_threshold") == 0)
+        profile->config.start_threshold = value;
+    else if (strcmp(key, "stop_threshold") == 0)
+        profile->config.stop_threshold = value;
+    else if (strcmp(key, "avail_min") == 0)
+        profile->config.avail_min = value;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+static bool pcm_profile_is_valid(const struct pcm_device_profile *profile)
+{
+    const struct pcm_config *config = &profile->config;
+    unsigned int buffer_size = config->period_size * config->period_count;
+    const char *error = NULL;
+
+    if (profile->card < 0 || profile->card >= PCM_PROFILE_MAX_CARDS ||
+            profile->id < 0 || profile->id >= PCM_PROFILE_MAX_DEVICES)
+        error = "card or device out of range";
+    else if (config->channels < 1 || config->channels > PCM_PROFILE_MAX_CHANNELS)
+        error = "bad channel count";
+    else if (config->rate < PCM_PROFILE_MIN_RATE || config->rate > PCM_PROFILE_MAX_RATE)
+        error = "bad sampling rate";
+    else if (config->period_size < PCM_PROFILE_MIN_PERIOD_SIZE ||
+            config->period_size > PCM_PROFILE_MAX_PERIOD_SIZE ||
+            config->period_count < 1 || config->period_count > PCM_PROFILE_MAX_PERIOD_COUNT)
+        error = "bad period size or count";
+    else if (config->start_threshold > buffer_size)
+        error = "start threshold beyond the buffer";
+    else if (config->stop_threshold != 0 && config->stop_threshold < config->start_threshold)
+        error = "stop threshold below the start threshold";
+    else if (config->avail_min > buffer_size)
+        error = "avail_min beyond the buffer";
+
+    if (error != NULL)
+        ALOGE("%s: %s: %s, keeping the previous values", __func__, profile->name, error);
+    return error == NULL;
+}
+
+/* Each non comment line of the file is "<profile> <field> <value>", the profile
+ * names are the ones of pcm_devices[].
+ */
+static void pcm_profiles_parse(struct pcm_device_profile *profiles, bool *tuned,
+                               const char *path)
+{
+    FILE *file;
+    char line[128];
+    char profile_name[48];
+    char key[48];
+    unsigned int value;
+    int line_num = 0;
+    int count = 0;
+    int i;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        ALOGV("%s: no PCM profiles at %s", __func__, path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%47s %47s %u", profile_name, key, &value) != 3) {
+            ALOGW("%s: %s:%d: malformed entry", __func__, path, line_num);
+            continue;
+        }
+        for (i = 0; pcm_devices[i] != NULL; i++) {
+            if (strcmp(pcm_devices[i]->name, profile_name) == 0)
+                break;
+        }
+        if (pcm_devices[i] == NULL || pcm_profile_set(&profiles[i], key, value) != 0) {
+            ALOGW("%s: %s:%d: unknown profile %s or field %s",
+                  __func__, path, line_num, profile_name, key);
+            continue;
+        }
+        tuned[i] = true;
+        count++;
+    }
+    fclose(file);
+
+    ALOGI("%s: %d entries loaded from %s", __func__, count, path);
+}
+
+/* The system file holds the tuning of the product, the override file the one
+ * of a unit under test. A profile is only updated if all its resulting values
+ * are consistent, e.g. a new period size must come with thresholds that fit
+ * the new buffer.
+ */
+static void pcm_profiles_load(void)
+{
+    struct pcm_device_profile profiles[ARRAY_SIZE(pcm_devices)];
+    bool tuned[ARRAY_SIZE(pcm_devices)];
+    int i;
+
+    for (i = 0; pcm_devices[i] != NULL; i++) {
+        profiles[i] = *pcm_devices[i];
+        tuned[i] = false;
+    }
+    pcm_profiles_parse(profiles, tuned, PCM_PROFILES_CONF_FILE_PATH);
+    pcm_profiles_parse(profiles, tuned, PCM_PROFILES_CONF_OVERRIDE_PATH);
+
+    for (i = 0; pcm_devices[i] != NULL; i++) {
+        if (!tuned[i] || !pcm_profile_is_valid(&profiles[i]))
+            continue;
+        profiles[i].tuned = true;
+        *pcm_devices[i] = profiles[i];
+    }
+}
+
+/* Applies the audio_hal.period_size override to the low latency playback and
+ * capture profiles, keeping their period counts, which may have been tuned.
+ * Returns false and leaves both profiles unchanged if either would be invalid.
+ */
+static bool pcm_profiles_override_period_size(int period_size)
+{
+    struct pcm_device_profile playback = pcm_device_playback;
+    struct pcm_device_profile capture = pcm_device_capture_low_latency;
+
+    playback.config.period_size = period_size;
+    playback.config.start_threshold =
+            PLAYBACK_START_THRESHOLD(period_size, playback.config.period_count);
+    playback.config.stop_threshold =
+            PLAYBACK_STOP_THRESHOLD(period_size, playback.config.period_count);
+    capture.config.period_size = period_size;
+
+    if (!pcm_profile_is_valid(&playback) || !pcm_profile_is_valid(&capture))
+        return false;
+    pcm_device_playback = playback;
+    pcm_device_capture_low_latency = capture;
+    return true;
+}
+
+static int latency_usecase_from_name(const char *name)
+{
+    int i;
+
+    for (i = 0; i < AUDIO_USECASE_MAX; i++) {
+        if (use_case_table[i] != NULL && strcmp(use_case_table[i], name) == 0)
+            return i;
+    }
+    return USECASE_INVALID;
+}
+
+/* "*" selects the usecase default, stored in the SND_DEVICE_NONE column */
+static snd_device_t latency_snd_device_from_name(const char *name)
+{
+    int i;
+
+    if (strcmp(name, "*") == 0)
+        return SND_DEVICE_NONE;
+    for (i = SND_DEVICE_MIN; i < SND_DEVICE_MAX; i++) {
+        if (device_table[i] != NULL && strcmp(device_table[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Each non comment line of the file is "<usecase> <snd device|*> <latency in us>",
+ * using the names of use_case_table[] and device_table[].
+ */
+static void latency_table_parse(struct audio_device *adev, const char *path, bool measured)
+{
+    FILE *file;
+    char line[128];
+    char uc_name[48];
+    char dev_name[48];
+    int latency_us;
+    int usecase;
+    snd_device_t snd_device;
+    int line_num = 0;
+    int count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        ALOGV("%s: no latency table at %s", __func__, path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%47s %47s %d", uc_name, dev_name, &latency_us) != 3 ||
+                latency_us < 0) {
+            ALOGW("%s: %s:%d: malformed entry", __func__, path, line_num);
+            continue;
+        }
+        usecase = latency_usecase_from_name(uc_name);
+        snd_device = latency_snd_device_from_name(dev_name);
+        if (usecase == USECASE_INVALID || snd_device < 0) {
+            ALOGW("%s: %s:%d: unknown usecase %s or device %s",
+                  __func__, path, line_num, uc_name, dev_name);
+            continue;
+        }
+        adev->latency_table[usecase][snd_device].us = latency_us;
+        adev->latency_table[usecase][snd_device].measured = measured;
+        count++;
+    }
+    fclose(file);
+
+    ALOGI("%s: %d entries loaded from %s", __func__, count, path);
+}
+
+/* The system table holds the reference values for the device, the override
+ * file holds the values measured on this unit (see latency_measure_thread()).
+ */
+static void latency_table_load(struct audio_device *adev)
+{
+    int i, j;
 
-    /* TODO */
-    return max_channels;
+    for (i = 0; i < AUDIO_USECASE_MAX; i++) {
+        for (j = 0; j < SND_DEVICE_MAX; j++) {
+            adev->latency_table[i][j].us = LATENCY_UNKNOWN;
+            adev->latency_table[i][j].measured = false;
+        }
+    }
+    latency_table_parse(adev, LATENCY_CONF_FILE_PATH, false);
+    latency_table_parse(adev, LATENCY_CONF_OVERRIDE_PATH, true);
 }
 
-/* Delay in Us */
-static int64_t render_latency(audio_usecase_t usecase)
+/* Only the measured entries are saved so that the system table can still be updated */
+static int latency_table_save(struct audio_device *adev)
 {
-    (void)usecase;
-    /* TODO */
+    FILE *file;
+    int i, j;
+
+    file = fopen(LATENCY_CONF_OVERRIDE_PATH, "w");
+    if (file == NULL) {
+        ALOGE("%s: cannot open %s: %s", __func__, LATENCY_CONF_OVERRIDE_PATH, strerror(errno));
+        return -errno;
+    }
+    fprintf(file, "# measured by the audio HAL, do not edit\n");
+    for (i = 0; i < AUDIO_USECASE_MAX; i++) {
+        for (j = 0; j < SND_DEVICE_MAX; j++) {
+            if (!adev->latency_table[i][j].measured || use_case_table[i] == NULL)
+                continue;
+            fprintf(file, "%s %s %d\n", use_case_table[i],
+                    j == SND_DEVICE_NONE ? "*" : device_table[j],
+                    adev->latency_table[i][j].us);
+        }
+    }
+    fclose(file);
     return 0;
 }
 
+/* must be called with adev->lock held */
+static int32_t latency_table_lookup(struct audio_device *adev,
+                                    audio_usecase_t usecase,
+                                    snd_device_t snd_device)
+{
+    int32_t latency_us;
+
+    if (usecase < 0 || usecase >= AUDIO_USECASE_MAX)
+        return 0;
+    if (snd_device < 0 || snd_device >= SND_DEVICE_MAX)
+        snd_device = SND_DEVICE_NONE;
+
+    latency_us = adev->latency_table[usecase][snd_device].us;
+    if (latency_us == LATENCY_UNKNOWN)
+        latency_us = adev->latency_table[usecase][SND_DEVICE_NONE].us;
+    return latency_us == LATENCY_UNKNOWN ? 0 : latency_us;
+}
+
+/* Latency after the application processor (codec, amplifier, DSP) in us, for
+ * the route currently selected for the stream.
+ */
+static int64_t render_latency(struct stream_out *out)
+{
+    return android_atomic_acquire_load(&out->render_latency_us);
+}
+
 static int enable_snd_device(struct audio_device *adev,
                              struct audio_usecase *uc_info,
                              snd_device_t snd_device,
@@ -737,6 +1297,11 @@ static int enable_snd_device(struct audio_device *adev,
         enable_snd_device(adev, uc_info, SND_DEVICE_OUT_HEADPHONES, update_mixer);
         return 0;
     }
+    if (snd_device == SND_DEVICE_OUT_SPEAKER_AND_HDMI) {
+        enable_snd_device(adev, uc_info, SND_DEVICE_OUT_SPEAKER, update_mixer);
+        enable_snd_device(adev, uc_info, SND_DEVICE_OUT_HDMI, update_mixer);
+        return 0;
+    }
     adev->snd_dev_ref_cnt[snd_device]++;
     if (adev->snd_dev_ref_cnt[snd_device] > 1) {
         ALOGV("%s: snd_device(%d: %s) is already active",
@@ -749,9 +1314,9 @@ static int enable_snd_device(struct audio_device *adev,
 
     list_for_each(node, &uc_info->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, uc_list_node[uc_info->id]);
-        audio_route_apply_path(mixer_card->audio_route, snd_device_name);
+        route_cache_apply_path(mixer_card->route_cache, snd_device_name);
         if (update_mixer)
-            audio_route_update_mixer(mixer_card->audio_route);
+            route_cache_update_mixer(mixer_card->route_cache);
     }
 
     return 0;
@@ -775,6 +1340,11 @@ static int disable_snd_device(struct audio_device *adev,
         disable_snd_device(adev, uc_info, SND_DEVICE_OUT_HEADPHONES, update_mixer);
         return 0;
     }
+    if (snd_device == SND_DEVICE_OUT_SPEAKER_AND_HDMI) {
+        disable_snd_device(adev, uc_info, SND_DEVICE_OUT_SPEAKER, update_mixer);
+        disable_snd_device(adev, uc_info, SND_DEVICE_OUT_HDMI, update_mixer);
+        return 0;
+    }
 
     if (adev->snd_dev_ref_cnt[snd_device] <= 0) {
         ALOGE("%s: device ref cnt is already 0", __func__);
@@ -786,16 +1356,16 @@ static int disable_snd_device(struct audio_device *adev,
               snd_device, snd_device_name);
         list_for_each(node, &uc_info->mixer_list) {
             mixer_card = node_to_item(node, struct mixer_card, uc_list_node[uc_info->id]);
-            audio_route_reset_path(mixer_card->audio_route, snd_device_name);
+            route_cache_reset_path(mixer_card->route_cache, snd_device_name);
             if (update_mixer)
-                audio_route_update_mixer(mixer_card->audio_route);
+                route_cache_update_mixer(mixer_card->route_cache);
         }
     }
     return 0;
 }
 
-static int select_devices(struct audio_device *adev,
-                          audio_usecase_t uc_id)
+static int do_select_devices(struct audio_device *adev,
+                             audio_usecase_t uc_id)
 {
     snd_device_t out_snd_device = SND_DEVICE_NONE;
     snd_device_t in_snd_device = SND_DEVICE_NONE;
@@ -851,7 +1421,7 @@ static int select_devices(struct audio_device *adev,
                 if (active_out == adev->primary_output &&
                         active_input &&
                         active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION) {
-                    select_devices(adev, active_input->usecase);
+                    do_select_devices(adev, active_input->usecase);
                 }
             }
         } else if (usecase->type == PCM_CAPTURE) {
@@ -900,12 +1470,16 @@ static int select_devices(struct audio_device *adev,
 
     list_for_each(node, &usecase->mixer_list) {
          mixer_card = node_to_item(node, struct mixer_card, uc_list_node[usecase->id]);
-         audio_route_update_mixer(mixer_card->audio_route);
+         route_cache_update_mixer(mixer_card->route_cache);
     }
 
     usecase->in_snd_device = in_snd_device;
     usecase->out_snd_device = out_snd_device;
 
+    if (usecase->type == PCM_PLAYBACK)
+        android_atomic_release_store(latency_table_lookup(adev, usecase->id, out_snd_device),
+                                     &active_out->render_latency_us);
+
     if (out_snd_device != SND_DEVICE_NONE)
         if (usecase->devices & (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
             if (adev->htc_acoustic_set_rt5506_amp != NULL)
@@ -913,53 +1487,200 @@ static int select_devices(struct audio_device *adev,
     return 0;
 }
 
+/* must be called with adev->lock held */
+static int select_devices(struct audio_device *adev,
+                          audio_usecase_t uc_id)
+{
+    int64_t start_ns = get_monotonic_ns();
+    int64_t start_cpu_ns = get_thread_cpu_ns();
+    int ret = do_select_devices(adev, uc_id);
 
-static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames);
-static int do_in_standby_l(struct stream_in *in);
+    audio_histogram_add(&adev->select_devices_cpu, get_thread_cpu_ns() - start_cpu_ns);
+    audio_histogram_add(&adev->select_devices_time, get_monotonic_ns() - start_ns);
+    return ret;
+}
 
-#ifdef PREPROCESSING_ENABLED
-static void get_capture_reference_delay(struct stream_in *in,
-                              size_t frames __unused,
-                              struct echo_reference_buffer *buffer)
+
+/* Asks the amplifier worker to reconfigure the amplifier the next time the
+ * speaker is playing. Can be called with or without adev->lock held.
+ */
+static void amp_request_config(struct audio_device *adev)
 {
-    ALOGVV("%s: enter:)", __func__);
+    pthread_mutex_lock(&adev->amp_lock);
+    android_atomic_release_store(AMP_STATE_PENDING, &adev->amp_state);
+    adev->amp_i2s_frames = 0;
+    pthread_mutex_unlock(&adev->amp_lock);
+}
 
-    /* read frames available in kernel driver buffer */
-    unsigned int kernel_frames;
-    struct timespec tstamp;
-    long buf_delay;
-    long kernel_delay;
-    long delay_ns;
-    struct pcm_device *ref_device;
-    long rsmp_delay = 0;
+/* Called from out_write() for every buffer sent to the speaker, and for the
+ * silence played ahead of it. Never blocks: the state is only advanced if
+ * amp_lock is free. Returns the number of frames of silence the caller must
+ * play before its buffer for the I2S clock to settle, 0 once that was done.
+ */
+static size_t amp_notify_playback(struct audio_device *adev, size_t frames, size_t settle_frames)
+{
+    size_t pad_frames = 0;
 
-    ref_device = node_to_item(list_tail(&in->pcm_dev_list),
-                              struct pcm_device, stream_list_node);
+    if (adev->htc_acoustic_set_amp_mode == NULL ||
+            android_atomic_acquire_load(&adev->amp_state) == AMP_STATE_READY)
+        return 0;
 
-    if (pcm_get_htimestamp(ref_device->pcm, &kernel_frames, &tstamp) < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGW("read get_capture_reference_delay(): pcm_htimestamp error");
-        return;
-    }
+    if (pthread_mutex_trylock(&adev->amp_lock) != 0)
+        return 0;
 
-    /* adjust render time stamp with delay added by current driver buffer.
-    * Add the duration of current frame as we want the render time of the last
-    * sample being written. */
+    switch (adev->amp_state) {
+    case AMP_STATE_PENDING:
+        adev->amp_i2s_frames = 0;
+        android_atomic_release_store(AMP_STATE_WAIT_I2S, &adev->amp_state);
+        pad_frames = settle_frames;
+        break;
+    case AMP_STATE_WAIT_I2S:
+        adev->amp_i2s_frames += frames;
+        if (adev->amp_i2s_frames >= settle_frames) {
+            android_atomic_release_store(AMP_STATE_I2S_READY, &adev->amp_state);
+            pthread_cond_signal(&adev->amp_cond);
+        }
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&adev->amp_lock);
 
-    kernel_delay = (long)(((int64_t)kernel_frames * 1000000000) / ref_device->pcm_profile->config.rate);
+    return pad_frames;
+}
 
-    buffer->time_stamp = tstamp;
-    buffer->delay_ns = kernel_delay;
+/* Speaker playback stopped: the I2S clock is about to go away */
+static void amp_notify_standby(struct audio_device *adev)
+{
+    if (adev->htc_acoustic_set_amp_mode == NULL)
+        return;
 
-    ALOGVV("get_capture_reference_delay_time_stamp Secs: [%10ld], nSecs: [%9ld], kernel_frames: [%5d],"
-          " delay_ns: [%d] , frames:[%zd]",
-           buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, kernel_frames, buffer->delay_ns, frames);
+    pthread_mutex_lock(&adev->amp_lock);
+    if (adev->amp_state == AMP_STATE_WAIT_I2S || adev->amp_state == AMP_STATE_I2S_READY)
+        android_atomic_release_store(AMP_STATE_PENDING, &adev->amp_state);
+    pthread_mutex_unlock(&adev->amp_lock);
 }
 
-static void get_capture_delay(struct stream_in *in,
-                              size_t frames __unused,
+static void *amp_config_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    int init;
+
+    prctl(PR_SET_NAME, (unsigned long)"Amp Config", 0, 0, 0);
+
+    ALOGV("%s", __func__);
+    pthread_mutex_lock(&adev->amp_lock);
+    for (;;) {
+        if (adev->amp_thread_exit)
+            break;
+        if (adev->amp_state != AMP_STATE_I2S_READY) {
+            pthread_cond_wait(&adev->amp_cond, &adev->amp_lock);
+            continue;
+        }
+        android_atomic_release_store(AMP_STATE_CONFIGURING, &adev->amp_state);
+        pthread_mutex_unlock(&adev->amp_lock);
+
+        pthread_mutex_lock(&adev->tfa9895_lock);
+        init = adev->htc_acoustic_set_amp_mode(adev->mode, AUDIO_DEVICE_OUT_SPEAKER,
+                                               0, 0, false);
+        adev->tfa9895_init = init;
+        pthread_mutex_unlock(&adev->tfa9895_lock);
+
+        pthread_mutex_lock(&adev->amp_lock);
+        /* a new request received meanwhile leaves the state PENDING */
+        if (adev->amp_state == AMP_STATE_CONFIGURING) {
+            if (!init)
+                ALOGE("%s: set_amp_mode failed, will retry on next speaker playback",
+                      __func__);
+            android_atomic_release_store(init ? AMP_STATE_READY : AMP_STATE_PENDING,
+                                         &adev->amp_state);
+            adev->amp_i2s_frames = 0;
+        }
+        ALOGD("%s: amp configured for mode %d, state %d", __func__, adev->mode,
+              adev->amp_state);
+    }
+    pthread_mutex_unlock(&adev->amp_lock);
+
+    return NULL;
+}
+
+static void create_amp_config_thread(struct audio_device *adev)
+{
+    pthread_mutex_init(&adev->amp_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->amp_cond, (const pthread_condattr_t *) NULL);
+    adev->amp_state = AMP_STATE_READY;
+    adev->amp_thread_exit = false;
+    if (adev->htc_acoustic_set_amp_mode == NULL)
+        return;
+
+    if (pthread_create(&adev->amp_thread, (const pthread_attr_t *) NULL,
+                       amp_config_thread, adev) != 0) {
+        ALOGE("%s: could not create amp config thread", __func__);
+        /* without the worker the amplifier keeps its boot configuration */
+        adev->htc_acoustic_set_amp_mode = NULL;
+    }
+}
+
+static void destroy_amp_config_thread(struct audio_device *adev)
+{
+    if (adev->htc_acoustic_set_amp_mode != NULL) {
+        pthread_mutex_lock(&adev->amp_lock);
+        adev->amp_thread_exit = true;
+        pthread_cond_signal(&adev->amp_cond);
+        pthread_mutex_unlock(&adev->amp_lock);
+        pthread_join(adev->amp_thread, (void **) NULL);
+    }
+    pthread_cond_destroy(&adev->amp_cond);
+    pthread_mutex_destroy(&adev->amp_lock);
+}
+
+
+static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames);
+static int do_in_standby_l(struct stream_in *in);
+
+#ifdef PREPROCESSING_ENABLED
+static void get_capture_reference_delay(struct stream_in *in,
+                              size_t frames __unused,
+                              struct echo_reference_buffer *buffer)
+{
+    ALOGVV("%s: enter:)", __func__);
+
+    /* read frames available in kernel driver buffer */
+    unsigned int kernel_frames;
+    struct timespec tstamp;
+    long buf_delay;
+    long kernel_delay;
+    long delay_ns;
+    struct pcm_device *ref_device;
+    long rsmp_delay = 0;
+
+    ref_device = node_to_item(list_tail(&in->pcm_dev_list),
+                              struct pcm_device, stream_list_node);
+
+    if (pcm_get_htimestamp(ref_device->pcm, &kernel_frames, &tstamp) < 0) {
+        buffer->time_stamp.tv_sec  = 0;
+        buffer->time_stamp.tv_nsec = 0;
+        buffer->delay_ns           = 0;
+        ALOGW("read get_capture_reference_delay(): pcm_htimestamp error");
+        return;
+    }
+
+    /* adjust render time stamp with delay added by current driver buffer.
+    * Add the duration of current frame as we want the render time of the last
+    * sample being written. */
+
+    kernel_delay = (long)(((int64_t)kernel_frames * 1000000000) / ref_device->pcm_profile->config.rate);
+
+    buffer->time_stamp = tstamp;
+    buffer->delay_ns = kernel_delay;
+
+    ALOGVV("get_capture_reference_delay_time_stamp Secs: [%10ld], nSecs: [%9ld], kernel_frames: [%5d],"
+          " delay_ns: [%d] , frames:[%zd]",
+           buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, kernel_frames, buffer->delay_ns, frames);
+}
+
+static void get_capture_delay(struct stream_in *in,
+                              size_t frames __unused,
                               struct echo_reference_buffer *buffer)
 {
     ALOGVV("%s: enter:)", __func__);
@@ -989,7 +1710,7 @@ static void get_capture_delay(struct stream_in *in,
     /* frames in in->read_buf are at driver sampling rate while frames in in->proc_buf are
      * at requested sampling rate */
     buf_delay = (long)(((int64_t)(in->read_buf_frames) * 1000000000) / in->config.rate +
-                       ((int64_t)(in->proc_buf_frames) * 1000000000) / in->requested_rate );
+                       ((int64_t)(in->proc_ring.frames) * 1000000000) / in->requested_rate );
 
     /* add delay introduced by resampler */
     rsmp_delay = 0;
@@ -1005,10 +1726,10 @@ static void get_capture_delay(struct stream_in *in,
     buffer->delay_ns   = delay_ns;
     ALOGVV("get_capture_delay_time_stamp Secs: [%10ld], nSecs: [%9ld], kernel_frames:[%5d],"
          " delay_ns: [%d], kernel_delay:[%ld], buf_delay:[%ld], rsmp_delay:[%ld],  "
-         "in->read_buf_frames:[%zd], in->proc_buf_frames:[%zd], frames:[%zd]",
+         "in->read_buf_frames:[%zd], in->proc_ring.frames:[%zd], frames:[%zd]",
          buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, kernel_frames,
          buffer->delay_ns, kernel_delay, buf_delay, rsmp_delay,
-         in->read_buf_frames, in->proc_buf_frames, frames);
+         in->read_buf_frames, in->proc_ring.frames, frames);
 }
 
 static int32_t update_echo_reference(struct stream_in *in, size_t frames)
@@ -1016,34 +1737,28 @@ static int32_t update_echo_reference(struct stream_in *in, size_t frames)
     ALOGVV("%s: enter:), in->config.channels(%d)", __func__,in->config.channels);
     struct echo_reference_buffer b;
     b.delay_ns = 0;
-    struct pcm_device *pcm_device;
 
-    pcm_device = node_to_item(list_head(&in->pcm_dev_list),
-                              struct pcm_device, stream_list_node);
+    /* allocates only on the first call or when the frame size changes */
+    if (capture_ring_reserve(&in->ref_ring, frames, in->config.channels * sizeof(int16_t)) != 0) {
+        ALOGE("update_echo_reference(): cannot allocate the reference buffer");
+        return 0;
+    }
 
-    ALOGVV("update_echo_reference, in->config.channels(%d), frames = [%zd], in->ref_buf_frames = [%zd],  "
+    ALOGVV("update_echo_reference, in->config.channels(%d), frames = [%zd], in->ref_ring.frames = [%zd],  "
           "b.frame_count = [%zd]",
-          in->config.channels, frames, in->ref_buf_frames, frames - in->ref_buf_frames);
-    if (in->ref_buf_frames < frames) {
-        if (in->ref_buf_size < frames) {
-            in->ref_buf_size = frames;
-            in->ref_buf = (int16_t *)realloc(in->ref_buf, pcm_frames_to_bytes(pcm_device->pcm, frames));
-            ALOG_ASSERT((in->ref_buf != NULL),
-                        "update_echo_reference() failed to reallocate ref_buf");
-            ALOGVV("update_echo_reference(): ref_buf %p extended to %d bytes",
-                      in->ref_buf, pcm_frames_to_bytes(pcm_device->pcm, frames));
-        }
-        b.frame_count = frames - in->ref_buf_frames;
-        b.raw = (void *)(in->ref_buf + in->ref_buf_frames * in->config.channels);
+          in->config.channels, frames, in->ref_ring.frames, frames - in->ref_ring.frames);
+    if (in->ref_ring.frames < frames) {
+        b.frame_count = frames - in->ref_ring.frames;
+        b.raw = capture_ring_write_ptr(&in->ref_ring);
 
         get_capture_delay(in, frames, &b);
 
         if (in->echo_reference->read(in->echo_reference, &b) == 0)
         {
-            in->ref_buf_frames += b.frame_count;
-            ALOGVV("update_echo_reference(): in->ref_buf_frames:[%zd], "
-                    "in->ref_buf_size:[%zd], frames:[%zd], b.frame_count:[%zd]",
-                 in->ref_buf_frames, in->ref_buf_size, frames, b.frame_count);
+            capture_ring_produce(&in->ref_ring, b.frame_count);
+            ALOGVV("update_echo_reference(): in->ref_ring.frames:[%zd], "
+                    "in->ref_ring.capacity:[%zd], frames:[%zd], b.frame_count:[%zd]",
+                 in->ref_ring.frames, in->ref_ring.capacity, frames, b.frame_count);
         }
     } else
         ALOGW("update_echo_reference(): NOT enough frames to read ref buffer");
@@ -1091,18 +1806,18 @@ static void push_echo_reference(struct stream_in *in, size_t frames)
 {
     ALOGVV("%s: enter:)", __func__);
     /* read frames from echo reference buffer and update echo delay
-     * in->ref_buf_frames is updated with frames available in in->ref_buf */
+     * in->ref_ring holds the frames read and not yet passed to the effects */
 
     int32_t delay_us = update_echo_reference(in, frames)/1000;
     int32_t size_in_bytes = 0;
     int i;
     audio_buffer_t buf;
 
-    if (in->ref_buf_frames < frames)
-        frames = in->ref_buf_frames;
+    if (in->ref_ring.frames < frames)
+        frames = in->ref_ring.frames;
 
     buf.frameCount = frames;
-    buf.raw = in->ref_buf;
+    buf.raw = capture_ring_read_ptr(&in->ref_ring);
 
     for (i = 0; i < in->num_preprocessors; i++) {
         if ((*in->preprocessors[i].effect_itfe)->process_reverse == NULL)
@@ -1115,39 +1830,38 @@ static void push_echo_reference(struct stream_in *in, size_t frames)
         set_preprocessor_echo_delay(in->preprocessors[i].effect_itfe, delay_us);
     }
 
-    in->ref_buf_frames -= buf.frameCount;
-    ALOGVV("%s: in->ref_buf_frames(%zd), in->config.channels(%d) ",
-           __func__, in->ref_buf_frames, in->config.channels);
-    if (in->ref_buf_frames) {
-        memcpy(in->ref_buf,
-               in->ref_buf + buf.frameCount * in->config.channels,
-               in->ref_buf_frames * in->config.channels * sizeof(int16_t));
-    }
+    capture_ring_consume(&in->ref_ring, buf.frameCount);
+    ALOGVV("%s: in->ref_ring.frames(%zd), in->config.channels(%d) ",
+           __func__, in->ref_ring.frames, in->config.channels);
 }
 
+/* The echo reference is published to the primary output without adev->lock:
+ * the output sets echo_reference_writing, then checks echo_reference_published
+ * (see out_echo_reference_acquire()). Here the reference is unpublished first,
+ * then released once the output is not writing to it, which takes one buffer at
+ * most. The output signals echo_reference_cond when it is done and a release
+ * is waiting. The full barriers order each side's store before its load.
+ * must be called with adev->lock held.
+ */
 static void put_echo_reference(struct audio_device *adev,
                           struct echo_reference_itfe *reference)
 {
     ALOGV("%s: enter:)", __func__);
-    int32_t prev_generation = adev->echo_reference_generation;
     struct stream_out *out = adev->primary_output;
 
-    if (adev->echo_reference != NULL &&
-            reference == adev->echo_reference) {
-        /* echo reference is taken from the low latency output stream used
-         * for voice use cases */
-        adev->echo_reference = NULL;
-        android_atomic_inc(&adev->echo_reference_generation);
-        if (out != NULL && out->usecase == USECASE_AUDIO_PLAYBACK) {
-            // if the primary output is in standby or did not pick the echo reference yet
-            // we can safely get rid of it here.
-            // otherwise, out_write() or out_standby() will detect the change in echo reference
-            // generation and release the echo reference owned by the stream.
-            if ((out->echo_reference_generation != prev_generation) || out->standby)
-                release_echo_reference(reference);
-        } else {
-            release_echo_reference(reference);
+    if (reference != NULL && reference == adev->echo_reference) {
+        android_atomic_release_store(0, &adev->echo_reference_published);
+        if (out != NULL) {
+            pthread_mutex_lock(&adev->echo_reference_lock);
+            android_atomic_release_store(1, &adev->echo_reference_waiting);
+            android_memory_barrier();
+            while (android_atomic_acquire_load(&out->echo_reference_writing))
+                pthread_cond_wait(&adev->echo_reference_cond, &adev->echo_reference_lock);
+            android_atomic_release_store(0, &adev->echo_reference_waiting);
+            pthread_mutex_unlock(&adev->echo_reference_lock);
         }
+        adev->echo_reference = NULL;
+        release_echo_reference(reference);
         ALOGV("release_echo_reference");
     }
 }
@@ -1157,6 +1871,8 @@ static struct echo_reference_itfe *get_echo_reference(struct audio_device *adev,
                                                       uint32_t channel_count,
                                                       uint32_t sampling_rate)
 {
+    struct echo_reference_itfe *reference;
+
     ALOGV("%s: enter:)", __func__);
     put_echo_reference(adev, adev->echo_reference);
     /* echo reference is taken from the low latency output stream used
@@ -1174,9 +1890,11 @@ static struct echo_reference_itfe *get_echo_reference(struct audio_device *adev,
                                            AUDIO_FORMAT_PCM_16_BIT,
                                            wr_channel_count,
                                            wr_sampling_rate,
-                                           &adev->echo_reference);
-        if (status == 0)
-            android_atomic_inc(&adev->echo_reference_generation);
+                                           &reference);
+        if (status == 0) {
+            adev->echo_reference = reference;
+            android_atomic_release_store(1, &adev->echo_reference_published);
+        }
     }
     return adev->echo_reference;
 }
@@ -1576,11 +2294,6 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     * - extra channels due to HW limitations
     * In case of additional channels, we cannot work inplace
     */
-    if (has_additional_channels)
-        proc_buf_out = in->proc_buf_out;
-    else
-        proc_buf_out = buffer;
-
     if (list_empty(&in->pcm_dev_list)) {
         ALOGE("%s: pcm device list empty", __func__);
         return -EINVAL;
@@ -1589,47 +2302,52 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     pcm_device = node_to_item(list_head(&in->pcm_dev_list),
                               struct pcm_device, stream_list_node);
 
+    if (has_additional_channels) {
+        /* With additional channels, we cannot use original buffer */
+        if (in->proc_buf_size < (size_t)frames) {
+            size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
+            in->proc_buf_size = (size_t)frames;
+            in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
+            ALOG_ASSERT((in->proc_buf_out != NULL),
+                        "process_frames() failed to reallocate proc_buf_out");
+        }
+        proc_buf_out = in->proc_buf_out;
+    } else {
+        proc_buf_out = buffer;
+    }
+
 #ifdef PREPROCESSING_ENABLED
     if (has_processing) {
         /* since all the processing below is done in frames and using the config.channels
          * as the number of channels, no changes is required in case aux_channels are present */
         while (frames_wr < frames) {
-            /* first reload enough frames at the end of process input buffer */
-            if (in->proc_buf_frames < (size_t)frames) {
+            /* first reload enough frames after the ones left in the process input
+             * ring, which allocates only when the read size or frame size grows */
+            if (in->proc_ring.frames < (size_t)frames) {
                 ssize_t frames_rd;
-                if (in->proc_buf_size < (size_t)frames) {
-                    size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
-                    in->proc_buf_size = (size_t)frames;
-                    in->proc_buf_in = (int16_t *)realloc(in->proc_buf_in, size_in_bytes);
-                    ALOG_ASSERT((in->proc_buf_in != NULL),
-                                "process_frames() failed to reallocate proc_buf_in");
-                    if (has_additional_channels) {
-                        in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
-                        ALOG_ASSERT((in->proc_buf_out != NULL),
-                                    "process_frames() failed to reallocate proc_buf_out");
-                        proc_buf_out = in->proc_buf_out;
-                    }
+                if (capture_ring_reserve(&in->proc_ring, frames,
+                                         in->config.channels * sizeof(int16_t)) != 0) {
+                    frames_wr = -ENOMEM;
+                    break;
                 }
-                frames_rd = read_frames(in,
-                                        in->proc_buf_in +
-                                            in->proc_buf_frames * in->config.channels,
-                                        frames - in->proc_buf_frames);
+                frames_rd = read_frames(in, capture_ring_write_ptr(&in->proc_ring),
+                                        frames - in->proc_ring.frames);
                   if (frames_rd < 0) {
                     /* Return error code */
                     frames_wr = frames_rd;
                     break;
                 }
-                in->proc_buf_frames += frames_rd;
+                capture_ring_produce(&in->proc_ring, frames_rd);
             }
 
             if (in->echo_reference != NULL) {
-                push_echo_reference(in, in->proc_buf_frames);
+                push_echo_reference(in, in->proc_ring.frames);
             }
 
              /* in_buf.frameCount and out_buf.frameCount indicate respectively
               * the maximum number of frames to be consumed and produced by process() */
-            in_buf.frameCount = in->proc_buf_frames;
-            in_buf.s16 = in->proc_buf_in;
+            in_buf.frameCount = in->proc_ring.frames;
+            in_buf.s16 = capture_ring_read_ptr(&in->proc_ring);
             out_buf.frameCount = frames - frames_wr;
             out_buf.s16 = (int16_t *)proc_buf_out + frames_wr * in->config.channels;
 
@@ -1645,15 +2363,9 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
             }
 
             /* process() has updated the number of frames consumed and produced in
-             * in_buf.frameCount and out_buf.frameCount respectively
-             * move remaining frames to the beginning of in->proc_buf_in */
-            in->proc_buf_frames -= in_buf.frameCount;
-
-            if (in->proc_buf_frames) {
-                memcpy(in->proc_buf_in,
-                       in->proc_buf_in + in_buf.frameCount * in->config.channels,
-                       in->proc_buf_frames * in->config.channels * sizeof(int16_t));
-            }
+             * in_buf.frameCount and out_buf.frameCount respectively, the remaining
+             * frames stay in place in in->proc_ring */
+            capture_ring_consume(&in->proc_ring, in_buf.frameCount);
 
             /* if not enough frames were passed to process(), read more and retry. */
             if (out_buf.frameCount == 0) {
@@ -1675,17 +2387,6 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
 #endif //PREPROCESSING_ENABLED
     {
         /* No processing effects attached */
-        if (has_additional_channels) {
-            /* With additional channels, we cannot use original buffer */
-            if (in->proc_buf_size < (size_t)frames) {
-                size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
-                in->proc_buf_size = (size_t)frames;
-                in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
-                ALOG_ASSERT((in->proc_buf_out != NULL),
-                            "process_frames() failed to reallocate proc_buf_out");
-                proc_buf_out = in->proc_buf_out;
-            }
-        }
         frames_wr = read_frames(in, proc_buf_out, frames);
     }
 
@@ -1695,30 +2396,60 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
      * Assumption is made that the channels are interleaved and that the main
      * channels are first. */
 
-    if (has_additional_channels)
+    if (has_additional_channels && frames_wr > 0)
     {
-        int16_t* src_buffer = (int16_t *)proc_buf_out;
-        int16_t* dst_buffer = (int16_t *)buffer;
-
-        if (dst_channels == 1) {
-            for (i = frames_wr; i > 0; i--)
-            {
-                *dst_buffer++ = *src_buffer;
-                src_buffer += src_channels;
-            }
-        } else {
-            for (i = frames_wr; i > 0; i--)
-            {
-                memcpy(dst_buffer, src_buffer, dst_channels*sizeof(int16_t));
-                dst_buffer += dst_channels;
-                src_buffer += src_channels;
-            }
-        }
+        dsp_extract_channels_s16((int16_t *)buffer, dst_channels, (int16_t *)proc_buf_out,
+                                 src_channels, NULL, frames_wr);
     }
 
     return frames_wr;
 }
 
+/* Reads from a capture PCM. No error reports an overrun: up to the stop
+ * threshold the driver overwrites the frames not read yet, then tinyalsa
+ * restarts the PCM whatever the open flags. It is detected afterwards, when
+ * more than a buffer of frames is pending, or when the hardware timestamp moved
+ * further than the frames read and pending account for, beyond the jitter of
+ * a period.
+ */
+static int in_pcm_read(struct stream_in *in, struct pcm_device *pcm_device,
+                       void *data, unsigned int count)
+{
+    struct pcm_config *config = &pcm_device->pcm_profile->config;
+    unsigned int buffer_size = pcm_get_buffer_size(pcm_device->pcm);
+    struct timespec ts;
+    unsigned int avail;
+    int64_t tstamp_ns, captured, lost = 0;
+    int ret;
+
+    ret = pcm_read(pcm_device->pcm, data, count);
+    if (ret != 0)
+        return ret;
+
+    if (pcm_get_htimestamp(pcm_device->pcm, &avail, &ts) != 0) {
+        pcm_device->read_tstamp_ns = 0;
+        return 0;
+    }
+    tstamp_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (pcm_device->read_tstamp_ns != 0) {
+        captured = (tstamp_ns - pcm_device->read_tstamp_ns) * config->rate / 1000000000LL;
+        lost = captured - ((int64_t)avail - pcm_device->read_avail +
+                           pcm_bytes_to_frames(pcm_device->pcm, count));
+        if (lost <= (int64_t)config->period_size)
+            lost = 0;
+    }
+    if (avail > buffer_size && pcm_device->read_avail <= buffer_size)
+        lost += avail - buffer_size;
+    if (lost > 0) {
+        android_atomic_inc(&in->stats.xrun_recoveries);
+        ALOGW("%s: overrun on device %d, about %lld frames lost", __func__,
+              pcm_device->pcm_profile->id, (long long)lost);
+    }
+    pcm_device->read_tstamp_ns = tstamp_ns;
+    pcm_device->read_avail = avail;
+    return 0;
+}
+
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                                    struct resampler_buffer* buffer)
 {
@@ -1750,7 +2481,9 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                         "get_next_buffer() failed to reallocate read_buf");
         }
 
-        in->read_status = pcm_read(pcm_device->pcm, (void*)in->read_buf, size_in_bytes);
+        int64_t start_ns = get_monotonic_ns();
+        in->read_status = in_pcm_read(in, pcm_device, (void*)in->read_buf, size_in_bytes);
+        stream_stats_pcm_transfer(&in->stats, &in->config, start_ns, in->read_status);
 
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
@@ -1898,6 +2631,286 @@ static int in_release_pcm_devices(struct stream_in *in)
     return 0;
 }
 
+static bool pcm_config_equal(const struct pcm_config *a, const struct pcm_config *b)
+{
+    return a->channels == b->channels &&
+           a->rate == b->rate &&
+           a->period_size == b->period_size &&
+           a->period_count == b->period_count &&
+           a->format == b->format &&
+           a->start_threshold == b->start_threshold &&
+           a->stop_threshold == b->stop_threshold &&
+           a->silence_threshold == b->silence_threshold &&
+           a->silence_size == b->silence_size &&
+           a->avail_min == b->avail_min;
+}
+
+/* Lock free: the entries below pcm_pool_count are complete, see pcm_pool_add(),
+ * and their profile and direction never change.
+ */
+static struct pcm_pool_entry *pcm_pool_find(struct audio_device *adev,
+                                            struct pcm_device_profile *profile)
+{
+    bool capture = profile->type != PCM_PLAYBACK;
+    int count = android_atomic_acquire_load(&adev->pcm_pool_count);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (adev->pcm_pool[i].profile->card == profile->card &&
+                adev->pcm_pool[i].profile->id == profile->id &&
+                ((adev->pcm_pool[i].flags & PCM_IN) != 0) == capture)
+            return &adev->pcm_pool[i];
+    }
+    return NULL;
+}
+
+/* Opens a PCM device for a stream. The pooled handle is handed over, already
+ * prepared, when it was opened with the same flags and configuration. Otherwise
+ * it is closed to free the device and a new handle is opened.
+ * The handle must be given back with pcm_pool_put(), even if it is not ready.
+ */
+static struct pcm *pcm_pool_get(struct audio_device *adev, struct pcm_device_profile *profile,
+                                unsigned int flags, struct pcm_config *config)
+{
+    struct pcm_pool_entry *entry = pcm_pool_find(adev, profile);
+    struct pcm *pcm = NULL;
+
+    if (entry != NULL) {
+        pthread_mutex_lock(&adev->pcm_pool_lock);
+        while (entry->opening)
+            pthread_cond_wait(&adev->pcm_pool_cond, &adev->pcm_pool_lock);
+        if (entry->pcm != NULL) {
+            if (entry->flags == flags && pcm_config_equal(&entry->config, config)) {
+                pcm = entry->pcm;
+                entry->lent = pcm;
+            } else {
+                ALOGV("%s: closing pooled handle of device %d", __func__, profile->id);
+                pcm_close(entry->pcm);
+            }
+            entry->pcm = NULL;
+        }
+        entry->busy = true;
+        pthread_mutex_unlock(&adev->pcm_pool_lock);
+    }
+
+    if (pcm == NULL)
+        pcm = pcm_open(profile->card, profile->id, flags, config);
+    return pcm;
+}
+
+/* Gives back a handle obtained with pcm_pool_get(). A pooled handle is stopped
+ * and prepared again for the next stream, any other one is closed and the pool
+ * opens a new handle in the background.
+ */
+static void pcm_pool_put(struct audio_device *adev, struct pcm_device_profile *profile,
+                         struct pcm *pcm)
+{
+    struct pcm_pool_entry *entry = pcm_pool_find(adev, profile);
+
+    if (entry == NULL) {
+        if (pcm != NULL)
+            pcm_close(pcm);
+        return;
+    }
+
+    pthread_mutex_lock(&adev->pcm_pool_lock);
+    if (pcm != NULL && pcm == entry->lent) {
+        pcm_stop(pcm);
+        pcm_prepare(pcm);
+        entry->pcm = pcm;
+        entry->idle_since_ns = get_monotonic_ns();
+        pthread_cond_broadcast(&adev->pcm_pool_cond);
+    } else {
+        if (pcm != NULL)
+            pcm_close(pcm);
+        entry->refill = true;
+        pthread_cond_broadcast(&adev->pcm_pool_cond);
+    }
+    entry->lent = NULL;
+    entry->busy = false;
+    pthread_mutex_unlock(&adev->pcm_pool_lock);
+}
+
+static struct pcm *pcm_pool_open_entry(struct pcm_pool_entry *entry)
+{
+    struct pcm *pcm;
+
+    pcm = pcm_open(entry->profile->card, entry->profile->id, entry->flags, &entry->config);
+    if (pcm != NULL && !pcm_is_ready(pcm) && (entry->flags & PCM_MMAP)) {
+        /* same fallback as out_open_pcm_devices() */
+        pcm_close(pcm);
+        entry->flags &= ~(PCM_MMAP | PCM_NOIRQ);
+        entry->config.avail_min = entry->profile->config.avail_min;
+        pcm = pcm_open(entry->profile->card, entry->profile->id, entry->flags, &entry->config);
+    }
+    if (pcm != NULL && !pcm_is_ready(pcm)) {
+        ALOGW("%s: cannot open device %d: %s", __func__, entry->profile->id, pcm_get_error(pcm));
+        pcm_close(pcm);
+        return NULL;
+    }
+    if (pcm != NULL && pcm_prepare(pcm) != 0) {
+        ALOGW("%s: cannot prepare device %d: %s", __func__, entry->profile->id,
+              pcm_get_error(pcm));
+        pcm_close(pcm);
+        return NULL;
+    }
+    return pcm;
+}
+
+/* Closes the handles left idle for PCM_POOL_IDLE_MS: an open and prepared PCM
+ * keeps the DAI and its DAPM widgets powered. Returns the time the next idle
+ * handle expires, 0 if there is none.
+ * must be called with adev->pcm_pool_lock held.
+ */
+static int64_t pcm_pool_reclaim_l(struct audio_device *adev)
+{
+    int64_t now_ns = get_monotonic_ns();
+    int64_t deadline_ns;
+    int64_t next_ns = 0;
+    int i;
+
+    for (i = 0; i < adev->pcm_pool_count; i++) {
+        struct pcm_pool_entry *entry = &adev->pcm_pool[i];
+
+        if (entry->pcm == NULL || entry->busy)
+            continue;
+        deadline_ns = entry->idle_since_ns + PCM_POOL_IDLE_MS * 1000000LL;
+        if (deadline_ns <= now_ns) {
+            ALOGV("%s: closing idle handle of device %d", __func__, entry->profile->id);
+            pcm_close(entry->pcm);
+            entry->pcm = NULL;
+        } else if (next_ns == 0 || deadline_ns < next_ns) {
+            next_ns = deadline_ns;
+        }
+    }
+    return next_ns;
+}
+
+/* Opens the pooled handles off the callers' threads: first at adev_open() and
+ * then each time a stream gave back a handle that did not come from the pool.
+ * Handles nobody took are closed again after PCM_POOL_IDLE_MS.
+ */
+static void *pcm_pool_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct pcm_pool_entry *entry;
+    struct timespec ts;
+    struct pcm *pcm;
+    int64_t next_ns;
+    int i;
+
+    prctl(PR_SET_NAME, (unsigned long)"PCM Pool", 0, 0, 0);
+
+    pthread_mutex_lock(&adev->pcm_pool_lock);
+    while (!adev->pcm_pool_exit) {
+        entry = NULL;
+        for (i = 0; i < adev->pcm_pool_count; i++) {
+            if (adev->pcm_pool[i].refill && !adev->pcm_pool[i].busy &&
+                    adev->pcm_pool[i].pcm == NULL) {
+                entry = &adev->pcm_pool[i];
+                break;
+            }
+        }
+        if (entry == NULL) {
+            next_ns = pcm_pool_reclaim_l(adev);
+            if (next_ns == 0) {
+                pthread_cond_wait(&adev->pcm_pool_cond, &adev->pcm_pool_lock);
+            } else {
+                ts.tv_sec = next_ns / 1000000000LL;
+                ts.tv_nsec = next_ns % 1000000000LL;
+                pthread_cond_timedwait(&adev->pcm_pool_cond, &adev->pcm_pool_lock, &ts);
+            }
+            continue;
+        }
+        entry->refill = false;
+        entry->opening = true;
+        pthread_mutex_unlock(&adev->pcm_pool_lock);
+
+        pcm = pcm_pool_open_entry(entry);
+
+        pthread_mutex_lock(&adev->pcm_pool_lock);
+        entry->pcm = pcm;
+        entry->idle_since_ns = get_monotonic_ns();
+        entry->opening = false;
+        pthread_cond_broadcast(&adev->pcm_pool_cond);
+        ALOGV("%s: device %d %s", __func__, entry->profile->id, pcm ? "ready" : "unavailable");
+    }
+    pthread_mutex_unlock(&adev->pcm_pool_lock);
+
+    return NULL;
+}
+
+/* The entry is filled before pcm_pool_count makes it visible: the dummybuf
+ * thread may already be looking up the pool.
+ */
+static void pcm_pool_add(struct audio_device *adev, struct pcm_device_profile *profile,
+                         unsigned int flags)
+{
+    struct pcm_pool_entry *entry = &adev->pcm_pool[adev->pcm_pool_count];
+
+    memset(entry, 0, sizeof(*entry));
+    entry->profile = profile;
+    entry->flags = flags;
+    entry->config = profile->config;
+    if (flags & PCM_MMAP)
+        entry->config.avail_min = PLAYBACK_MMAP_AVAILABLE_MIN(entry->config.period_size);
+    entry->refill = true;
+
+    pthread_mutex_lock(&adev->pcm_pool_lock);
+    android_atomic_release_store(adev->pcm_pool_count + 1, &adev->pcm_pool_count);
+    pthread_cond_broadcast(&adev->pcm_pool_cond);
+    pthread_mutex_unlock(&adev->pcm_pool_lock);
+}
+
+/* Pools the handles of the low latency playback, with the parameters of a FAST
+ * primary output, and of the default capture.
+ */
+static void pcm_pool_init(struct audio_device *adev)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&adev->pcm_pool_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->pcm_pool_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    adev->pcm_pool_count = 0;
+    adev->pcm_pool_exit = false;
+
+    if (pthread_create(&adev->pcm_pool_thread, (const pthread_attr_t *) NULL,
+                       pcm_pool_thread_loop, adev) != 0) {
+        ALOGW("%s: PCM pool disabled", __func__);
+        return;
+    }
+    adev->pcm_pool_active = true;
+
+    pcm_pool_add(adev, &pcm_device_playback,
+                 PCM_OUT | PCM_MONOTONIC | PCM_NORESTART | PCM_MMAP | PCM_NOIRQ);
+    pcm_pool_add(adev, &pcm_device_capture, PCM_IN | PCM_MONOTONIC);
+}
+
+static void pcm_pool_release(struct audio_device *adev)
+{
+    int i;
+
+    if (!adev->pcm_pool_active)
+        return;
+
+    pthread_mutex_lock(&adev->pcm_pool_lock);
+    adev->pcm_pool_exit = true;
+    pthread_cond_broadcast(&adev->pcm_pool_cond);
+    pthread_mutex_unlock(&adev->pcm_pool_lock);
+    pthread_join(adev->pcm_pool_thread, (void **) NULL);
+
+    for (i = 0; i < adev->pcm_pool_count; i++) {
+        if (adev->pcm_pool[i].pcm != NULL)
+            pcm_close(adev->pcm_pool[i].pcm);
+        adev->pcm_pool[i].pcm = NULL;
+    }
+    android_atomic_release_store(0, &adev->pcm_pool_count);
+    adev->pcm_pool_active = false;
+}
+
 static int stop_input_stream(struct stream_in *in)
 {
     struct audio_usecase *uc_info;
@@ -1949,6 +2962,11 @@ static int start_input_stream(struct stream_in *in)
     struct pcm_device *pcm_device;
 
     ALOGV("%s: enter: usecase(%d)", __func__, in->usecase);
+    if (adev->latency_measuring) {
+        ALOGW("%s: latency measurement in progress", __func__);
+        return -EBUSY;
+    }
+    thread_placement_refresh();
     adev->active_input = in;
     pcm_profile = get_pcm_device(in->usecase_type, in->devices);
     if (pcm_profile == NULL) {
@@ -2002,12 +3020,12 @@ static int start_input_stream(struct stream_in *in)
 
     if (recreate_resampler) {
         if (in->resampler) {
-            release_resampler(in->resampler);
+            hal_release_resampler(in->resampler);
             in->resampler = NULL;
         }
         in->buf_provider.get_next_buffer = get_next_buffer;
         in->buf_provider.release_buffer = release_buffer;
-        ret = create_resampler(in->config.rate,
+        ret = hal_create_resampler(in->config.rate,
                                in->requested_rate,
                                in->config.channels,
                                RESAMPLER_QUALITY_DEFAULT,
@@ -2061,12 +3079,15 @@ static int start_input_stream(struct stream_in *in)
         ALOGV("Opened DSP successfully");
     } else {
         pcm_device->sound_trigger_handle = 0;
-        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                                   PCM_IN | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+        pcm_device->pcm = pcm_pool_get(adev, pcm_device->pcm_profile,
+                                       PCM_IN | PCM_MONOTONIC,
+                                       &pcm_device->pcm_profile->config);
+        pcm_device->read_tstamp_ns = 0;
+        pcm_device->read_avail = 0;
 
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
-            pcm_close(pcm_device->pcm);
+            pcm_pool_put(adev, pcm_device->pcm_profile, pcm_device->pcm);
             pcm_device->pcm = NULL;
             ret = -EIO;
             goto error_open;
@@ -2074,8 +3095,8 @@ static int start_input_stream(struct stream_in *in)
     }
 
     /* force read and proc buffer reallocation in case of frame size or
-     * channel count change */
-    in->proc_buf_frames = 0;
+     * channel count change, the process input ring reallocates itself */
+    capture_ring_reset(&in->proc_ring);
     in->proc_buf_size = 0;
     in->read_buf_size = 0;
     in->read_buf_frames = 0;
@@ -2090,7 +3111,7 @@ static int start_input_stream(struct stream_in *in)
 
 error_open:
     if (in->resampler) {
-        release_resampler(in->resampler);
+        hal_release_resampler(in->resampler);
         in->resampler = NULL;
     }
     stop_input_stream(in);
@@ -2103,32 +3124,93 @@ error_config:
 
 void lock_input_stream(struct stream_in *in)
 {
-    pthread_mutex_lock(&in->pre_lock);
-    pthread_mutex_lock(&in->lock);
+    int64_t pre_lock_wait_ns = timed_mutex_lock(&in->pre_lock);
+    int64_t lock_wait_ns = timed_mutex_lock(&in->lock);
+
     pthread_mutex_unlock(&in->pre_lock);
+    audio_histogram_add(&in->stats.pre_lock_wait, pre_lock_wait_ns);
+    audio_histogram_add(&in->stats.lock_wait, lock_wait_ns);
 }
 
 void lock_output_stream(struct stream_out *out)
 {
-    pthread_mutex_lock(&out->pre_lock);
-    pthread_mutex_lock(&out->lock);
+    int64_t pre_lock_wait_ns = timed_mutex_lock(&out->pre_lock);
+    int64_t lock_wait_ns = timed_mutex_lock(&out->lock);
+
     pthread_mutex_unlock(&out->pre_lock);
+    audio_histogram_add(&out->stats.pre_lock_wait, pre_lock_wait_ns);
+    audio_histogram_add(&out->stats.lock_wait, lock_wait_ns);
 }
 
+/* Takes adev->lock, the wait is accounted with the lock held */
+static void lock_audio_device(struct audio_device *adev)
+{
+    int64_t wait_ns = timed_mutex_lock(&adev->lock);
 
-/* must be called with out->lock locked */
+    audio_histogram_add(&adev->lock_wait, wait_ns);
+}
+
+/* must be called with out->lock locked. Does not allocate: commands are
+ * queued in out->offload_cmds and a WAIT_FOR_BUFFER is dropped if one is
+ * already pending since the thread only signals the next write ready once.
+ * The last OFFLOAD_CMD_RESERVED_SLOTS entries are kept for WAIT_FOR_BUFFER
+ * and EXIT, each queued at most once, so that sending them never fails.
+ * Only the drain commands can be refused, with -ENOSPC.
+ */
 static int send_offload_cmd_l(struct stream_out* out, int command)
 {
-    struct offload_cmd *cmd = (struct offload_cmd *)calloc(1, sizeof(struct offload_cmd));
+    struct offload_cmd *cmd;
 
     ALOGVV("%s %d", __func__, command);
 
+    if (command == OFFLOAD_CMD_WAIT_FOR_BUFFER && out->offload_wait_queued) {
+        out->offload_stats.coalesced++;
+        return 0;
+    }
+    if (command != OFFLOAD_CMD_WAIT_FOR_BUFFER && command != OFFLOAD_CMD_EXIT &&
+            out->offload_cmd_count >= OFFLOAD_CMD_QUEUE_SIZE - OFFLOAD_CMD_RESERVED_SLOTS) {
+        ALOGE("%s: command queue full, refusing command %d", __func__, command);
+        return -ENOSPC;
+    }
+    if (out->offload_cmd_count == OFFLOAD_CMD_QUEUE_SIZE) {
+        ALOGE("%s: command queue full, dropping command %d", __func__, command);
+        return -ENOSPC;
+    }
+
+    cmd = &out->offload_cmds[(out->offload_cmd_head + out->offload_cmd_count) %
+                             OFFLOAD_CMD_QUEUE_SIZE];
     cmd->cmd = command;
-    list_add_tail(&out->offload_cmd_list, &cmd->node);
+    cmd->queued_ns = get_monotonic_ns();
+    out->offload_cmd_count++;
+    if (command == OFFLOAD_CMD_WAIT_FOR_BUFFER)
+        out->offload_wait_queued = true;
+
+    out->offload_stats.sent++;
+    if (out->offload_cmd_count > out->offload_stats.max_depth)
+        out->offload_stats.max_depth = out->offload_cmd_count;
+
     pthread_cond_signal(&out->offload_cond);
     return 0;
 }
 
+/* must be called with out->lock locked and a non empty queue */
+static int receive_offload_cmd_l(struct stream_out* out)
+{
+    struct offload_cmd *cmd = &out->offload_cmds[out->offload_cmd_head];
+    int64_t queue_ns = get_monotonic_ns() - cmd->queued_ns;
+
+    out->offload_cmd_head = (out->offload_cmd_head + 1) % OFFLOAD_CMD_QUEUE_SIZE;
+    out->offload_cmd_count--;
+    if (cmd->cmd == OFFLOAD_CMD_WAIT_FOR_BUFFER)
+        out->offload_wait_queued = false;
+
+    out->offload_stats.queue_ns_total += queue_ns;
+    if (queue_ns > out->offload_stats.queue_ns_max)
+        out->offload_stats.queue_ns_max = queue_ns;
+
+    return cmd->cmd;
+}
+
 /* must be called iwth out->lock locked */
 static void stop_compressed_output_l(struct stream_out *out)
 {
@@ -2144,40 +3226,35 @@ static void stop_compressed_output_l(struct stream_out *out)
 static void *offload_thread_loop(void *context)
 {
     struct stream_out *out = (struct stream_out *) context;
-    struct listnode *item;
+    int64_t wait_ns;
 
-    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
-    set_sched_policy(0, SP_FOREGROUND);
     prctl(PR_SET_NAME, (unsigned long)"Offload Callback", 0, 0, 0);
+    thread_placement_apply(THREAD_ROLE_OFFLOAD_CALLBACK);
 
     ALOGV("%s", __func__);
     lock_output_stream(out);
     for (;;) {
-        struct offload_cmd *cmd = NULL;
+        int cmd;
         stream_callback_event_t event;
         bool send_callback = false;
 
-        ALOGVV("%s offload_cmd_list %d out->offload_state %d",
-              __func__, list_empty(&out->offload_cmd_list),
+        ALOGVV("%s offload_cmd_count %d out->offload_state %d",
+              __func__, out->offload_cmd_count,
               out->offload_state);
-        if (list_empty(&out->offload_cmd_list)) {
+        if (out->offload_cmd_count == 0) {
             ALOGV("%s SLEEPING", __func__);
             pthread_cond_wait(&out->offload_cond, &out->lock);
             ALOGV("%s RUNNING", __func__);
             continue;
         }
 
-        item = list_head(&out->offload_cmd_list);
-        cmd = node_to_item(item, struct offload_cmd, node);
-        list_remove(item);
+        cmd = receive_offload_cmd_l(out);
 
         ALOGVV("%s STATE %d CMD %d out->compr %p",
-               __func__, out->offload_state, cmd->cmd, out->compr);
+               __func__, out->offload_state, cmd, out->compr);
 
-        if (cmd->cmd == OFFLOAD_CMD_EXIT) {
-            free(cmd);
+        if (cmd == OFFLOAD_CMD_EXIT)
             break;
-        }
 
         if (out->compr == NULL) {
             ALOGE("%s: Compress handle is NULL", __func__);
@@ -2187,9 +3264,12 @@ static void *offload_thread_loop(void *context)
         out->offload_thread_blocked = true;
         pthread_mutex_unlock(&out->lock);
         send_callback = false;
-        switch(cmd->cmd) {
+        wait_ns = 0;
+        switch(cmd) {
         case OFFLOAD_CMD_WAIT_FOR_BUFFER:
+            wait_ns = get_monotonic_ns();
             compress_wait(out->compr, -1);
+            wait_ns = get_monotonic_ns() - wait_ns;
             send_callback = true;
             event = STREAM_CBK_EVENT_WRITE_READY;
             break;
@@ -2205,24 +3285,26 @@ static void *offload_thread_loop(void *context)
             event = STREAM_CBK_EVENT_DRAIN_READY;
             break;
         default:
-            ALOGE("%s unknown command received: %d", __func__, cmd->cmd);
+            ALOGE("%s unknown command received: %d", __func__, cmd);
             break;
         }
         lock_output_stream(out);
         out->offload_thread_blocked = false;
+        if (cmd == OFFLOAD_CMD_WAIT_FOR_BUFFER) {
+            out->offload_stats.waits++;
+            out->offload_stats.wait_ns_total += wait_ns;
+            if (wait_ns > out->offload_stats.wait_ns_max)
+                out->offload_stats.wait_ns_max = wait_ns;
+        }
         pthread_cond_signal(&out->cond);
         if (send_callback) {
             out->offload_callback(event, NULL, out->offload_cookie);
         }
-        free(cmd);
     }
 
     pthread_cond_signal(&out->cond);
-    while (!list_empty(&out->offload_cmd_list)) {
-        item = list_head(&out->offload_cmd_list);
-        list_remove(item);
-        free(node_to_item(item, struct offload_cmd, node));
-    }
+    out->offload_cmd_count = 0;
+    out->offload_wait_queued = false;
     pthread_mutex_unlock(&out->lock);
 
     return NULL;
@@ -2231,7 +3313,10 @@ static void *offload_thread_loop(void *context)
 static int create_offload_callback_thread(struct stream_out *out)
 {
     pthread_cond_init(&out->offload_cond, (const pthread_condattr_t *) NULL);
-    list_init(&out->offload_cmd_list);
+    out->offload_cmd_head = 0;
+    out->offload_cmd_count = 0;
+    out->offload_wait_queued = false;
+    memset(&out->offload_stats, 0, sizeof(out->offload_stats));
     pthread_create(&out->offload_thread, (const pthread_attr_t *) NULL,
                     offload_thread_loop, out);
     return 0;
@@ -2239,8 +3324,12 @@ static int create_offload_callback_thread(struct stream_out *out)
 
 static int destroy_offload_callback_thread(struct stream_out *out)
 {
+    int ret;
+
     lock_output_stream(out);
-    send_offload_cmd_l(out, OFFLOAD_CMD_EXIT);
+    ret = send_offload_cmd_l(out, OFFLOAD_CMD_EXIT);
+    /* the thread would never be joined */
+    LOG_ALWAYS_FATAL_IF(ret != 0, "%s: cannot queue the exit command", __func__);
 
     pthread_mutex_unlock(&out->lock);
     pthread_join(out->offload_thread, (void **) NULL);
@@ -2293,6 +3382,23 @@ static int uc_select_pcm_devices(struct audio_usecase *usecase)
     return 0;
 }
 
+static void pcm_device_worker_stop(struct pcm_device *pcm_device)
+{
+    struct pcm_device_worker *worker = &pcm_device->worker;
+
+    if (!worker->active)
+        return;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->exit = true;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, (void **) NULL);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    worker->active = false;
+}
+
 static int out_close_pcm_devices(struct stream_out *out)
 {
     struct pcm_device *pcm_device;
@@ -2301,57 +3407,408 @@ static int out_close_pcm_devices(struct stream_out *out)
 
     list_for_each(node, &out->pcm_dev_list) {
         pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        pcm_device_worker_stop(pcm_device);
         if (pcm_device->sound_trigger_handle > 0) {
             adev->sound_trigger_close_for_streaming(pcm_device->sound_trigger_handle);
             pcm_device->sound_trigger_handle = 0;
         }
         if (pcm_device->pcm) {
-            pcm_close(pcm_device->pcm);
+            pcm_pool_put(adev, pcm_device->pcm_profile, pcm_device->pcm);
             pcm_device->pcm = NULL;
         }
         if (pcm_device->resampler) {
-            release_resampler(pcm_device->resampler);
+            hal_release_resampler(pcm_device->resampler);
             pcm_device->resampler = NULL;
         }
-        if (pcm_device->res_buffer) {
-            free(pcm_device->res_buffer);
-            pcm_device->res_buffer = NULL;
-        }
+        free(pcm_device->remix_buffer);
+        pcm_device->remix_buffer = NULL;
+        /* res_buffer points into out->res_arena which is kept until the stream is closed */
+        pcm_device->res_buffer = NULL;
+        pcm_device->res_byte_count = 0;
     }
 
     return 0;
 }
 
-static int out_open_pcm_devices(struct stream_out *out)
+/* Size of the frames handed to the PCM devices: the stream data once converted to 16 bit */
+static size_t out_pcm_frame_size(struct stream_out *out)
 {
-    struct pcm_device *pcm_device;
-    struct listnode *node;
-    int ret = 0;
+    return audio_channel_count_from_out_mask(out->channel_mask) * sizeof(int16_t);
+}
 
-    list_for_each(node, &out->pcm_dev_list) {
-        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
-        ALOGV("%s: Opening PCM device card_id(%d) device_id(%d)",
+/* Resampler output size for one chunk of at most out->config.period_size input frames */
+static size_t out_res_buffer_size(struct stream_out *out, struct pcm_device *pcm_device)
+{
+    size_t frame_size = out_pcm_frame_size(out);
+
+    return (out->config.period_size * pcm_device->pcm_profile->config.rate / out->sample_rate
+            + 1) * frame_size;
+}
+
+/* Hands out the resampler buffers from the per-stream arena. The arena only grows here,
+ * when the PCM devices are opened, so that the write path never allocates.
+ */
+static int out_alloc_res_buffers(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    size_t size = 0;
+    int8_t *ptr;
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->resampler)
+            size += out_res_buffer_size(out, pcm_device);
+    }
+    if (size == 0)
+        return 0;
+
+    if (size > out->res_arena_size) {
+        free(out->res_arena);
+        out->res_arena = (int8_t *)malloc(size);
+        if (out->res_arena == NULL) {
+            out->res_arena_size = 0;
+            return -ENOMEM;
+        }
+        out->res_arena_size = size;
+        ALOGV("%s: resampler arena size = %zu", __func__, size);
+    }
+
+    ptr = out->res_arena;
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->resampler) {
+            pcm_device->res_buffer = (int16_t *)ptr;
+            pcm_device->res_byte_count = out_res_buffer_size(out, pcm_device);
+            ptr += pcm_device->res_byte_count;
+        }
+    }
+
+    return 0;
+}
+
+/* PCM configuration to open pcm_device with, according to its pcm_open() flags.
+ * The deep buffer output uses its own buffering on the shared playback device.
+ */
+static void out_get_pcm_config(struct stream_out *out, struct pcm_device *pcm_device,
+                               struct pcm_config *config)
+{
+    *config = pcm_device->pcm_profile->config;
+#ifdef HDMI_PCM_DEVICE
+    if (pcm_device->pcm_profile == &pcm_device_hdmi_multi) {
+        /* follow the stream buffering, with no more channels than the sink supports */
+        *config = out->config;
+        if (out->dev->hdmi_caps.valid &&
+                config->channels > (unsigned int)out->dev->hdmi_caps.max_channels)
+            config->channels = out->dev->hdmi_caps.max_channels;
+    }
+#endif
+    if (out->deep_buffer_config != NULL) {
+        config->period_size = out->deep_buffer_config->period_size;
+        config->period_count = out->deep_buffer_config->period_count;
+        config->start_threshold = out->deep_buffer_config->start_threshold;
+        config->stop_threshold = out->deep_buffer_config->stop_threshold;
+        config->avail_min = out->deep_buffer_config->avail_min;
+    }
+    if (pcm_device->flags & PCM_MMAP)
+        config->avail_min = PLAYBACK_MMAP_AVAILABLE_MIN(config->period_size);
+}
+
+/* Frames buffered in the driver when the PCM devices are full */
+static size_t out_kernel_buffer_frames(struct stream_out *out)
+{
+    if (out->deep_buffer_config != NULL)
+        return out->deep_buffer_config->period_size * out->deep_buffer_config->period_count;
+    return out->config.period_size * out->config.period_count;
+}
+
+static int out_pcm_transfer(struct pcm_device *pcm_device, const void *data, unsigned int count)
+{
+    int ret;
+
+    if (!(pcm_device->flags & PCM_MMAP))
+        return pcm_write(pcm_device->pcm, data, count);
+
+    ret = pcm_mmap_write(pcm_device->pcm, data, count);
+    return ret < 0 ? ret : 0;
+}
+
+/* Restarts a playback PCM after an underrun without closing it: prepares it
+ * again and queues a period of silence, so that the data written next is not
+ * starved again before the DMA restarts. Underruns on every attempt are
+ * treated as a persistent error, left to the standby of out_write().
+ */
+static int out_pcm_recover_xrun(struct stream_out *out, struct pcm_device *pcm_device)
+{
+    unsigned int pad_bytes = pcm_frames_to_bytes(pcm_device->pcm, pcm_device->period_size);
+    unsigned int count;
+    int ret;
+
+    if (++pcm_device->xrun_streak > PCM_XRUN_MAX_RETRIES) {
+        ALOGE("%s: device %d keeps underrunning", __func__, pcm_device->pcm_profile->id);
+        return -EPIPE;
+    }
+    android_atomic_inc(&out->stats.xrun_recoveries);
+    ALOGW("%s: underrun on device %d", __func__, pcm_device->pcm_profile->id);
+
+    ret = pcm_prepare(pcm_device->pcm);
+    while (ret == 0 && pad_bytes > 0) {
+        count = pad_bytes < sizeof(pcm_xrun_silence) ? pad_bytes : sizeof(pcm_xrun_silence);
+        ret = out_pcm_transfer(pcm_device, pcm_xrun_silence, count);
+        pad_bytes -= count;
+    }
+    return ret;
+}
+
+/* The playback PCMs are opened with PCM_NORESTART so that underruns are reported here */
+static int out_pcm_write(struct stream_out *out, struct pcm_device *pcm_device,
+                         const void *data, unsigned int count)
+{
+    int ret;
+
+    while ((ret = out_pcm_transfer(pcm_device, data, count)) == -EPIPE) {
+        ret = out_pcm_recover_xrun(out, pcm_device);
+        if (ret != 0)
+            return ret;
+    }
+    if (ret == 0)
+        pcm_device->xrun_streak = 0;
+    return ret;
+}
+
+/* Converts the stream channel layout to the one of the PCM, in chunks that fit
+ * the remix buffer allocated when the PCM was opened.
+ */
+static int out_remix_and_write(struct stream_out *out, struct pcm_device *pcm_device,
+                               const void *buffer, size_t bytes)
+{
+    unsigned int channels = audio_channel_count_from_out_mask(out->channel_mask);
+    const int16_t *src = (const int16_t *)buffer;
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    size_t count;
+    int ret = 0;
+
+    if (pcm_device->remix_buffer == NULL)
+        return out_pcm_write(out, pcm_device, buffer, bytes);
+
+    while (frames > 0 && ret == 0) {
+        count = frames;
+        if (count > pcm_device->remix_frames)
+            count = pcm_device->remix_frames;
+        dsp_remix_s16(pcm_device->remix_buffer, pcm_device->channels, src, channels, count);
+        ret = out_pcm_write(out, pcm_device, pcm_device->remix_buffer,
+                            count * pcm_device->channels * sizeof(int16_t));
+        src += count * channels;
+        frames -= count;
+    }
+    return ret;
+}
+
+/* Resamples in chunks that fit the preallocated res_buffer */
+static int out_resample_and_write(struct stream_out *out, struct pcm_device *pcm_device,
+                                  const void *buffer, size_t frames)
+{
+    size_t frame_size = out_pcm_frame_size(out);
+    const int8_t *src = (const int8_t *)buffer;
+    size_t frames_wr = 0, frames_rq = 0;
+    int ret = 0;
+
+    while (frames > 0 && ret == 0) {
+        frames_rq = frames;
+        if (frames_rq > out->config.period_size)
+            frames_rq = out->config.period_size;
+        frames_wr = pcm_device->res_byte_count / frame_size;
+        ALOGVV("%s: resampler request frames = %d frame_size = %d",
+            __func__, frames_rq, frame_size);
+        pcm_device->resampler->resample_from_input(pcm_device->resampler,
+            (int16_t *)src, &frames_rq, (int16_t *)pcm_device->res_buffer, &frames_wr);
+        ALOGVV("%s: resampler output frames_= %d", __func__, frames_wr);
+        /* A pass may consume no input when the frames buffered in the
+         * resampler fill res_buffer: write them and go on with the same input.
+         * Only a pass without any progress is an error.
+         */
+        if (frames_rq == 0 && frames_wr == 0) {
+            ALOGE("%s: resampler stalled with %zu frames left", __func__, frames);
+            return -EIO;
+        }
+        if (frames_wr > 0)
+            ret = out_remix_and_write(out, pcm_device, (void *)pcm_device->res_buffer,
+                                      frames_wr * frame_size);
+        src += frames_rq * frame_size;
+        frames -= frames_rq;
+    }
+
+    return ret;
+}
+
+/* Writes one buffer to a single PCM device, resampling it if needed */
+static int out_write_pcm_device(struct stream_out *out, struct pcm_device *pcm_device,
+                                const void *buffer, size_t bytes)
+{
+    size_t frame_size = out_pcm_frame_size(out);
+
+    ALOGVV("%s: writing buffer (%d bytes) to pcm device", __func__, bytes);
+    if (pcm_device->resampler && pcm_device->res_buffer)
+        return out_resample_and_write(out, pcm_device, buffer, bytes / frame_size);
+    return out_remix_and_write(out, pcm_device, buffer, bytes);
+}
+
+static void *pcm_device_worker_loop(void *context)
+{
+    struct pcm_device *pcm_device = (struct pcm_device *)context;
+    struct pcm_device_worker *worker = &pcm_device->worker;
+    int status;
+
+    prctl(PR_SET_NAME, (unsigned long)"PCM Fan-out", 0, 0, 0);
+    thread_placement_apply(THREAD_ROLE_PLAYBACK_WORKER);
+
+    pthread_mutex_lock(&worker->lock);
+    for (;;) {
+        if (worker->exit)
+            break;
+        if (!worker->pending) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        status = out_write_pcm_device(worker->out, pcm_device, worker->buffer, worker->bytes);
+
+        pthread_mutex_lock(&worker->lock);
+        pcm_device->status = status;
+        worker->pending = false;
+        pthread_cond_broadcast(&worker->cond);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+static void pcm_device_worker_start(struct stream_out *out, struct pcm_device *pcm_device)
+{
+    struct pcm_device_worker *worker = &pcm_device->worker;
+
+    worker->out = out;
+    worker->exit = false;
+    worker->pending = false;
+    pthread_mutex_init(&worker->lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&worker->cond, (const pthread_condattr_t *) NULL);
+    if (pthread_create(&worker->thread, (const pthread_attr_t *) NULL,
+                       pcm_device_worker_loop, pcm_device) != 0) {
+        /* the device is then written from the caller thread */
+        ALOGW("%s: could not create worker for pcm device %d", __func__,
+              pcm_device->pcm_profile->id);
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->lock);
+        return;
+    }
+    worker->active = true;
+}
+
+/* Posts a buffer to a PCM device worker. The buffer must stay valid until
+ * pcm_device_worker_wait() returns. */
+static void pcm_device_worker_post(struct pcm_device *pcm_device, const void *buffer, size_t bytes)
+{
+    struct pcm_device_worker *worker = &pcm_device->worker;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->buffer = buffer;
+    worker->bytes = bytes;
+    worker->pending = true;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static int pcm_device_worker_wait(struct pcm_device *pcm_device)
+{
+    struct pcm_device_worker *worker = &pcm_device->worker;
+    int status;
+
+    pthread_mutex_lock(&worker->lock);
+    while (worker->pending)
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    status = pcm_device->status;
+    pthread_mutex_unlock(&worker->lock);
+
+    return status;
+}
+
+/* The low latency output uses the mmap/NOIRQ path when opened with the FAST flag:
+ * the HAL then waits for avail_min frames instead of relying on period interrupts.
+ */
+static bool out_use_mmap(struct stream_out *out, struct pcm_device *pcm_device)
+{
+    return out->usecase == USECASE_AUDIO_PLAYBACK &&
+           (out->flags & AUDIO_OUTPUT_FLAG_FAST) &&
+           !out->mmap_refused &&
+           pcm_device->pcm_profile == &pcm_device_playback;
+}
+
+static int out_open_pcm_devices(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    struct pcm_config config;
+    int ret = 0;
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        ALOGV("%s: Opening PCM device card_id(%d) device_id(%d)",
               __func__, pcm_device->pcm_profile->card, pcm_device->pcm_profile->id);
 
-        pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                               PCM_OUT | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+        pcm_device->pcm = NULL;
+        if (out_use_mmap(out, pcm_device)) {
+            pcm_device->flags = PCM_OUT | PCM_MONOTONIC | PCM_NORESTART | PCM_MMAP | PCM_NOIRQ;
+            out_get_pcm_config(out, pcm_device, &config);
+            pcm_device->pcm = pcm_pool_get(out->dev, pcm_device->pcm_profile,
+                                           pcm_device->flags, &config);
+            if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
+                ALOGW("%s: mmap mode refused, using read/write mode: %s",
+                      __func__, pcm_get_error(pcm_device->pcm));
+                pcm_pool_put(out->dev, pcm_device->pcm_profile, pcm_device->pcm);
+                pcm_device->pcm = NULL;
+                out->mmap_refused = true;
+            }
+        }
+
+        if (pcm_device->pcm == NULL) {
+            pcm_device->flags = PCM_OUT | PCM_MONOTONIC | PCM_NORESTART;
+            out_get_pcm_config(out, pcm_device, &config);
+            pcm_device->pcm = pcm_pool_get(out->dev, pcm_device->pcm_profile,
+                                           pcm_device->flags, &config);
+        }
 
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
+            pcm_pool_put(out->dev, pcm_device->pcm_profile, pcm_device->pcm);
             pcm_device->pcm = NULL;
             ret = -EIO;
             goto error_open;
         }
+        pcm_device->channels = config.channels;
+        pcm_device->period_size = config.period_size;
+        pcm_device->xrun_streak = 0;
+        if (config.channels != audio_channel_count_from_out_mask(out->channel_mask)) {
+            ALOGV("%s: remixing %d channels to %d", __func__,
+                  audio_channel_count_from_out_mask(out->channel_mask), config.channels);
+            pcm_device->remix_frames = config.period_size;
+            pcm_device->remix_buffer = (int16_t *)malloc(pcm_device->remix_frames *
+                                                         config.channels * sizeof(int16_t));
+            if (pcm_device->remix_buffer == NULL) {
+                ret = -ENOMEM;
+                goto error_open;
+            }
+        }
         /*
         * If the stream rate differs from the PCM rate, we need to
         * create a resampler.
         */
         if (out->sample_rate != pcm_device->pcm_profile->config.rate) {
-            ALOGV("%s: create_resampler(), pcm_device_card(%d), pcm_device_id(%d), \
+            ALOGV("%s: hal_create_resampler(), pcm_device_card(%d), pcm_device_id(%d), \
                     out_rate(%d), device_rate(%d)",__func__,
                     pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
                     out->sample_rate, pcm_device->pcm_profile->config.rate);
-            ret = create_resampler(out->sample_rate,
+            ret = hal_create_resampler(out->sample_rate,
                     pcm_device->pcm_profile->config.rate,
                     audio_channel_count_from_out_mask(out->channel_mask),
                     RESAMPLER_QUALITY_DEFAULT,
@@ -2361,6 +3818,18 @@ static int out_open_pcm_devices(struct stream_out *out)
             pcm_device->res_buffer = NULL;
         }
     }
+    if (out_alloc_res_buffers(out) != 0) {
+        ALOGE("%s: could not allocate resampler buffers", __func__);
+        ret = -ENOMEM;
+        goto error_open;
+    }
+
+    /* the first device is written by the caller, the others by their own worker */
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (node != list_head(&out->pcm_dev_list))
+            pcm_device_worker_start(out, pcm_device);
+    }
     return ret;
 
 error_open:
@@ -2430,26 +3899,58 @@ static int stop_output_stream(struct stream_out *out)
     return ret;
 }
 
+static const struct pcm_config *out_select_deep_buffer_config(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    if (adev->adaptive_deep_buffer && adev->screen_off)
+        return &pcm_config_deep_buffer_screen_off;
+    return &pcm_config_deep_buffer;
+}
+
 static int start_output_stream(struct stream_out *out)
 {
     int ret = 0;
     struct audio_device *adev = out->dev;
+#ifdef HDMI_PCM_DEVICE
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+#endif
 
     ALOGV("%s: enter: usecase(%d: %s) devices(%#x) channels(%d)",
           __func__, out->usecase, use_case_table[out->usecase], out->devices, out->config.channels);
+    if (adev->latency_measuring) {
+        ALOGW("%s: latency measurement in progress", __func__);
+        return -EBUSY;
+    }
+    /* follow a move of the audio interrupt, out of the write path */
+    thread_placement_refresh();
+
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        /* real playback takes over: stop the warm-up keep-alive and release its PCM */
+        dummybuf_thread_close(adev);
+    }
 
     enable_output_path_l(out);
 
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER)
+        out->deep_buffer_config = out_select_deep_buffer_config(out);
+
     if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         out->compr = NULL;
+#ifdef HDMI_PCM_DEVICE
+        if (out->devices & AUDIO_DEVICE_OUT_AUX_DIGITAL)
+            hdmi_update_caps_l(adev);
+#endif
         ret = out_open_pcm_devices(out);
         if (ret != 0)
             goto error_open;
-#ifdef PREPROCESSING_ENABLED
-        out->echo_reference = NULL;
-        out->echo_reference_generation = adev->echo_reference_generation;
-        if (adev->echo_reference != NULL)
-            out->echo_reference = adev->echo_reference;
+#ifdef HDMI_PCM_DEVICE
+        list_for_each(node, &out->pcm_dev_list) {
+            pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+            if (pcm_device->pcm_profile == &pcm_device_hdmi_multi)
+                set_hdmi_channels(adev, pcm_device->channels);
+        }
 #endif
     } else {
         out->compr = compress_open(COMPRESS_CARD, COMPRESS_DEVICE,
@@ -2508,6 +4009,10 @@ static int start_voice_call(struct audio_device *adev)
     struct audio_usecase *uc_info;
 
     ALOGV("%s: enter", __func__);
+    if (adev->latency_measuring) {
+        ALOGW("%s: latency measurement in progress", __func__);
+        return -EBUSY;
+    }
 
     uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
     uc_info->id = USECASE_VOICE_CALL;
@@ -2635,78 +4140,586 @@ static int out_set_format(struct audio_stream *stream, audio_format_t format)
     return -ENOSYS;
 }
 
-static int do_out_standby_l(struct stream_out *out)
+#ifdef PREPROCESSING_ENABLED
+/* Returns the published echo reference, valid until out_echo_reference_release().
+ * Lock free, see put_echo_reference(). The echo reference is created with the
+ * format of the primary output, the only one writing to it.
+ */
+static struct echo_reference_itfe *out_echo_reference_acquire(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
-    int status = 0;
 
-    out->standby = true;
-    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
-        out_close_pcm_devices(out);
+    if (!(out->flags & AUDIO_OUTPUT_FLAG_PRIMARY))
+        return NULL;
+    android_atomic_release_store(1, &out->echo_reference_writing);
+    android_memory_barrier();
+    if (!android_atomic_acquire_load(&adev->echo_reference_published))
+        return NULL;
+    return adev->echo_reference;
+}
+
+static void out_echo_reference_release(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    if (!(out->flags & AUDIO_OUTPUT_FLAG_PRIMARY))
+        return;
+    android_atomic_release_store(0, &out->echo_reference_writing);
+    android_memory_barrier();
+    if (android_atomic_acquire_load(&adev->echo_reference_waiting)) {
+        pthread_mutex_lock(&adev->echo_reference_lock);
+        pthread_cond_broadcast(&adev->echo_reference_cond);
+        pthread_mutex_unlock(&adev->echo_reference_lock);
+    }
+}
+#endif
+
+/* must be called with out->lock locked or from the writer thread while not paused */
+static int out_write_pcm_devices(struct stream_out *out, const void *buffer, size_t bytes)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    int64_t start_ns = get_monotonic_ns();
+    int ret = 0;
+#ifdef PREPROCESSING_ENABLED
+    size_t frame_size = out_pcm_frame_size(out);
+    size_t in_frames = bytes / frame_size;
+    size_t out_frames = in_frames;
+    struct echo_reference_itfe *reference = out_echo_reference_acquire(out);
+#endif
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm) {
 #ifdef PREPROCESSING_ENABLED
-        /* stop writing to echo reference */
-        if (out->echo_reference != NULL) {
-            out->echo_reference->write(out->echo_reference, NULL);
-            if (out->echo_reference_generation != adev->echo_reference_generation) {
-                ALOGV("%s: release_echo_reference %p", __func__, out->echo_reference);
-                release_echo_reference(out->echo_reference);
-                out->echo_reference_generation = adev->echo_reference_generation;
+            if (reference != NULL && pcm_device->pcm_profile->devices != SND_DEVICE_OUT_SPEAKER) {
+                struct echo_reference_buffer b;
+                b.raw = (void *)buffer;
+                b.frame_count = in_frames;
+
+                get_playback_delay(out, out_frames, &b);
+                reference->write(reference, &b);
+                out->echo_reference = reference;
             }
-            out->echo_reference = NULL;
+#endif
+            if (pcm_device->worker.active)
+                pcm_device_worker_post(pcm_device, buffer, bytes);
         }
+    }
+#ifdef PREPROCESSING_ENABLED
+    out_echo_reference_release(out);
 #endif
-    } else {
-        stop_compressed_output_l(out);
-        out->gapless_mdata.encoder_delay = 0;
-        out->gapless_mdata.encoder_padding = 0;
-        if (out->compr != NULL) {
-            compress_close(out->compr);
-            out->compr = NULL;
+
+    /* all devices are written concurrently: a slow sink does not delay the others */
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm && !pcm_device->worker.active) {
+            pcm_device->status = out_write_pcm_device(out, pcm_device, buffer, bytes);
+            if (pcm_device->status != 0)
+                ret = pcm_device->status;
         }
     }
-    status = stop_output_stream(out);
 
-    return status;
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm && pcm_device->worker.active) {
+            if (pcm_device_worker_wait(pcm_device) != 0) {
+                ALOGV("%s: pcm device %d write error %d", __func__,
+                      pcm_device->pcm_profile->id, pcm_device->status);
+                ret = pcm_device->status;
+            }
+        }
+    }
+    stream_stats_pcm_transfer(&out->stats, &out->config, start_ns, ret);
+    return ret;
 }
 
-static int out_standby(struct audio_stream *stream)
+static void *out_writer_thread_loop(void *context)
 {
-    struct stream_out *out = (struct stream_out *)stream;
-    struct audio_device *adev = out->dev;
+    struct stream_out *out = (struct stream_out *) context;
+    uint32_t rd, wr;
+    size_t offset, frames;
+    int status;
+    int tid;
 
-    ALOGV("%s: enter: usecase(%d: %s)", __func__,
-          out->usecase, use_case_table[out->usecase]);
-    lock_output_stream(out);
-    if (!out->standby) {
-        pthread_mutex_lock(&adev->lock);
-        do_out_standby_l(out);
-        pthread_mutex_unlock(&adev->lock);
+    prctl(PR_SET_NAME, (unsigned long)"Primary Writer", 0, 0, 0);
+    tid = thread_placement_apply(THREAD_ROLE_PLAYBACK_WRITER);
+
+    ALOGV("%s", __func__);
+    pthread_mutex_lock(&out->writer_lock);
+    for (;;) {
+        if (out->writer_exit)
+            break;
+
+        rd = (uint32_t)out->ring_rd;
+        wr = (uint32_t)android_atomic_acquire_load(&out->ring_wr);
+        if (wr == rd || out->writer_paused) {
+            pthread_cond_wait(&out->writer_cond, &out->writer_lock);
+            continue;
+        }
+
+        offset = rd & (out->ring_frames - 1);
+        frames = wr - rd;
+        if (frames > out->ring_frames - offset)
+            frames = out->ring_frames - offset;
+        if (frames > out->config.period_size)
+            frames = out->config.period_size;
+
+        out->writer_busy = true;
+        pthread_mutex_unlock(&out->writer_lock);
+
+        status = out_write_pcm_devices(out, out->ring_buf + offset * out->ring_frame_size,
+                                       frames * out->ring_frame_size);
+
+        pthread_mutex_lock(&out->writer_lock);
+        out->writer_busy = false;
+        if (status != 0)
+            out->writer_status = status;
+        android_atomic_release_store((int32_t)(rd + frames), &out->ring_rd);
+        pthread_cond_broadcast(&out->writer_cond);
     }
-    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&out->writer_lock);
+
+    if (tid > 0)
+        thread_placement_remove(tid);
     ALOGV("%s: exit", __func__);
-    return 0;
+    return NULL;
 }
 
-static int out_dump(const struct audio_stream *stream, int fd)
+static int create_out_writer_thread(struct stream_out *out)
 {
-    (void)stream;
-    (void)fd;
+    int ret;
+
+    out->ring_frame_size = out_pcm_frame_size(out);
+    out->ring_frames = 1;
+    while (out->ring_frames < out->config.period_size * ASYNC_WRITER_PERIOD_COUNT)
+        out->ring_frames <<= 1;
+    out->ring_buf = (int8_t *)calloc(out->ring_frames, out->ring_frame_size);
+    if (out->ring_buf == NULL)
+        return -ENOMEM;
+    out->ring_rd = 0;
+    out->ring_wr = 0;
+    out->writer_exit = false;
+    out->writer_paused = false;
+    out->writer_busy = false;
+    out->writer_status = 0;
+
+    pthread_mutex_init(&out->writer_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&out->writer_cond, (const pthread_condattr_t *) NULL);
+
+    /* scheduled by thread_placement_apply() */
+    ret = pthread_create(&out->writer_thread, (const pthread_attr_t *) NULL,
+                         out_writer_thread_loop, out);
+    if (ret != 0) {
+        ALOGE("%s: could not create writer thread (%d)", __func__, ret);
+        pthread_cond_destroy(&out->writer_cond);
+        pthread_mutex_destroy(&out->writer_lock);
+        free(out->ring_buf);
+        out->ring_buf = NULL;
+        return -ret;
+    }
+    out->writer_enabled = true;
+    ALOGV("%s: ring of %zu frames", __func__, out->ring_frames);
 
     return 0;
 }
 
-static int parse_compress_metadata(struct stream_out *out, struct str_parms *parms)
+static void destroy_out_writer_thread(struct stream_out *out)
 {
-    int ret = 0;
-    char value[32];
-    struct compr_gapless_mdata tmp_mdata;
+    if (!out->writer_enabled)
+        return;
 
-    if (!out || !parms) {
-        return -EINVAL;
-    }
+    pthread_mutex_lock(&out->writer_lock);
+    out->writer_exit = true;
+    pthread_cond_broadcast(&out->writer_cond);
+    pthread_mutex_unlock(&out->writer_lock);
+    pthread_join(out->writer_thread, (void **) NULL);
 
-    ret = str_parms_get_str(parms, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, value, sizeof(value));
-    if (ret >= 0) {
+    pthread_cond_destroy(&out->writer_cond);
+    pthread_mutex_destroy(&out->writer_lock);
+    free(out->ring_buf);
+    out->ring_buf = NULL;
+    out->writer_enabled = false;
+}
+
+/* must be called with out->lock locked.
+ * Returns once the writer thread no longer touches the PCM devices. */
+static void out_writer_pause_l(struct stream_out *out)
+{
+    pthread_mutex_lock(&out->writer_lock);
+    out->writer_paused = true;
+    while (out->writer_busy)
+        pthread_cond_wait(&out->writer_cond, &out->writer_lock);
+    pthread_mutex_unlock(&out->writer_lock);
+}
+
+/* must be called with out->lock locked */
+static void out_writer_resume_l(struct stream_out *out, bool flush)
+{
+    pthread_mutex_lock(&out->writer_lock);
+    if (flush) {
+        out->ring_rd = 0;
+        android_atomic_release_store(0, &out->ring_wr);
+        out->writer_status = 0;
+    }
+    out->writer_paused = false;
+    pthread_cond_broadcast(&out->writer_cond);
+    pthread_mutex_unlock(&out->writer_lock);
+}
+
+/* must be called with out->lock locked.
+ * Blocks only when the ring is full. Returns the last error reported by the writer. */
+static int out_writer_queue_l(struct stream_out *out, const void *buffer, size_t bytes)
+{
+    const int8_t *src = (const int8_t *)buffer;
+    size_t frames = bytes / out->ring_frame_size;
+    size_t offset, avail, count;
+    uint32_t rd, wr;
+    int status = 0;
+
+    while (frames > 0 && status == 0) {
+        wr = (uint32_t)out->ring_wr;
+        rd = (uint32_t)android_atomic_acquire_load(&out->ring_rd);
+        avail = out->ring_frames - (wr - rd);
+        if (avail == 0) {
+            pthread_mutex_lock(&out->writer_lock);
+            while ((uint32_t)out->ring_wr - (uint32_t)out->ring_rd == out->ring_frames &&
+                    out->writer_status == 0)
+                pthread_cond_wait(&out->writer_cond, &out->writer_lock);
+            status = out->writer_status;
+            pthread_mutex_unlock(&out->writer_lock);
+            continue;
+        }
+
+        offset = wr & (out->ring_frames - 1);
+        count = frames;
+        if (count > avail)
+            count = avail;
+        if (count > out->ring_frames - offset)
+            count = out->ring_frames - offset;
+        memcpy(out->ring_buf + offset * out->ring_frame_size, src,
+               count * out->ring_frame_size);
+        android_atomic_release_store((int32_t)(wr + count), &out->ring_wr);
+        src += count * out->ring_frame_size;
+        frames -= count;
+
+        pthread_mutex_lock(&out->writer_lock);
+        pthread_cond_broadcast(&out->writer_cond);
+        pthread_mutex_unlock(&out->writer_lock);
+    }
+
+    pthread_mutex_lock(&out->writer_lock);
+    status = out->writer_status;
+    out->writer_status = 0;
+    pthread_mutex_unlock(&out->writer_lock);
+
+    return status;
+}
+
+/* frames accepted by out_write() but not yet written to the PCM devices */
+static size_t out_writer_queued_frames(struct stream_out *out)
+{
+    if (!out->writer_enabled)
+        return 0;
+    return (uint32_t)android_atomic_acquire_load(&out->ring_wr) -
+           (uint32_t)android_atomic_acquire_load(&out->ring_rd);
+}
+
+#ifdef PREPROCESSING_ENABLED
+/* stop writing to echo reference
+ * must be called with out->lock and adev->lock locked, the latter keeps the
+ * echo reference published.
+ */
+static void out_stop_echo_reference_l(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    struct echo_reference_itfe *reference = adev->echo_reference;
+
+    if (out->echo_reference != NULL && out->echo_reference == reference)
+        reference->write(reference, NULL);
+    out->echo_reference = NULL;
+}
+#endif
+
+static int do_out_standby_l(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    int status = 0;
+
+    out->standby = true;
+    out->warm_standby = false;
+    out->stats.standby_count++;
+    out->stats.last_pcm_ns = 0;
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        if (out->writer_enabled)
+            out_writer_pause_l(out);
+        out_close_pcm_devices(out);
+        if (out->devices & AUDIO_DEVICE_OUT_SPEAKER)
+            amp_notify_standby(adev);
+#ifdef PREPROCESSING_ENABLED
+        out_stop_echo_reference_l(out);
+#endif
+        /* queued data is dropped like the data pending in the kernel buffer */
+        if (out->writer_enabled)
+            out_writer_resume_l(out, true);
+    } else {
+        stop_compressed_output_l(out);
+        out->gapless_mdata.encoder_delay = 0;
+        out->gapless_mdata.encoder_padding = 0;
+        if (out->compr != NULL) {
+            compress_close(out->compr);
+            out->compr = NULL;
+        }
+    }
+    status = stop_output_stream(out);
+
+    return status;
+}
+
+/* Stops the PCM devices but keeps them open and prepared, and keeps the usecase
+ * and its route, so that leaving standby only restarts the PCM devices. The
+ * data queued in the driver is dropped as with a full standby.
+ * must be called with out->lock and adev->lock locked.
+ */
+static void out_enter_warm_standby_l(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+
+    out->standby = true;
+    out->warm_standby = true;
+    out->stats.warm_standby_count++;
+    out->stats.last_pcm_ns = 0;
+    if (out->writer_enabled)
+        out_writer_pause_l(out);
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm) {
+            pcm_stop(pcm_device->pcm);
+            pcm_prepare(pcm_device->pcm);
+        }
+        if (pcm_device->resampler)
+            pcm_device->resampler->reset(pcm_device->resampler);
+    }
+    if (out->devices & AUDIO_DEVICE_OUT_SPEAKER)
+        amp_notify_standby(adev);
+#ifdef PREPROCESSING_ENABLED
+    out_stop_echo_reference_l(out);
+#endif
+    if (out->writer_enabled)
+        out_writer_resume_l(out, true);
+
+    out->warm_standby_deadline_ns = get_monotonic_ns() +
+                                    (int64_t)adev->warm_standby_ms * 1000000LL;
+    pthread_cond_signal(&out->warm_standby_cond);
+}
+
+/* Waits for the PCM devices of a running output to play the frames queued in
+ * the driver, which ends on a period boundary. Bounded by the kernel buffer.
+ * must be called with out->lock locked and the writer paused.
+ */
+static void out_drain_pcm_devices_l(struct stream_out *out)
+{
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    struct timespec ts;
+    unsigned int avail, buffer_size;
+    int tries;
+
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm == NULL)
+            continue;
+        buffer_size = pcm_get_buffer_size(pcm_device->pcm);
+        for (tries = 0; tries < PCM_DRAIN_MAX_TRIES; tries++) {
+            if (pcm_get_htimestamp(pcm_device->pcm, &avail, &ts) != 0 || avail >= buffer_size)
+                break;
+            usleep((int64_t)(buffer_size - avail) * 1000000LL /
+                   pcm_device->pcm_profile->config.rate);
+        }
+    }
+}
+
+/* Moves a deep buffer output to the PCM configuration of the screen state. A
+ * running output is drained first and reopened on the period boundary, so the
+ * data queued in the driver and in the writer ring is played, not dropped.
+ * must be called with out->lock locked.
+ */
+static int out_update_deep_buffer_config_l(struct stream_out *out)
+{
+    const struct pcm_config *config;
+    int ret;
+
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_DEEP_BUFFER)
+        return 0;
+    config = out_select_deep_buffer_config(out);
+    if (config == out->deep_buffer_config)
+        return 0;
+
+    ALOGV("%s: period size %u -> %u", __func__,
+          out->deep_buffer_config->period_size, config->period_size);
+    if (out->writer_enabled)
+        out_writer_pause_l(out);
+    if (!out->standby)
+        out_drain_pcm_devices_l(out);
+    out_close_pcm_devices(out);
+    out->deep_buffer_config = config;
+    ret = out_open_pcm_devices(out);
+    if (out->writer_enabled)
+        out_writer_resume_l(out, false);
+    return ret;
+}
+
+/* Restarts from warm standby, in the PCM configuration of the screen state.
+ * must be called with out->lock and adev->lock locked.
+ */
+static int out_exit_warm_standby_l(struct stream_out *out)
+{
+    int ret;
+
+    out->warm_standby = false;
+    ret = out_update_deep_buffer_config_l(out);
+    if (ret != 0)
+        do_out_standby_l(out);
+    return ret;
+}
+
+/* Closes the output once it stayed in warm standby for the whole grace period */
+static void *warm_standby_thread_loop(void *context)
+{
+    struct stream_out *out = (struct stream_out *)context;
+    struct audio_device *adev = out->dev;
+    struct timespec ts;
+
+    prctl(PR_SET_NAME, (unsigned long)"Warm Standby", 0, 0, 0);
+
+    lock_output_stream(out);
+    while (!out->warm_standby_thread_exit) {
+        if (!out->warm_standby) {
+            pthread_cond_wait(&out->warm_standby_cond, &out->lock);
+            continue;
+        }
+        if (get_monotonic_ns() < out->warm_standby_deadline_ns) {
+            ts.tv_sec = out->warm_standby_deadline_ns / 1000000000LL;
+            ts.tv_nsec = out->warm_standby_deadline_ns % 1000000000LL;
+            pthread_cond_timedwait(&out->warm_standby_cond, &out->lock, &ts);
+            continue;
+        }
+        ALOGV("%s: closing usecase %s", __func__, use_case_table[out->usecase]);
+        lock_audio_device(adev);
+        do_out_standby_l(out);
+        pthread_mutex_unlock(&adev->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return NULL;
+}
+
+static void create_warm_standby_thread(struct stream_out *out)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&out->warm_standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    out->warm_standby_thread_exit = false;
+    if (pthread_create(&out->warm_standby_thread, (const pthread_attr_t *) NULL,
+                       warm_standby_thread_loop, out) != 0) {
+        ALOGW("%s: warm standby disabled", __func__);
+        pthread_cond_destroy(&out->warm_standby_cond);
+        return;
+    }
+    out->warm_standby_enabled = true;
+}
+
+static void destroy_warm_standby_thread(struct stream_out *out)
+{
+    if (!out->warm_standby_enabled)
+        return;
+
+    lock_output_stream(out);
+    out->warm_standby_thread_exit = true;
+    pthread_cond_signal(&out->warm_standby_cond);
+    pthread_mutex_unlock(&out->lock);
+    pthread_join(out->warm_standby_thread, (void **) NULL);
+    pthread_cond_destroy(&out->warm_standby_cond);
+    out->warm_standby_enabled = false;
+}
+
+/* Puts the output in standby. Unless cold is set, the PCM devices and the route
+ * are kept for the warm standby grace period.
+ */
+static void out_do_standby(struct stream_out *out, bool cold)
+{
+    struct audio_device *adev = out->dev;
+
+    lock_output_stream(out);
+    if (!out->standby || (cold && out->warm_standby)) {
+        lock_audio_device(adev);
+        if (!cold && out->warm_standby_enabled)
+            out_enter_warm_standby_l(out);
+        else
+            do_out_standby_l(out);
+        pthread_mutex_unlock(&adev->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
+static int out_standby(struct audio_stream *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+
+    ALOGV("%s: enter: usecase(%d: %s)", __func__,
+          out->usecase, use_case_table[out->usecase]);
+    out_do_standby(out, false);
+    ALOGV("%s: exit", __func__);
+    return 0;
+}
+
+static int out_dump(const struct audio_stream *stream, int fd)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct offload_cmd_stats stats;
+    uint32_t processed;
+
+    /* read without the stream lock so that a stuck write does not block the dump */
+    dprintf(fd, "HAL output %s:\n", use_case_table[out->usecase]);
+    stream_stats_dump(&out->stats, fd);
+
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD)
+        return 0;
+
+    lock_output_stream(out);
+    stats = out->offload_stats;
+    processed = stats.sent - out->offload_cmd_count;
+    pthread_mutex_unlock(&out->lock);
+
+    dprintf(fd, "Offload commands: sent %u coalesced %u max depth %u/%d\n",
+            stats.sent, stats.coalesced, stats.max_depth, OFFLOAD_CMD_QUEUE_SIZE);
+    dprintf(fd, "  queue delay avg %lld us max %lld us\n",
+            processed ? (long long)(stats.queue_ns_total / processed / 1000) : 0LL,
+            (long long)(stats.queue_ns_max / 1000));
+    dprintf(fd, "  buffer waits %u avg %lld us max %lld us\n", stats.waits,
+            stats.waits ? (long long)(stats.wait_ns_total / stats.waits / 1000) : 0LL,
+            (long long)(stats.wait_ns_max / 1000));
+
+    return 0;
+}
+
+static int parse_compress_metadata(struct stream_out *out, struct str_parms *parms)
+{
+    int ret = 0;
+    char value[32];
+    struct compr_gapless_mdata tmp_mdata;
+
+    if (!out || !parms) {
+        return -EINVAL;
+    }
+
+    ret = str_parms_get_str(parms, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, value, sizeof(value));
+    if (ret >= 0) {
         tmp_mdata.encoder_delay = atoi(value); /* what is a good limit check? */
     } else {
         return -EINVAL;
@@ -2753,7 +4766,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         val = atoi(value);
         pthread_mutex_lock(&adev->lock_inputs);
         lock_output_stream(out);
-        pthread_mutex_lock(&adev->lock);
+        lock_audio_device(adev);
 #ifdef PREPROCESSING_ENABLED
         if (((int)out->devices != val) && (val != 0) && (!out->standby) &&
             (out->usecase == USECASE_AUDIO_PLAYBACK)) {
@@ -2767,6 +4780,9 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         }
 #endif
         if (val != 0) {
+            /* the route kept in warm standby is for the previous devices */
+            if (out->warm_standby && (int)out->devices != val)
+                do_out_standby_l(out);
             out->devices = val;
 
             if (!out->standby) {
@@ -2822,7 +4838,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         if (in) {
             /* The lock on adev->lock_inputs prevents input stream from being closed */
             lock_input_stream(in);
-            pthread_mutex_lock(&adev->lock);
+            lock_audio_device(adev);
             LOG_ALWAYS_FATAL_IF(in != adev->active_input);
             do_in_standby_l(in);
             pthread_mutex_unlock(&adev->lock);
@@ -2886,12 +4902,17 @@ static char* out_get_parameters(const struct audio_stream *stream, const char *k
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
+    uint32_t render_latency_ms = render_latency(out) / 1000;
 
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD)
-        return COMPRESS_OFFLOAD_PLAYBACK_LATENCY;
+        return COMPRESS_OFFLOAD_PLAYBACK_LATENCY + render_latency_ms;
+
+    if (out->writer_enabled)
+        return ((out_kernel_buffer_frames(out) + out->ring_frames) * 1000) /
+               (out->config.rate) + render_latency_ms;
 
-    return (out->config.period_count * out->config.period_size * 1000) /
-           (out->config.rate);
+    return (out_kernel_buffer_frames(out) * 1000) /
+           (out->config.rate) + render_latency_ms;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -2943,69 +4964,129 @@ static void *tfa9895_config_thread(void *context)
     pthread_mutex_lock(&adev->tfa9895_lock);
     adev->tfa9895_init =
         adev->htc_acoustic_set_amp_mode(adev->mode, AUDIO_DEVICE_OUT_SPEAKER, 0, 0, false);
+    pthread_mutex_unlock(&adev->tfa9895_lock);
     if (!adev->tfa9895_init) {
         ALOGE("set_amp_mode failed, need to re-config again");
-        adev->tfa9895_mode_change |= 0x1;
+        amp_request_config(adev);
     }
-    ALOGI("@@##tfa9895_config_thread Done!! tfa9895_mode_change=%d", adev->tfa9895_mode_change);
-    pthread_mutex_unlock(&adev->tfa9895_lock);
+    ALOGI("@@##tfa9895_config_thread Done!! amp_state=%d", adev->amp_state);
     dummybuf_thread_close(adev);
     return NULL;
 }
 
-static int fast_set_affinity(pid_t tid) {
-    cpu_set_t cpu_set;
-    int cpu_num;
-    const char *irq_procfs = "/proc/asound/irq_affinity";
-    FILE *fp;
+/* Plays frames of silence through the same path as the data. They are not
+ * counted in out->written: the presentation position only counts the frames
+ * of the client.
+ * must be called with out->lock locked.
+ */
+static int out_write_silence_l(struct stream_out *out, size_t frames)
+{
+    size_t frame_size = out_pcm_frame_size(out);
+    size_t count;
+    int ret = 0;
 
-    if ((fp = fopen(irq_procfs, "r")) == NULL) {
-        ALOGW("Procfs node %s not found", irq_procfs);
-        return -1;
+    while (frames > 0 && ret == 0) {
+        count = sizeof(pcm_xrun_silence) / frame_size;
+        if (count > frames)
+            count = frames;
+        if (out->writer_enabled)
+            ret = out_writer_queue_l(out, pcm_xrun_silence, count * frame_size);
+        else
+            ret = out_write_pcm_devices(out, pcm_xrun_silence, count * frame_size);
+        frames -= count;
     }
+    return ret;
+}
+
+/* Writes 16 bit data to the PCM devices of a non offloaded output.
+ * must be called with out->lock locked.
+ */
+static int out_write_s16_l(struct stream_out *out, const void *buffer, size_t bytes)
+{
+    struct audio_device *adev = out->dev;
+    size_t frames = bytes / out_pcm_frame_size(out);
+    size_t settle_frames, pad_frames;
+    int ret;
+
+    /* the screen state changed since the deep buffer PCM devices were opened */
+    ret = out_update_deep_buffer_config_l(out);
+    if (ret != 0)
+        return ret;
 
-    if (fscanf(fp, "%d", &cpu_num) != 1) {
-        ALOGW("Couldn't read CPU id from procfs node %s", irq_procfs);
-        fclose(fp);
-        return -1;
+    /* Before the amplifier is configured, its I2S clock must have run for
+     * AMP_I2S_SETTLE_MS: the first speaker write delays the data by that much
+     * silence, once it went through the buffers, instead of replacing it.
+     */
+    if (out->devices & AUDIO_DEVICE_OUT_SPEAKER) {
+        settle_frames = out_kernel_buffer_frames(out) +
+                out->sample_rate * AMP_I2S_SETTLE_MS / 1000;
+        if (out->writer_enabled)
+            settle_frames += out->ring_frames;
+        pad_frames = amp_notify_playback(adev, frames, settle_frames);
+        if (pad_frames != 0) {
+            ret = out_write_silence_l(out, pad_frames);
+            if (ret != 0)
+                return ret;
+            amp_notify_playback(adev, pad_frames, settle_frames);
+        }
     }
-    fclose(fp);
+    if (out->muted)
+        memset((void *)buffer, 0, bytes);
+    if (out->writer_enabled)
+        ret = out_writer_queue_l(out, buffer, bytes);
+    else
+        ret = out_write_pcm_devices(out, buffer, bytes);
+    if (ret == 0)
+        out->written += frames;
+    return ret;
+}
+
+/* Requantizes a 24 bit or float buffer to 16 bit and writes it, at most
+ * out->convert_frames at a time.
+ * must be called with out->lock locked.
+ */
+static int out_convert_and_write_l(struct stream_out *out, const void *buffer, size_t bytes)
+{
+    unsigned int channels = audio_channel_count_from_out_mask(out->channel_mask);
+    size_t frame_size = audio_stream_out_frame_size(&out->stream);
+    struct dsp_dither *dither = out->dither_enabled ? &out->dither : NULL;
+    const int8_t *src = (const int8_t *)buffer;
+    size_t frames = bytes / frame_size;
+    size_t count;
+    int ret = 0;
 
-    CPU_ZERO(&cpu_set);
-    CPU_SET(cpu_num, &cpu_set);
-    return sched_setaffinity(tid, sizeof(cpu_set), &cpu_set);
+    while (frames > 0 && ret == 0) {
+        count = frames;
+        if (count > out->convert_frames)
+            count = out->convert_frames;
+        if (out->format == AUDIO_FORMAT_PCM_FLOAT)
+            dsp_float_to_s16(out->convert_buf, (const float *)src, count * channels, dither);
+        else
+            dsp_p24_to_s16(out->convert_buf, (const uint8_t *)src, count * channels, dither);
+        ret = out_write_s16_l(out, out->convert_buf, count * out_pcm_frame_size(out));
+        src += count * frame_size;
+        frames -= count;
+    }
+    return ret;
 }
 
-static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
-                         size_t bytes)
+static ssize_t do_out_write(struct audio_stream_out *stream, const void *buffer,
+                            size_t bytes)
 {
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
     ssize_t ret = 0;
     struct pcm_device *pcm_device;
     struct listnode *node;
-    size_t frame_size = audio_stream_out_frame_size(stream);
-    size_t frames_wr = 0, frames_rq = 0;
-    unsigned char *data = NULL;
-    struct pcm_config config;
 #ifdef PREPROCESSING_ENABLED
-    size_t in_frames = bytes / frame_size;
-    size_t out_frames = in_frames;
     struct stream_in *in = NULL;
 #endif
-    pid_t tid;
-    int err;
 
     lock_output_stream(out);
 
-    if (out->usecase == USECASE_AUDIO_PLAYBACK && !out->is_fastmixer_affinity_set) {
-        tid = gettid();
-        err = fast_set_affinity(tid);
-        if (err < 0) {
-            ALOGW("Couldn't set affinity for tid %d; error %d", tid, err);
-        }
-        out->is_fastmixer_affinity_set = true;
-    }
+    /* placed once, the writing thread does not change during the life of the stream */
+    if (out->usecase == USECASE_AUDIO_PLAYBACK && out->fast_tid == 0)
+        out->fast_tid = thread_placement_apply(THREAD_ROLE_FAST_PLAYBACK);
 
     if (out->standby) {
 #ifdef PREPROCESSING_ENABLED
@@ -3018,8 +5099,11 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
             goto false_alarm;
         }
 #endif
-        pthread_mutex_lock(&adev->lock);
-        ret = start_output_stream(out);
+        lock_audio_device(adev);
+        if (out->warm_standby)
+            ret = out_exit_warm_standby_l(out);
+        else
+            ret = start_output_stream(out);
         /* ToDo: If use case is compress offload should return 0 */
         if (ret != 0) {
             pthread_mutex_unlock(&adev->lock);
@@ -3054,7 +5138,7 @@ false_alarm:
 
         if (out->offload_state == OFFLOAD_STATE_PAUSED_FLUSHED) {
             ALOGV("start offload write from pause state");
-            pthread_mutex_lock(&adev->lock);
+            lock_audio_device(adev);
             enable_output_path_l(out);
             pthread_mutex_unlock(&adev->lock);
         }
@@ -3068,7 +5152,10 @@ false_alarm:
         ret = compress_write(out->compr, buffer, bytes);
         ALOGVV("%s: writing buffer (%d bytes) to compress device returned %d", __func__, bytes, ret);
         if (ret >= 0 && ret < (ssize_t)bytes) {
-            send_offload_cmd_l(out, OFFLOAD_CMD_WAIT_FOR_BUFFER);
+            int cmd_ret = send_offload_cmd_l(out, OFFLOAD_CMD_WAIT_FOR_BUFFER);
+            /* the framework waits for the write ready callback of this command */
+            LOG_ALWAYS_FATAL_IF(cmd_ret != 0, "%s: cannot queue the wait for buffer command",
+                                __func__);
         }
         if (out->offload_state != OFFLOAD_STATE_PLAYING) {
             compress_start(out->compr);
@@ -3083,140 +5170,10 @@ false_alarm:
 #endif
         return ret;
     } else {
-#ifdef PREPROCESSING_ENABLED
-        if (android_atomic_acquire_load(&adev->echo_reference_generation)
-                != out->echo_reference_generation) {
-            pthread_mutex_lock(&adev->lock);
-            if (out->echo_reference != NULL) {
-                ALOGV("%s: release_echo_reference %p", __func__, out->echo_reference);
-                release_echo_reference(out->echo_reference);
-            }
-            // note that adev->echo_reference_generation here can be different from the one
-            // tested above but it doesn't matter as we now have the adev mutex and it is consistent
-            // with what has been set by get_echo_reference() or put_echo_reference()
-            out->echo_reference_generation = adev->echo_reference_generation;
-            out->echo_reference = adev->echo_reference;
-            ALOGV("%s: update echo reference generation %d", __func__,
-                  out->echo_reference_generation);
-            pthread_mutex_unlock(&adev->lock);
-        }
-#endif
-
-        if (out->muted)
-            memset((void *)buffer, 0, bytes);
-        list_for_each(node, &out->pcm_dev_list) {
-            pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
-            if (pcm_device->resampler) {
-                if (bytes * pcm_device->pcm_profile->config.rate / out->sample_rate + frame_size
-                        > pcm_device->res_byte_count) {
-                    pcm_device->res_byte_count =
-                        bytes * pcm_device->pcm_profile->config.rate / out->sample_rate + frame_size;
-                    pcm_device->res_buffer =
-                        realloc(pcm_device->res_buffer, pcm_device->res_byte_count);
-                    ALOGV("%s: resampler res_byte_count = %zu", __func__,
-                        pcm_device->res_byte_count);
-                }
-                frames_rq = bytes / frame_size;
-                frames_wr = pcm_device->res_byte_count / frame_size;
-                ALOGVV("%s: resampler request frames = %d frame_size = %d",
-                    __func__, frames_rq, frame_size);
-                pcm_device->resampler->resample_from_input(pcm_device->resampler,
-                    (int16_t *)buffer, &frames_rq, (int16_t *)pcm_device->res_buffer, &frames_wr);
-                ALOGVV("%s: resampler output frames_= %d", __func__, frames_wr);
-            }
-            if (pcm_device->pcm) {
-#ifdef PREPROCESSING_ENABLED
-                if (out->echo_reference != NULL && pcm_device->pcm_profile->devices != SND_DEVICE_OUT_SPEAKER) {
-                    struct echo_reference_buffer b;
-                    b.raw = (void *)buffer;
-                    b.frame_count = in_frames;
-
-                    get_playback_delay(out, out_frames, &b);
-                    out->echo_reference->write(out->echo_reference, &b);
-                 }
-#endif
-                if (adev->tfa9895_mode_change == 0x1) {
-                    if (out->devices & AUDIO_DEVICE_OUT_SPEAKER) {
-                        pthread_mutex_lock(&adev->tfa9895_lock);
-                        data = (unsigned char *)
-                                calloc(pcm_frames_to_bytes(pcm_device->pcm, out->config.period_size),
-                                        sizeof(unsigned char));
-                        if (data) {
-                            int i;
-
-                            // reopen pcm with stop_threshold = INT_MAX/2
-                            memcpy(&config, &pcm_device->pcm_profile->config,
-                                    sizeof(struct pcm_config));
-                            config.stop_threshold = INT_MAX/2;
-
-                            if (pcm_device->pcm)
-                                pcm_close(pcm_device->pcm);
-
-                            for (i = 0; i < RETRY_NUMBER; i++) {
-                                pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
-                                        pcm_device->pcm_profile->id,
-                                        PCM_OUT | PCM_MONOTONIC, &config);
-                                if (pcm_device->pcm != NULL && pcm_is_ready(pcm_device->pcm))
-                                    break;
-                                else
-                                    usleep(10000);
-                            }
-                            if (i >= RETRY_NUMBER)
-                                ALOGE("%s: failed to reopen pcm device", __func__);
-
-                            if (pcm_device->pcm) {
-                                for (i = out->config.period_count; i > 0; i--)
-                                    pcm_write(pcm_device->pcm, (void *)data,
-                                           pcm_frames_to_bytes(pcm_device->pcm,
-                                           out->config.period_size));
-                                /* TODO: Hold on 100 ms and wait i2s signal ready
-                                     before giving dsp related i2c commands */
-                                usleep(100000);
-                                adev->tfa9895_mode_change &= ~0x1;
-                                ALOGD("@@##checking - 2: tfa9895_config_thread: "
-                                    "adev->tfa9895_mode_change=%d", adev->tfa9895_mode_change);
-                                adev->tfa9895_init =
-                                        adev->htc_acoustic_set_amp_mode(
-                                                adev->mode, AUDIO_DEVICE_OUT_SPEAKER, 0, 0, false);
-                            }
-                            free(data);
-
-                            // reopen pcm with normal stop_threshold
-                            if (pcm_device->pcm)
-                                pcm_close(pcm_device->pcm);
-
-                            for (i = 0; i < RETRY_NUMBER; i++) {
-                                pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
-                                        pcm_device->pcm_profile->id,
-                                        PCM_OUT | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
-                                if (pcm_device->pcm != NULL && pcm_is_ready(pcm_device->pcm))
-                                    break;
-                                else
-                                    usleep(10000);
-                            }
-                            if (i >= RETRY_NUMBER) {
-                                ALOGE("%s: failed to reopen pcm device, error return", __func__);
-                                pthread_mutex_unlock(&adev->tfa9895_lock);
-                                pthread_mutex_unlock(&out->lock);
-                                return -1;
-                            }
-                        }
-                    }
-                    pthread_mutex_unlock(&adev->tfa9895_lock);
-                }
-                ALOGVV("%s: writing buffer (%d bytes) to pcm device", __func__, bytes);
-                if (pcm_device->resampler && pcm_device->res_buffer)
-                    pcm_device->status =
-                        pcm_write(pcm_device->pcm, (void *)pcm_device->res_buffer,
-                            frames_wr * frame_size);
-                else
-                    pcm_device->status = pcm_write(pcm_device->pcm, (void *)buffer, bytes);
-                if (pcm_device->status != 0)
-                    ret = pcm_device->status;
-            }
-        }
-        if (ret == 0)
-            out->written += bytes / (out->config.channels * sizeof(short));
+        if (out->convert_buf != NULL)
+            ret = out_convert_and_write_l(out, buffer, bytes);
+        else
+            ret = out_write_s16_l(out, buffer, bytes);
     }
 
 exit:
@@ -3228,7 +5185,7 @@ exit:
             if (pcm_device->pcm && pcm_device->status != 0)
                 ALOGE("%s: error %zd - %s", __func__, ret, pcm_get_error(pcm_device->pcm));
         }
-        out_standby(&out->stream.common);
+        out_do_standby(out, true);
         usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
                out_get_sample_rate(&out->stream.common));
     }
@@ -3237,7 +5194,7 @@ exit:
     if (in) {
         /* The lock on adev->lock_inputs prevents input stream from being closed */
         lock_input_stream(in);
-        pthread_mutex_lock(&adev->lock);
+        lock_audio_device(adev);
         LOG_ALWAYS_FATAL_IF(in != adev->active_input);
         do_in_standby_l(in);
         pthread_mutex_unlock(&adev->lock);
@@ -3250,6 +5207,20 @@ exit:
     return bytes;
 }
 
+/* Called by a single thread, the audio flinger playback thread of the stream */
+static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
+                         size_t bytes)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int64_t start_ns = get_monotonic_ns();
+    int64_t start_cpu_ns = get_thread_cpu_ns();
+    ssize_t ret = do_out_write(stream, buffer, bytes);
+
+    audio_histogram_add(&out->stats.io_cpu, get_thread_cpu_ns() - start_cpu_ns);
+    audio_histogram_add(&out->stats.io, get_monotonic_ns() - start_ns);
+    return ret;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
@@ -3319,12 +5290,14 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                                                    struct pcm_device, stream_list_node);
 
             if (pcm_get_htimestamp(pcm_device->pcm, &avail, timestamp) == 0) {
-                size_t kernel_buffer_size = out->config.period_size * out->config.period_count;
+                size_t kernel_buffer_size = out_kernel_buffer_frames(out);
                 int64_t signed_frames = out->written - kernel_buffer_size + avail;
+                /* frames still queued for the writer thread have not reached the kernel */
+                signed_frames -= out_writer_queued_frames(out);
                 /* This adjustment accounts for buffering after app processor.
-                   It is based on estimated DSP latency per use case, rather than exact. */
+                   It is based on the latency measured for the current route. */
                 signed_frames -=
-                    (render_latency(out->usecase) * out->sample_rate / 1000000LL);
+                    (render_latency(out) * out->sample_rate / 1000000LL);
 
                 /* It would be unusual for this value to be negative, but check just in case ... */
                 if (signed_frames >= 0) {
@@ -3363,7 +5336,7 @@ static int out_pause(struct audio_stream_out* stream)
         if (out->compr != NULL && out->offload_state == OFFLOAD_STATE_PLAYING) {
             status = compress_pause(out->compr);
             out->offload_state = OFFLOAD_STATE_PAUSED;
-            pthread_mutex_lock(&out->dev->lock);
+            lock_audio_device(out->dev);
             status = disable_output_path_l(out);
             pthread_mutex_unlock(&out->dev->lock);
         }
@@ -3381,7 +5354,7 @@ static int out_resume(struct audio_stream_out* stream)
         status = 0;
         lock_output_stream(out);
         if (out->compr != NULL && out->offload_state == OFFLOAD_STATE_PAUSED) {
-            pthread_mutex_lock(&out->dev->lock);
+            lock_audio_device(out->dev);
             enable_output_path_l(out);
             pthread_mutex_unlock(&out->dev->lock);
             status = compress_resume(out->compr);
@@ -3486,7 +5459,7 @@ static int in_close_pcm_devices(struct stream_in *in)
         pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
         if (pcm_device) {
             if (pcm_device->pcm)
-                pcm_close(pcm_device->pcm);
+                pcm_pool_put(adev, pcm_device->pcm_profile, pcm_device->pcm);
             pcm_device->pcm = NULL;
             if (pcm_device->sound_trigger_handle > 0)
                 adev->sound_trigger_close_for_streaming(pcm_device->sound_trigger_handle);
@@ -3506,6 +5479,8 @@ static int do_in_standby_l(struct stream_in *in)
     struct audio_device *adev = in->dev;
 #endif
     if (!in->standby) {
+        in->stats.standby_count++;
+        in->stats.last_pcm_ns = 0;
 
         in_close_pcm_devices(in);
 
@@ -3546,7 +5521,7 @@ static int in_standby_l(struct stream_in *in)
     int status = 0;
     lock_input_stream(in);
     if (!in->standby) {
-        pthread_mutex_lock(&adev->lock);
+        lock_audio_device(adev);
         status = do_in_standby_l(in);
         pthread_mutex_unlock(&adev->lock);
     }
@@ -3569,9 +5544,11 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
-    (void)stream;
-    (void)fd;
+    struct stream_in *in = (struct stream_in *)stream;
 
+    /* read without the stream lock, as out_dump() */
+    dprintf(fd, "HAL input %s:\n", use_case_table[in->usecase]);
+    stream_stats_dump(&in->stats, fd);
     return 0;
 }
 
@@ -3596,7 +5573,7 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 
     pthread_mutex_lock(&adev->lock_inputs);
     lock_input_stream(in);
-    pthread_mutex_lock(&adev->lock);
+    lock_audio_device(adev);
     if (ret >= 0) {
         val = atoi(value);
         /* no audio source uses val == 0 */
@@ -3678,8 +5655,8 @@ static ssize_t read_bytes_from_dsp(struct stream_in *in, void* buffer,
         return 0;
 }
 
-static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
-                       size_t bytes)
+static ssize_t do_in_read(struct audio_stream_in *stream, void *buffer,
+                          size_t bytes)
 {
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
@@ -3688,20 +5665,12 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
     int read_and_process_successful = false;
 
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
-    pid_t tid;
-    int err;
 
     /* no need to acquire adev->lock_inputs because API contract prevents a close */
     lock_input_stream(in);
 
-    if (in->usecase == USECASE_AUDIO_CAPTURE && !in->is_fastcapture_affinity_set) {
-        tid = gettid();
-        err = fast_set_affinity(tid);
-        if (err < 0) {
-            ALOGW("Couldn't set affinity for tid %d; error %d", tid, err);
-        }
-        in->is_fastcapture_affinity_set = true;
-    }
+    if (in->usecase == USECASE_AUDIO_CAPTURE && in->fast_tid == 0)
+        in->fast_tid = thread_placement_apply(THREAD_ROLE_FAST_CAPTURE);
 
     if (in->standby) {
         pthread_mutex_unlock(&in->lock);
@@ -3711,7 +5680,7 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
             pthread_mutex_unlock(&adev->lock_inputs);
             goto false_alarm;
         }
-        pthread_mutex_lock(&adev->lock);
+        lock_audio_device(adev);
         ret = start_input_stream(in);
         pthread_mutex_unlock(&adev->lock);
         pthread_mutex_unlock(&adev->lock_inputs);
@@ -3759,8 +5728,22 @@ exit:
     return bytes;
 }
 
-static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
-{
+/* Called by a single thread, the audio flinger record thread of the stream */
+static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
+                       size_t bytes)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    int64_t start_ns = get_monotonic_ns();
+    int64_t start_cpu_ns = get_thread_cpu_ns();
+    ssize_t ret = do_in_read(stream, buffer, bytes);
+
+    audio_histogram_add(&in->stats.io_cpu, get_thread_cpu_ns() - start_cpu_ns);
+    audio_histogram_add(&in->stats.io, get_monotonic_ns() - start_ns);
+    return ret;
+}
+
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+{
     (void)stream;
 
     return 0;
@@ -3785,7 +5768,7 @@ static int add_remove_audio_effect(const struct audio_stream *stream,
 
     pthread_mutex_lock(&adev->lock_inputs);
     lock_input_stream(in);
-    pthread_mutex_lock(&in->dev->lock);
+    lock_audio_device(in->dev);
 #ifndef PREPROCESSING_ENABLED
     if ((in->source == AUDIO_SOURCE_VOICE_COMMUNICATION) &&
             in->enable_aec != enable &&
@@ -3875,6 +5858,20 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
     return add_remove_audio_effect(stream, effect, false);
 }
 
+/* Readiness barrier of the entry points that use the mixers, the vendor
+ * libraries or the amplifier: returns once adev_init_thread() is done.
+ */
+static int adev_wait_init(struct audio_device *adev)
+{
+    if (!android_atomic_acquire_load(&adev->init_done)) {
+        pthread_mutex_lock(&adev->init_lock);
+        while (!adev->init_done)
+            pthread_cond_wait(&adev->init_cond, &adev->init_lock);
+        pthread_mutex_unlock(&adev->init_lock);
+    }
+    return adev->init_status;
+}
+
 static int adev_open_output_stream(struct audio_hw_device *dev,
                                    audio_io_handle_t handle,
                                    audio_devices_t devices,
@@ -3891,6 +5888,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     ALOGV("%s: enter: sample_rate(%d) channel_mask(%#x) devices(%#x) flags(%#x)",
           __func__, config->sample_rate, config->channel_mask, devices, flags);
     *stream_out = NULL;
+    ret = adev_wait_init(adev);
+    if (ret != 0)
+        return ret;
     out = (struct stream_out *)calloc(1, sizeof(struct stream_out));
 
     if (devices == AUDIO_DEVICE_NONE)
@@ -3964,16 +5964,63 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         ALOGV("%s: offloaded output offload_info version %04x bit rate %d",
                 __func__, config->offload_info.version,
                 config->offload_info.bit_rate);
+#ifdef HDMI_PCM_DEVICE
+    } else if ((out->flags & AUDIO_OUTPUT_FLAG_DIRECT) &&
+               (devices == AUDIO_DEVICE_OUT_AUX_DIGITAL)) {
+        lock_audio_device(adev);
+        ret = read_hdmi_channel_masks(out);
+        pthread_mutex_unlock(&adev->lock);
+        if (ret != 0)
+            goto error_open;
+
+        if (config->channel_mask == 0)
+            config->channel_mask = AUDIO_CHANNEL_OUT_5POINT1;
+        if (audio_channel_count_from_out_mask(config->channel_mask) > HDMI_MAX_CHANNELS) {
+            ret = -EINVAL;
+            goto error_open;
+        }
+        out->usecase = USECASE_AUDIO_PLAYBACK_MULTI_CH;
+        out->channel_mask = config->channel_mask;
+        out->config = pcm_device_hdmi_multi.config;
+        out->config.channels = audio_channel_count_from_out_mask(out->channel_mask);
+        out->config.period_size = PLAYBACK_HDMI_MULTI_PERIOD_BYTES / (out->config.channels * 2);
+        out->config.start_threshold = out->config.period_size * out->config.period_count - 1;
+        out->config.stop_threshold = out->config.period_size * out->config.period_count;
+        out->sample_rate = out->config.rate;
+        ALOGD("%s: use AUDIO_PLAYBACK_MULTI_CH, %d channels", __func__, out->config.channels);
+#endif
     } else if (out->flags & (AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) {
         out->usecase = USECASE_AUDIO_PLAYBACK_DEEP_BUFFER;
         out->config = pcm_config_deep_buffer;
         out->sample_rate = out->config.rate;
+        out->deep_buffer_config = &pcm_config_deep_buffer;
         ALOGD("%s: use AUDIO_PLAYBACK_DEEP_BUFFER",__func__);
     } else {
         out->usecase = USECASE_AUDIO_PLAYBACK;
         out->sample_rate = out->config.rate;
     }
 
+    /* Take 24 bit and float as they are rather than having the framework
+     * requantize them: the HAL converts them once into the PCM format.
+     */
+    if (out->usecase == USECASE_AUDIO_PLAYBACK ||
+            out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER) {
+        if (!is_supported_pcm_format(out->format))
+            out->format = AUDIO_FORMAT_PCM_16_BIT;
+        if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+            out->convert_frames = out->config.period_size;
+            out->convert_buf = (int16_t *)calloc(out->convert_frames, out_pcm_frame_size(out));
+            if (out->convert_buf == NULL) {
+                ret = -ENOMEM;
+                goto error_open;
+            }
+            out->dither_enabled = adev->dither_output;
+            dsp_dither_init(&out->dither, (uint32_t)handle);
+            ALOGD("%s: converting format %#x to 16 bit%s", __func__, out->format,
+                  out->dither_enabled ? " with dither" : "");
+        }
+    }
+
     if (flags & AUDIO_OUTPUT_FLAG_PRIMARY) {
         if (adev->primary_output == NULL)
             adev->primary_output = out;
@@ -3985,13 +6032,15 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     }
 
     /* Check if this usecase is already existing */
-    pthread_mutex_lock(&adev->lock);
+    lock_audio_device(adev);
     if (get_usecase_from_id(adev, out->usecase) != NULL) {
         ALOGE("%s: Usecase (%d) is already present", __func__, out->usecase);
         pthread_mutex_unlock(&adev->lock);
         ret = -EEXIST;
         goto error_open;
     }
+    out->render_latency_us = latency_table_lookup(adev, out->usecase,
+                                                  get_output_snd_device(adev, out->devices));
     pthread_mutex_unlock(&adev->lock);
 
     out->stream.common.get_sample_rate = out_get_sample_rate;
@@ -4025,13 +6074,22 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     config->channel_mask = out->stream.common.get_channels(&out->stream.common);
     config->sample_rate = out->stream.common.get_sample_rate(&out->stream.common);
 
-    out->is_fastmixer_affinity_set = false;
+    out->fast_tid = 0;
+
+    if (out->usecase == USECASE_AUDIO_PLAYBACK && adev->async_write) {
+        if (create_out_writer_thread(out) != 0)
+            ALOGW("%s: falling back to synchronous writes", __func__);
+    }
+
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD && adev->warm_standby_ms > 0)
+        create_warm_standby_thread(out);
 
     *stream_out = &out->stream;
     ALOGV("%s: exit", __func__);
     return 0;
 
 error_open:
+    free(out->convert_buf);
     free(out);
     *stream_out = NULL;
     ALOGD("%s: exit: ret %d", __func__, ret);
@@ -4046,7 +6104,18 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     (void)dev;
 
     ALOGV("%s: enter", __func__);
-    out_standby(&stream->common);
+    out_do_standby(out, true);
+    if (adev->primary_output == out) {
+        lock_audio_device(adev);
+        adev->primary_output = NULL;
+        pthread_mutex_unlock(&adev->lock);
+    }
+    destroy_warm_standby_thread(out);
+    destroy_out_writer_thread(out);
+    if (out->fast_tid > 0)
+        thread_placement_remove(out->fast_tid);
+    free(out->res_arena);
+    free(out->convert_buf);
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         destroy_offload_callback_thread(out);
 
@@ -4059,6 +6128,279 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     ALOGV("%s: exit", __func__);
 }
 
+/* Microphone used to pick up the probe played on out_snd_device. Headphones are
+ * measured with a loopback plug between the headset output and microphone.
+ */
+static snd_device_t latency_measure_mic(snd_device_t out_snd_device)
+{
+    switch (out_snd_device) {
+    case SND_DEVICE_OUT_HANDSET:
+        return SND_DEVICE_IN_HANDSET_MIC;
+    case SND_DEVICE_OUT_SPEAKER:
+        return SND_DEVICE_IN_SPEAKER_MIC;
+    case SND_DEVICE_OUT_HEADPHONES:
+        return SND_DEVICE_IN_HEADSET_MIC;
+    default:
+        return SND_DEVICE_NONE;
+    }
+}
+
+/* CLOCK_MONOTONIC time in ns at which the given frame of the stream was at the
+ * codec, extrapolated from the last hardware timestamp of the PCM.
+ */
+static int latency_frame_time(struct pcm *pcm, bool capture, uint64_t transferred,
+                              unsigned int buffer_frames, unsigned int rate,
+                              uint64_t frame, int64_t *time_ns)
+{
+    unsigned int avail;
+    struct timespec ts;
+    int64_t position;
+
+    if (pcm_get_htimestamp(pcm, &avail, &ts) != 0)
+        return -ENODATA;
+
+    if (capture)
+        position = transferred + avail;
+    else
+        position = transferred - (buffer_frames - avail);
+
+    *time_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec +
+               ((int64_t)frame - position) * 1000000000LL / rate;
+    return 0;
+}
+
+/* Plays LATENCY_MEASURE_LEAD_MS of silence followed by a short tone burst and
+ * looks for the burst in the capture. Both streams are timestamped by the driver
+ * so the result only contains the delays after the PCM ring buffers: playback
+ * path + acoustic path + capture path.
+ * Returns the round trip in us or a negative error code.
+ */
+static int64_t latency_measure_run(struct pcm *out_pcm, struct pcm_config *out_config,
+                                   struct pcm *in_pcm, struct pcm_config *in_config,
+                                   int16_t *out_buf, int16_t *in_buf)
+{
+    unsigned int rate = out_config->rate;
+    unsigned int chunk = in_config->period_size;
+    unsigned int out_buffer_frames = out_config->period_size * out_config->period_count;
+    uint64_t probe_start = (uint64_t)LATENCY_MEASURE_LEAD_MS * rate / 1000;
+    uint64_t probe_end = probe_start + (uint64_t)LATENCY_MEASURE_PROBE_MS * rate / 1000;
+    uint64_t total = probe_end + (uint64_t)LATENCY_MEASURE_WINDOW_MS * rate / 1000;
+    uint64_t played = 0;
+    uint64_t captured = 0;
+    int64_t probe_time = 0;
+    int64_t detect_time = 0;
+    bool probe_timed = false;
+    bool detected = false;
+    int noise_peak = 0;
+    int threshold;
+    unsigned int i, ch;
+    int sample;
+
+    /* fill the playback buffer before starting the capture so that it never underruns */
+    memset(out_buf, 0, out_buffer_frames * out_config->channels * sizeof(int16_t));
+    if (pcm_write(out_pcm, out_buf, pcm_frames_to_bytes(out_pcm, out_buffer_frames)) != 0)
+        return -EIO;
+    played = out_buffer_frames;
+
+    while (captured < total && !detected) {
+        if (pcm_read(in_pcm, in_buf, pcm_frames_to_bytes(in_pcm, chunk)) != 0)
+            return -EIO;
+
+        threshold = noise_peak * 4;
+        if (threshold < LATENCY_MEASURE_MIN_THRESHOLD)
+            threshold = LATENCY_MEASURE_MIN_THRESHOLD;
+        for (i = 0; i < chunk && !detected; i++) {
+            for (ch = 0; ch < in_config->channels; ch++) {
+                sample = abs(in_buf[i * in_config->channels + ch]);
+                if (captured + i < probe_start) {
+                    if (sample > noise_peak)
+                        noise_peak = sample;
+                } else if (sample > threshold) {
+                    if (latency_frame_time(in_pcm, true, captured + chunk, 0, rate,
+                                           captured + i, &detect_time) != 0)
+                        return -ENODATA;
+                    detected = true;
+                    break;
+                }
+            }
+        }
+        captured += chunk;
+
+        for (i = 0; i < chunk; i++) {
+            int16_t value = 0;
+
+            if (played + i >= probe_start && played + i < probe_end)
+                value = (int16_t)(16384 * sinf(2 * M_PI * 1000 * (played + i - probe_start) /
+                                               rate));
+            for (ch = 0; ch < out_config->channels; ch++)
+                out_buf[i * out_config->channels + ch] = value;
+        }
+        if (pcm_write(out_pcm, out_buf, pcm_frames_to_bytes(out_pcm, chunk)) != 0)
+            return -EIO;
+        played += chunk;
+
+        if (!probe_timed && played > probe_end) {
+            if (latency_frame_time(out_pcm, false, played, out_buffer_frames, rate,
+                                   probe_start, &probe_time) != 0)
+                return -ENODATA;
+            probe_timed = true;
+        }
+    }
+
+    if (!detected || !probe_timed) {
+        ALOGW("%s: probe not detected (noise peak %d)", __func__, noise_peak);
+        return -ETIMEDOUT;
+    }
+    if (detect_time < probe_time)
+        return -ERANGE;
+
+    return (detect_time - probe_time) / 1000;
+}
+
+/* Loopback calibration started by the "latency_measure=<snd device>" parameter.
+ * The measurement needs exclusive use of the codec: it is refused while any
+ * usecase is active and, while adev->latency_measuring is set, the streams and
+ * voice calls are refused to start. adev->lock is only held to set and reset
+ * the route and to update the table, not during the runs (about a second
+ * each). The capture path latency is taken from the table entry of the capture
+ * usecase for the microphone and subtracted from the round trip.
+ */
+static void *latency_measure_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    snd_device_t out_snd_device = adev->latency_measure_device;
+    snd_device_t in_snd_device = latency_measure_mic(out_snd_device);
+    struct pcm_device_profile *out_profile = &pcm_device_playback;
+    struct pcm_device_profile *in_profile = &pcm_device_capture;
+    struct pcm_config out_config = pcm_config_deep_buffer;
+    struct pcm_config in_config = in_profile->config;
+    struct mixer_card *mixer_card;
+    struct pcm *out_pcm = NULL;
+    struct pcm *in_pcm = NULL;
+    int16_t *out_buf = NULL;
+    int16_t *in_buf = NULL;
+    int64_t round_trip_us;
+    int64_t total_us = 0;
+    int32_t latency_us;
+    int runs = 0;
+    int i;
+
+    prctl(PR_SET_NAME, (unsigned long)"LatencyMeasure", 0, 0, 0);
+
+    /* the keep-alive thread plays on the same PCM device */
+    dummybuf_thread_close(adev);
+
+    lock_audio_device(adev);
+    if (!list_empty(&adev->usecase_list)) {
+        ALOGE("%s: audio is active, measurement cancelled", __func__);
+        goto exit;
+    }
+    mixer_card = adev_get_mixer_for_card(adev, out_profile->card);
+    if (mixer_card == NULL || in_snd_device == SND_DEVICE_NONE) {
+        ALOGE("%s: cannot route %s", __func__, get_snd_device_name(out_snd_device));
+        goto exit;
+    }
+
+    out_config.stop_threshold = INT_MAX / 2;
+    in_config.period_count = LATENCY_MEASURE_CAPTURE_PERIOD_COUNT;
+    if (in_config.rate != out_config.rate) {
+        ALOGE("%s: playback and capture rates differ", __func__);
+        goto exit;
+    }
+
+    route_cache_apply_path(mixer_card->route_cache, get_snd_device_name(out_snd_device));
+    route_cache_apply_path(mixer_card->route_cache, get_snd_device_name(in_snd_device));
+    route_cache_update_mixer(mixer_card->route_cache);
+    pthread_mutex_unlock(&adev->lock);
+
+    out_buf = calloc(out_config.period_size * out_config.period_count,
+                     out_config.channels * sizeof(int16_t));
+    in_buf = calloc(in_config.period_size, in_config.channels * sizeof(int16_t));
+    if (out_buf == NULL || in_buf == NULL || in_config.period_size >
+            out_config.period_size * out_config.period_count) {
+        lock_audio_device(adev);
+        goto reset_route;
+    }
+
+    for (i = 0; i < LATENCY_MEASURE_RUNS; i++) {
+        out_pcm = pcm_pool_get(adev, out_profile, PCM_OUT | PCM_MONOTONIC, &out_config);
+        in_pcm = pcm_pool_get(adev, in_profile, PCM_IN | PCM_MONOTONIC, &in_config);
+        if (!pcm_is_ready(out_pcm) || !pcm_is_ready(in_pcm)) {
+            ALOGE("%s: cannot open the PCM devices: %s / %s", __func__,
+                  pcm_get_error(out_pcm), pcm_get_error(in_pcm));
+            round_trip_us = -ENODEV;
+        } else {
+            round_trip_us = latency_measure_run(out_pcm, &out_config, in_pcm, &in_config,
+                                                out_buf, in_buf);
+        }
+        pcm_pool_put(adev, out_profile, out_pcm);
+        pcm_pool_put(adev, in_profile, in_pcm);
+        out_pcm = in_pcm = NULL;
+
+        ALOGD("%s: run %d: round trip %lld us", __func__, i, (long long)round_trip_us);
+        if (round_trip_us >= 0) {
+            total_us += round_trip_us;
+            runs++;
+        }
+    }
+
+    lock_audio_device(adev);
+    if (runs > 0) {
+        latency_us = total_us / runs -
+                     latency_table_lookup(adev, USECASE_AUDIO_CAPTURE, in_snd_device);
+        if (latency_us < 0)
+            latency_us = 0;
+        ALOGI("%s: %s: render latency %d us (%d runs)", __func__,
+              get_snd_device_name(out_snd_device), latency_us, runs);
+        /* the low latency and deep buffer outputs share the same codec path */
+        adev->latency_table[USECASE_AUDIO_PLAYBACK][out_snd_device].us = latency_us;
+        adev->latency_table[USECASE_AUDIO_PLAYBACK][out_snd_device].measured = true;
+        adev->latency_table[USECASE_AUDIO_PLAYBACK_DEEP_BUFFER][out_snd_device].us = latency_us;
+        adev->latency_table[USECASE_AUDIO_PLAYBACK_DEEP_BUFFER][out_snd_device].measured = true;
+        latency_table_save(adev);
+    } else {
+        ALOGE("%s: %s: measurement failed", __func__, get_snd_device_name(out_snd_device));
+    }
+
+reset_route:
+    free(out_buf);
+    free(in_buf);
+    route_cache_reset_path(mixer_card->route_cache, get_snd_device_name(in_snd_device));
+    route_cache_reset_path(mixer_card->route_cache, get_snd_device_name(out_snd_device));
+    route_cache_update_mixer(mixer_card->route_cache);
+exit:
+    adev->latency_measuring = false;
+    pthread_mutex_unlock(&adev->lock);
+    return NULL;
+}
+
+/* must be called with adev->lock held */
+static int latency_measure_start(struct audio_device *adev, const char *device_name)
+{
+    snd_device_t snd_device = latency_snd_device_from_name(device_name);
+
+    if (snd_device <= SND_DEVICE_NONE || latency_measure_mic(snd_device) == SND_DEVICE_NONE) {
+        ALOGE("%s: cannot measure device %s", __func__, device_name);
+        return -EINVAL;
+    }
+    if (adev->latency_measuring || !list_empty(&adev->usecase_list)) {
+        ALOGE("%s: busy", __func__);
+        return -EBUSY;
+    }
+    if (adev->latency_measure_thread != 0)
+        pthread_join(adev->latency_measure_thread, (void **)NULL);
+
+    adev->latency_measure_device = snd_device;
+    adev->latency_measuring = true;
+    if (pthread_create(&adev->latency_measure_thread, (const pthread_attr_t *) NULL,
+                       latency_measure_thread, adev) != 0) {
+        adev->latency_measure_thread = 0;
+        adev->latency_measuring = false;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
     struct audio_device *adev = (struct audio_device *)dev;
@@ -4070,6 +6412,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     ALOGV("%s: enter: %s", __func__, kvpairs);
 
+    adev_wait_init(adev);
     parms = str_parms_create_str(kvpairs);
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_TTY_MODE, value, sizeof(value));
     if (ret >= 0) {
@@ -4086,7 +6429,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         else
             return -EINVAL;
 
-        pthread_mutex_lock(&adev->lock);
+        lock_audio_device(adev);
         if (tty_mode != adev->tty_mode) {
             adev->tty_mode = tty_mode;
             if (adev->in_call)
@@ -4114,6 +6457,33 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             adev->screen_off = true;
     }
 
+#ifdef HDMI_PCM_DEVICE
+    ret = str_parms_get_int(parms, AUDIO_PARAMETER_DEVICE_CONNECT, &val);
+    if (ret >= 0 && (val & AUDIO_DEVICE_OUT_AUX_DIGITAL)) {
+        lock_audio_device(adev);
+        hdmi_invalidate_caps_l(adev);
+        pthread_mutex_unlock(&adev->lock);
+    }
+
+    ret = str_parms_get_int(parms, AUDIO_PARAMETER_DEVICE_DISCONNECT, &val);
+    if (ret >= 0 && (val & AUDIO_DEVICE_OUT_AUX_DIGITAL)) {
+        lock_audio_device(adev);
+        hdmi_invalidate_caps_l(adev);
+        pthread_mutex_unlock(&adev->lock);
+    }
+#endif
+
+    ret = str_parms_get_str(parms, "latency_measure", value, sizeof(value));
+    if (ret >= 0) {
+        lock_audio_device(adev);
+        ret = latency_measure_start(adev, value);
+        pthread_mutex_unlock(&adev->lock);
+        if (ret != 0) {
+            str_parms_destroy(parms);
+            return ret;
+        }
+    }
+
     ret = str_parms_get_int(parms, "rotation", &val);
     if (ret >= 0) {
         bool reverse_speakers = false;
@@ -4131,7 +6501,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         default:
             ALOGE("%s: unexpected rotation of %d", __func__, val);
         }
-        pthread_mutex_lock(&adev->lock);
+        lock_audio_device(adev);
         if (adev->speaker_lr_swap != reverse_speakers) {
             adev->speaker_lr_swap = reverse_speakers;
             /* only update the selected device if there is active pcm playback */
@@ -4170,16 +6540,21 @@ static char* adev_get_parameters(const struct audio_hw_device *dev,
 
 static int adev_init_check(const struct audio_hw_device *dev)
 {
-    (void)dev;
+    struct audio_device *adev = (struct audio_device *)dev;
 
-    return 0;
+    /* an init still in progress is not an error, streams wait for it */
+    if (!android_atomic_acquire_load(&adev->init_done))
+        return 0;
+    return adev->init_status;
 }
 
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
 {
     int ret = 0;
     struct audio_device *adev = (struct audio_device *)dev;
-    pthread_mutex_lock(&adev->lock);
+
+    adev_wait_init(adev);
+    lock_audio_device(adev);
     /* cache volume */
     adev->voice_volume = volume;
     ret = set_voice_volume_l(adev, adev->voice_volume);
@@ -4224,13 +6599,12 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
 {
     struct audio_device *adev = (struct audio_device *)dev;
 
-    pthread_mutex_lock(&adev->lock);
+    adev_wait_init(adev);
+    lock_audio_device(adev);
     if (adev->mode != mode) {
         ALOGI("%s mode = %d", __func__, mode);
         adev->mode = mode;
-        pthread_mutex_lock(&adev->tfa9895_lock);
-        adev->tfa9895_mode_change |= 0x1;
-        pthread_mutex_unlock(&adev->tfa9895_lock);
+        amp_request_config(adev);
     }
     pthread_mutex_unlock(&adev->lock);
     return 0;
@@ -4241,7 +6615,7 @@ static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
     struct audio_device *adev = (struct audio_device *)dev;
     int err = 0;
 
-    pthread_mutex_lock(&adev->lock);
+    lock_audio_device(adev);
     adev->mic_mute = state;
 
     if (adev->mode == AUDIO_MODE_IN_CALL) {
@@ -4292,6 +6666,8 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     ALOGV("%s: enter", __func__);
 
     *stream_in = NULL;
+    if (adev_wait_init(adev) != 0)
+        return -ENODEV;
     if (check_input_parameters(config->sample_rate, config->format,
                                audio_channel_count_from_in_mask(config->channel_mask)) != 0)
         return -EINVAL;
@@ -4353,7 +6729,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     pthread_mutex_init(&in->lock, (const pthread_mutexattr_t *) NULL);
     pthread_mutex_init(&in->pre_lock, (const pthread_mutexattr_t *) NULL);
 
-    in->is_fastcapture_affinity_set = false;
+    in->fast_tid = 0;
 
     *stream_in = &in->stream;
     ALOGV("%s: exit", __func__);
@@ -4382,28 +6758,24 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
         in->read_buf = NULL;
     }
 
-    if (in->proc_buf_in) {
-        free(in->proc_buf_in);
-        in->proc_buf_in = NULL;
-    }
+    capture_ring_free(&in->proc_ring);
 
     if (in->proc_buf_out) {
         free(in->proc_buf_out);
         in->proc_buf_out = NULL;
     }
 
-    if (in->ref_buf) {
-        free(in->ref_buf);
-        in->ref_buf = NULL;
-    }
+    capture_ring_free(&in->ref_ring);
 
     if (in->resampler) {
-        release_resampler(in->resampler);
+        hal_release_resampler(in->resampler);
         in->resampler = NULL;
     }
 #endif
 
     in_standby_l(in);
+    if (in->fast_tid > 0)
+        thread_placement_remove(in->fast_tid);
     free(stream);
 
     pthread_mutex_unlock(&adev->lock_inputs);
@@ -4413,8 +6785,68 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
-    (void)device;
-    (void)fd;
+    struct audio_device *adev = (struct audio_device *)device;
+    struct mixer_card *mixer_card;
+    struct listnode *node;
+    int i, j;
+
+    lock_audio_device(adev);
+    dprintf(fd, "Audio HAL:\n");
+    audio_histogram_dump(&adev->lock_wait, "device lock wait", fd);
+    audio_histogram_dump(&adev->select_devices_time, "select_devices", fd);
+    audio_histogram_dump(&adev->select_devices_cpu, "select_devices CPU", fd);
+    dprintf(fd, "Render latency (us):%s\n", adev->latency_measuring ? " measuring" : "");
+    for (i = 0; i < AUDIO_USECASE_MAX; i++) {
+        for (j = 0; j < SND_DEVICE_MAX; j++) {
+            if (adev->latency_table[i][j].us == LATENCY_UNKNOWN)
+                continue;
+            dprintf(fd, "  %s %s: %d%s\n", use_case_table[i],
+                    j == SND_DEVICE_NONE ? "*" : device_table[j],
+                    adev->latency_table[i][j].us,
+                    adev->latency_table[i][j].measured ? " (measured)" : "");
+        }
+    }
+    dprintf(fd, "PCM device profiles:\n");
+    if (adev->period_size_override != 0)
+        dprintf(fd, "  audio_hal.period_size override: %d frames\n",
+                adev->period_size_override);
+    for (i = 0; pcm_devices[i] != NULL; i++) {
+        const struct pcm_device_profile *profile = pcm_devices[i];
+
+        dprintf(fd, "  %s: card %d device %d, %u ch %u Hz, %u x %u frames, "
+                "start %u stop %u avail_min %u%s\n", profile->name, profile->card, profile->id,
+                profile->config.channels, profile->config.rate, profile->config.period_count,
+                profile->config.period_size, profile->config.start_threshold,
+                profile->config.stop_threshold, profile->config.avail_min,
+                profile->tuned ? " (tuned)" : "");
+    }
+    if (!android_atomic_acquire_load(&adev->init_done)) {
+        dprintf(fd, "Initializing\n");
+    } else {
+        list_for_each(node, &adev->mixer_list) {
+            mixer_card = node_to_item(node, struct mixer_card, adev_list_node);
+            dprintf(fd, "Card %d ", mixer_card->card);
+            route_cache_dump(mixer_card->route_cache, fd);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    thread_placement_dump(fd);
+
+    if (adev->pcm_pool_active) {
+        pthread_mutex_lock(&adev->pcm_pool_lock);
+        dprintf(fd, "PCM pool (idle handles closed after %d ms):\n", PCM_POOL_IDLE_MS);
+        for (i = 0; i < adev->pcm_pool_count; i++) {
+            struct pcm_pool_entry *entry = &adev->pcm_pool[i];
+
+            dprintf(fd, "  card %d device %d%s: %s\n", entry->profile->card,
+                    entry->profile->id, (entry->flags & PCM_MMAP) ? " mmap" : "",
+                    entry->pcm != NULL ? "ready" :
+                    entry->lent != NULL ? "lent" :
+                    entry->busy ? "in use" : "closed");
+        }
+        pthread_mutex_unlock(&adev->pcm_pool_lock);
+    }
 
     return 0;
 }
@@ -4423,16 +6855,72 @@ static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
     audio_device_ref_count--;
+    if (adev->init_thread_active)
+        pthread_join(adev->init_thread, (void **)NULL);
+    if (adev->latency_measure_thread != 0)
+        pthread_join(adev->latency_measure_thread, (void **)NULL);
+    dummybuf_thread_close(adev);
+    pcm_pool_release(adev);
+    pthread_cond_destroy(&adev->dummybuf_thread_cond);
+    pthread_mutex_destroy(&adev->dummybuf_thread_lock);
+#ifdef PREPROCESSING_ENABLED
+    pthread_cond_destroy(&adev->echo_reference_cond);
+    pthread_mutex_destroy(&adev->echo_reference_lock);
+#endif
+    if (adev->init_status == 0)
+        destroy_amp_config_thread(adev);
+    pthread_cond_destroy(&adev->init_cond);
+    pthread_mutex_destroy(&adev->init_lock);
     free(adev->snd_dev_ref_cnt);
     free_mixer_list(adev);
     free(device);
     return 0;
 }
 
+static void dummybuf_timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static struct pcm *dummybuf_pcm_open(struct audio_device *adev,
+                                     struct pcm_device_profile *profile,
+                                     struct pcm_config *config)
+{
+    struct pcm *pcm;
+
+    pcm = pcm_pool_get(adev, profile, (PCM_OUT | PCM_MONOTONIC), config);
+    if (pcm != NULL && !pcm_is_ready(pcm)) {
+        ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
+        pcm_pool_put(adev, profile, pcm);
+        pcm = NULL;
+    } else {
+        ALOGD("pcm_open: card=%d, id=%d", profile->card, profile->id);
+    }
+    return pcm;
+}
+
+/* The keep-alive stops when the timer expires: the timerfd becomes readable */
+static bool dummybuf_timer_expired(int timer_fd)
+{
+    uint64_t expirations;
+
+    return timer_fd < 0 ||
+           read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
+
+/* Plays silence on the primary PCM for up to DUMMYBUF_TIMEOUT_MS so that the
+ * amplifiers see an I2S clock while they are configured. Writes are blocking
+ * and paced by the hardware. The thread exits when the timerfd deadline expires
+ * or when dummybuf_thread_close() sets dummybuf_thread_cancel.
+ */
 static void *dummybuf_thread(void *context)
 {
     ALOGD("%s: enter", __func__);
-    pthread_detach(pthread_self());
     struct audio_device *adev = (struct audio_device *)context;
     struct pcm_config config;
     struct mixer *mixer = NULL;
@@ -4441,10 +6929,22 @@ static void *dummybuf_thread(void *context)
     struct pcm *pcm = NULL;
     struct pcm_device_profile *profile = NULL;
     audio_devices_t dummybuf_thread_devices = adev->dummybuf_thread_devices;
-
-    pthread_mutex_lock(&adev->dummybuf_thread_lock);
-
-    memset(&config, 0, sizeof(struct pcm_config));
+    struct itimerspec deadline;
+    struct timespec ts;
+    int retry_ms = DUMMYBUF_RETRY_MS;
+    int retries = 0;
+    int timer_fd;
+
+    prctl(PR_SET_NAME, (unsigned long)"Dummybuf", 0, 0, 0);
+
+    memset(&deadline, 0, sizeof(deadline));
+    deadline.it_value.tv_sec = DUMMYBUF_TIMEOUT_MS / 1000;
+    deadline.it_value.tv_nsec = (DUMMYBUF_TIMEOUT_MS % 1000) * 1000000;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &deadline, NULL) < 0) {
+        ALOGE("%s: cannot arm the keep-alive timer: %s", __func__, strerror(errno));
+        goto exit;
+    }
 
     profile = &pcm_device_playback;
 
@@ -4452,14 +6952,12 @@ static void *dummybuf_thread(void *context)
     /* Use large value for stop_threshold so that automatic
        trigger for stop is avoided, when this thread fails to write data */
     config.stop_threshold = INT_MAX/2;
-    pcm = pcm_open(profile->card, profile->id,
-                   (PCM_OUT | PCM_MONOTONIC), &config);
-    if (pcm != NULL && !pcm_is_ready(pcm)) {
-        ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
-        pcm_close(pcm);
-        pcm = NULL;
-    } else {
-        ALOGD("pcm_open: card=%d, id=%d", profile->card, profile->id);
+    pcm = dummybuf_pcm_open(adev, profile, &config);
+
+    data = (unsigned char *)calloc(DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8, sizeof(unsigned char));
+    if (data == NULL) {
+        ALOGE("%s: cannot allocate the silence buffer", __func__);
+        goto exit;
     }
 
     mixer = mixer_open(profile->card);
@@ -4491,42 +6989,44 @@ static void *dummybuf_thread(void *context)
         }
     }
 
-    while (1) {
-        if (pcm) {
-            if (data == NULL)
-                data = (unsigned char *)calloc(DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8,
-                            sizeof(unsigned char));
-            if (data) {
-                pcm_write(pcm, (void *)data, DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8);
-                adev->dummybuf_thread_active = 1;
-            } else {
-                ALOGD("%s: cant open a buffer, retry to open it", __func__);
-            }
-        } else {
-            ALOGD("%s: cant open a output deep stream, retry to open it", __func__);
-            pcm = pcm_open(profile->card, profile->id,
-                   (PCM_OUT | PCM_MONOTONIC), &config);
-            if (pcm != NULL && !pcm_is_ready(pcm)) {
-                ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
-                pcm_close(pcm);
-                pcm = NULL;
-            } else {
-                ALOGD("pcm_open: card=%d, id=%d", profile->card, profile->id);
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    while (!adev->dummybuf_thread_cancel && !dummybuf_timer_expired(timer_fd)) {
+        if (pcm == NULL) {
+            if (retries++ == DUMMYBUF_MAX_RETRIES) {
+                ALOGE("%s: cannot open the output after %d retries, giving up",
+                      __func__, DUMMYBUF_MAX_RETRIES);
+                break;
             }
+            ALOGD("%s: cant open a output deep stream, retry to open it in %d ms",
+                  __func__, retry_ms);
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            dummybuf_timespec_add_ms(&ts, retry_ms);
+            pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                                   &adev->dummybuf_thread_lock, &ts);
+            if (adev->dummybuf_thread_cancel)
+                break;
+            retry_ms *= 2;
+            if (retry_ms > DUMMYBUF_RETRY_MAX_MS)
+                retry_ms = DUMMYBUF_RETRY_MAX_MS;
+            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+            pcm = dummybuf_pcm_open(adev, profile, &config);
+            pthread_mutex_lock(&adev->dummybuf_thread_lock);
+            continue;
         }
+        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
-        if (adev->dummybuf_thread_cancel || adev->dummybuf_thread_timeout-- <= 0) {
-            adev->dummybuf_thread_cancel = 0;
-            break;
-        }
+        /* blocks until the driver has room, i.e. for about one write worth of audio */
+        pcm_write(pcm, (void *)data, DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8);
 
-        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-        usleep(3000);
         pthread_mutex_lock(&adev->dummybuf_thread_lock);
+        if (!adev->dummybuf_thread_active) {
+            adev->dummybuf_thread_active = 1;
+            pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+        }
     }
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
 exit:
-    adev->dummybuf_thread_active = 0;
     if (mixer) {
         if (dummybuf_thread_devices == AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
             ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_HEADPHONE_JACK_SWITCH);
@@ -4543,53 +7043,93 @@ exit:
         mixer_close(mixer);
     }
     if (pcm) {
-        pcm_close(pcm);
+        pcm_pool_put(adev, profile, pcm);
         pcm = NULL;
     }
-    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+    if (timer_fd >= 0)
+        close(timer_fd);
 
     if (data)
         free(data);
 
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    adev->dummybuf_thread_active = 0;
+    adev->dummybuf_thread_running = 0;
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+
+    ALOGD("%s: exit", __func__);
     return NULL;
 }
 
 static void dummybuf_thread_open(struct audio_device *adev)
 {
-    adev->dummybuf_thread_timeout = 6000; /* in 18 sec */
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    if (adev->dummybuf_thread != 0) {
+        if (adev->dummybuf_thread_running) {
+            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+            return;
+        }
+        /* previous thread reached its deadline but was never joined */
+        pthread_join(adev->dummybuf_thread, (void **) NULL);
+        adev->dummybuf_thread = 0;
+    }
     adev->dummybuf_thread_cancel = 0;
     adev->dummybuf_thread_active = 0;
-    pthread_mutex_init(&adev->dummybuf_thread_lock, (const pthread_mutexattr_t *) NULL);
-    if (!adev->dummybuf_thread)
-        pthread_create(&adev->dummybuf_thread, (const pthread_attr_t *) NULL, dummybuf_thread, adev);
+    adev->dummybuf_thread_running = 1;
+    if (pthread_create(&adev->dummybuf_thread, (const pthread_attr_t *) NULL,
+                       dummybuf_thread, adev) != 0) {
+        ALOGE("%s: could not create dummybuf thread", __func__);
+        adev->dummybuf_thread_running = 0;
+        adev->dummybuf_thread = 0;
+    }
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 }
 
-static void dummybuf_thread_close(struct audio_device *adev)
+/* Waits up to timeout_ms for the keep-alive to start playing. Returns true if it does. */
+static bool dummybuf_thread_wait_active(struct audio_device *adev, int timeout_ms)
 {
-    ALOGD("%s: enter", __func__);
-    int retry_cnt = 20;
+    struct timespec ts;
+    bool active;
 
-    if (adev->dummybuf_thread == 0)
-        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    dummybuf_timespec_add_ms(&ts, timeout_ms);
 
     pthread_mutex_lock(&adev->dummybuf_thread_lock);
-    adev->dummybuf_thread_cancel = 1;
+    while (adev->dummybuf_thread_running && !adev->dummybuf_thread_active) {
+        if (pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                                   &adev->dummybuf_thread_lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    active = adev->dummybuf_thread_active;
     pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
-    while (retry_cnt > 0) {
-        pthread_mutex_lock(&adev->dummybuf_thread_lock);
-        if (adev->dummybuf_thread_active == 0) {
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            break;
-        }
+    return active;
+}
+
+/* Cancels the keep-alive and returns once its PCM is closed. Safe to call
+ * concurrently, e.g. from tfa9895_config_thread() and start_output_stream().
+ */
+static void dummybuf_thread_close(struct audio_device *adev)
+{
+    pthread_t thread;
+
+    pthread_mutex_lock(&adev->dummybuf_thread_lock);
+    if (adev->dummybuf_thread == 0) {
         pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-        retry_cnt--;
-        usleep(1000);
+        return;
     }
-
-    pthread_join(adev->dummybuf_thread, (void **) NULL);
-    pthread_mutex_destroy(&adev->dummybuf_thread_lock);
+    ALOGD("%s: enter", __func__);
+    adev->dummybuf_thread_cancel = 1;
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+    while (adev->dummybuf_thread_running)
+        pthread_cond_wait(&adev->dummybuf_thread_cond, &adev->dummybuf_thread_lock);
+    thread = adev->dummybuf_thread;
     adev->dummybuf_thread = 0;
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+
+    if (thread != 0)
+        pthread_join(thread, (void **) NULL);
 }
 
 /* This returns true if the input parameter looks at all plausible as a low latency period size,
@@ -4610,64 +7150,9 @@ static bool period_size_is_plausible_for_low_latency(int period_size)
     }
 }
 
-static int adev_open(const hw_module_t *module, const char *name,
-                     hw_device_t **device)
+/* Loads the vendor libraries used by the HAL */
+static void adev_load_libraries(struct audio_device *adev)
 {
-    struct audio_device *adev;
-    int retry_count = 0;
-
-    ALOGD("%s: enter", __func__);
-    if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0) return -EINVAL;
-
-    adev = calloc(1, sizeof(struct audio_device));
-
-    adev->device.common.tag = HARDWARE_DEVICE_TAG;
-    adev->device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
-    adev->device.common.module = (struct hw_module_t *)module;
-    adev->device.common.close = adev_close;
-
-    adev->device.init_check = adev_init_check;
-    adev->device.set_voice_volume = adev_set_voice_volume;
-    adev->device.set_master_volume = adev_set_master_volume;
-    adev->device.get_master_volume = adev_get_master_volume;
-    adev->device.set_master_mute = adev_set_master_mute;
-    adev->device.get_master_mute = adev_get_master_mute;
-    adev->device.set_mode = adev_set_mode;
-    adev->device.set_mic_mute = adev_set_mic_mute;
-    adev->device.get_mic_mute = adev_get_mic_mute;
-    adev->device.set_parameters = adev_set_parameters;
-    adev->device.get_parameters = adev_get_parameters;
-    adev->device.get_input_buffer_size = adev_get_input_buffer_size;
-    adev->device.open_output_stream = adev_open_output_stream;
-    adev->device.close_output_stream = adev_close_output_stream;
-    adev->device.open_input_stream = adev_open_input_stream;
-    adev->device.close_input_stream = adev_close_input_stream;
-    adev->device.dump = adev_dump;
-
-    /* Set the default route before the PCM stream is opened */
-    adev->mode = AUDIO_MODE_NORMAL;
-    adev->active_input = NULL;
-    adev->primary_output = NULL;
-    adev->voice_volume = 1.0f;
-    adev->tty_mode = TTY_MODE_OFF;
-    adev->bluetooth_nrec = true;
-    adev->in_call = false;
-    /* adev->cur_hdmi_channels = 0;  by calloc() */
-    adev->snd_dev_ref_cnt = calloc(SND_DEVICE_MAX, sizeof(int));
-
-    adev->dualmic_config = DUALMIC_CONFIG_NONE;
-    adev->ns_in_voice_rec = false;
-
-    list_init(&adev->usecase_list);
-
-    if (mixer_init(adev) != 0) {
-        free(adev->snd_dev_ref_cnt);
-        free(adev);
-        ALOGE("%s: Failed to init, aborting.", __func__);
-        *device = NULL;
-        return -EINVAL;
-    }
-
     if (access(OFFLOAD_FX_LIBRARY_PATH, R_OK) == 0) {
         adev->offload_fx_lib = dlopen(OFFLOAD_FX_LIBRARY_PATH, RTLD_NOW);
         if (adev->offload_fx_lib == NULL) {
@@ -4732,27 +7217,38 @@ static int adev_open(const hw_module_t *module, const char *name,
             }
         }
     }
+}
 
+/* Everything adev_open() does not need to return: waiting for the mixers, which
+ * can take seconds while the codec firmware loads, the vendor libraries and the
+ * amplifier setup. Runs on init_thread, see adev_wait_init().
+ */
+static void *adev_init_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    char value[PROPERTY_VALUE_MAX];
+    int status = 0;
 
-    *device = &adev->device.common;
+    prctl(PR_SET_NAME, (unsigned long)"Audio HAL Init", 0, 0, 0);
+
+    if (mixer_init(adev) != 0) {
+        ALOGE("%s: Failed to init, aborting.", __func__);
+        status = -ENODEV;
+        goto exit;
+    }
+
+    adev_load_libraries(adev);
+
+    create_amp_config_thread(adev);
 
     if (adev->htc_acoustic_init_rt5506 != NULL)
         adev->htc_acoustic_init_rt5506();
 
-    if (audio_device_ref_count == 0) {
+    if (adev->init_first_open) {
         /* For HS GPIO initial config */
         adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
         dummybuf_thread_open(adev);
-        retry_count = RETRY_NUMBER;
-        while (retry_count-- > 0) {
-            pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            if (adev->dummybuf_thread_active != 0) {
-                pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-                break;
-            }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            usleep(10000);
-        }
+        dummybuf_thread_wait_active(adev, RETRY_NUMBER * DUMMYBUF_RETRY_MS);
         dummybuf_thread_close(adev);
 
         /* For NXP DSP config */
@@ -4760,43 +7256,141 @@ static int adev_open(const hw_module_t *module, const char *name,
             pthread_t th;
             adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_SPEAKER;
             dummybuf_thread_open(adev);
-            pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            retry_count = RETRY_NUMBER;
-            while (retry_count-- > 0) {
-                if (adev->dummybuf_thread_active) {
-                    break;
-                }
-                pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-                usleep(10000);
-                pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            }
-            if (adev->dummybuf_thread_active) {
+            if (dummybuf_thread_wait_active(adev, RETRY_NUMBER * DUMMYBUF_RETRY_MS)) {
                 usleep(10000); /* tfa9895 spk amp need more than 1ms i2s signal before giving dsp related i2c commands*/
                 if (pthread_create(&th, NULL, tfa9895_config_thread, (void* )adev) != 0) {
                     ALOGE("@@##THREAD_FADE_IN_UPPER_SPEAKER thread create fail");
                 }
             }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
             /* Then, dummybuf_thread_close() is called by tfa9895_config_thread() */
         }
     }
+
+    if (property_get("audio_hal.pcm_pool", value, "1") > 0 && atoi(value) != 0)
+        pcm_pool_init(adev);
+
+exit:
+    pthread_mutex_lock(&adev->init_lock);
+    adev->init_status = status;
+    android_atomic_release_store(1, &adev->init_done);
+    pthread_cond_broadcast(&adev->init_cond);
+    pthread_mutex_unlock(&adev->init_lock);
+    ALOGV("%s: done, status %d", __func__, status);
+
+    return NULL;
+}
+
+static int adev_open(const hw_module_t *module, const char *name,
+                     hw_device_t **device)
+{
+    struct audio_device *adev;
+    pthread_condattr_t attr;
+
+    ALOGD("%s: enter", __func__);
+    if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0) return -EINVAL;
+
+    adev = calloc(1, sizeof(struct audio_device));
+
+    adev->device.common.tag = HARDWARE_DEVICE_TAG;
+    adev->device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
+    adev->device.common.module = (struct hw_module_t *)module;
+    adev->device.common.close = adev_close;
+
+    adev->device.init_check = adev_init_check;
+    adev->device.set_voice_volume = adev_set_voice_volume;
+    adev->device.set_master_volume = adev_set_master_volume;
+    adev->device.get_master_volume = adev_get_master_volume;
+    adev->device.set_master_mute = adev_set_master_mute;
+    adev->device.get_master_mute = adev_get_master_mute;
+    adev->device.set_mode = adev_set_mode;
+    adev->device.set_mic_mute = adev_set_mic_mute;
+    adev->device.get_mic_mute = adev_get_mic_mute;
+    adev->device.set_parameters = adev_set_parameters;
+    adev->device.get_parameters = adev_get_parameters;
+    adev->device.get_input_buffer_size = adev_get_input_buffer_size;
+    adev->device.open_output_stream = adev_open_output_stream;
+    adev->device.close_output_stream = adev_close_output_stream;
+    adev->device.open_input_stream = adev_open_input_stream;
+    adev->device.close_input_stream = adev_close_input_stream;
+    adev->device.dump = adev_dump;
+
+    /* Set the default route before the PCM stream is opened */
+    adev->mode = AUDIO_MODE_NORMAL;
+    adev->active_input = NULL;
+    adev->primary_output = NULL;
+    adev->voice_volume = 1.0f;
+    adev->tty_mode = TTY_MODE_OFF;
+    adev->bluetooth_nrec = true;
+    adev->in_call = false;
+    /* adev->cur_hdmi_channels = 0;  by calloc() */
+    adev->snd_dev_ref_cnt = calloc(SND_DEVICE_MAX, sizeof(int));
+
+    adev->dualmic_config = DUALMIC_CONFIG_NONE;
+    adev->ns_in_voice_rec = false;
+
+    list_init(&adev->usecase_list);
+    list_init(&adev->mixer_list);
+
+    latency_table_load(adev);
+
+#ifdef PREPROCESSING_ENABLED
+    pthread_mutex_init(&adev->echo_reference_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->echo_reference_cond, (const pthread_condattr_t *) NULL);
+#endif
+
+    pthread_mutex_init(&adev->dummybuf_thread_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->dummybuf_thread_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_init(&adev->init_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->init_cond, (const pthread_condattr_t *) NULL);
+    adev->init_first_open = audio_device_ref_count == 0;
+
     audio_device_ref_count++;
 
+    /* the profiles are shared by all the device instances */
+    if (adev->init_first_open)
+        pcm_profiles_load();
+
     char value[PROPERTY_VALUE_MAX];
     if (property_get("audio_hal.period_size", value, NULL) > 0) {
         int trial = atoi(value);
-        if (period_size_is_plausible_for_low_latency(trial)) {
+        if (period_size_is_plausible_for_low_latency(trial) &&
+                pcm_profiles_override_period_size(trial))
+            adev->period_size_override = trial;
+    }
 
-            pcm_device_playback.config.period_size = trial;
-            pcm_device_playback.config.start_threshold =
-                    PLAYBACK_START_THRESHOLD(trial, PLAYBACK_PERIOD_COUNT);
-            pcm_device_playback.config.stop_threshold =
-                    PLAYBACK_STOP_THRESHOLD(trial, PLAYBACK_PERIOD_COUNT);
+    if (property_get("audio_hal.async_write", value, NULL) > 0)
+        adev->async_write = atoi(value) != 0;
 
-            pcm_device_capture_low_latency.config.period_size = trial;
-        }
+    adev->adaptive_deep_buffer = true;
+    if (property_get("audio_hal.adaptive_deep_buffer", value, NULL) > 0)
+        adev->adaptive_deep_buffer = atoi(value) != 0;
+
+    adev->warm_standby_ms = WARM_STANDBY_DEFAULT_MS;
+    if (property_get("audio_hal.warm_standby_ms", value, NULL) > 0)
+        adev->warm_standby_ms = atoi(value);
+
+    adev->dither_output = true;
+    if (property_get("audio_hal.dither", value, NULL) > 0)
+        adev->dither_output = atoi(value) != 0;
+
+    adev->compiled_mixer_paths = true;
+    if (property_get("audio_hal.compiled_mixer_paths", value, NULL) > 0)
+        adev->compiled_mixer_paths = atoi(value) != 0;
+
+    /* the properties above apply to the PCM configurations used by init_thread */
+    if (pthread_create(&adev->init_thread, (const pthread_attr_t *) NULL,
+                       adev_init_thread, adev) != 0) {
+        ALOGW("%s: initializing synchronously", __func__);
+        adev_init_thread(adev);
+    } else {
+        adev->init_thread_active = true;
     }
 
+    *device = &adev->device.common;
     ALOGV("%s: exit", __func__);
     return 0;
 }
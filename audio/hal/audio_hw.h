@@ -24,7 +24,15 @@
 #include <tinycompress/tinycompress.h>
 /* TODO: remove resampler if possible when AudioFlinger supports downsampling from 48 to 8 */
 #include <audio_utils/resampler.h>
-#include <audio_route/audio_route.h>
+#include "audio_dsp.h"
+#include "audio_stats.h"
+#include "capture_ring.h"
+#include "route_cache.h"
+
+/* bionic defines it in <sys/cdefs.h>, the host C library does not */
+#ifndef __unused
+#define __unused __attribute__((__unused__))
+#endif
 
 /* Retry for delay in FW loading*/
 #define RETRY_NUMBER 10
@@ -139,6 +147,8 @@ enum {
 #define PLAYBACK_START_THRESHOLD(size, count) (((size) * (count)) - 1)
 #define PLAYBACK_STOP_THRESHOLD(size, count) ((size) * ((count) + 2))
 #define PLAYBACK_AVAILABLE_MIN 1
+/* mmap/NOIRQ playback: wake up once a full period can be written */
+#define PLAYBACK_MMAP_AVAILABLE_MIN(size) (size)
 
 
 #define SCO_PERIOD_SIZE 168
@@ -160,6 +170,23 @@ enum {
 
 #define PLAYBACK_HDMI_DEFAULT_CHANNEL_COUNT   2
 
+/* The HDMI codec PCM is not exposed by the kernel of this device and the mixer
+ * paths have no hdmi route, so AUX_DIGITAL is left unrouted. Define the card and
+ * device of the HDMI PCM, and add the "hdmi" and "speaker-and-hdmi" paths, to
+ * enable the multichannel output.
+ */
+/* #define HDMI_SOUND_CARD 1 */
+/* #define HDMI_PCM_DEVICE 3 */
+
+/* HDMI sink capabilities, read from the ELD of the codec (see hdmi_update_caps_l()) */
+#define HDMI_MAX_CHANNELS 8
+#define HDMI_ELD_MAX_SIZE 256
+#define HDMI_ELD_MNL_OFFSET 4           /* bits 4:0: monitor name length */
+#define HDMI_ELD_SAD_COUNT_OFFSET 5     /* bits 7:4: number of short audio descriptors */
+#define HDMI_ELD_MONITOR_NAME_OFFSET 20
+#define HDMI_SAD_SIZE 3
+#define HDMI_SAD_FORMAT_LPCM 1
+
 #define CAPTURE_PERIOD_SIZE 1024
 #define CAPTURE_PERIOD_SIZE_LOW_LATENCY 256
 #define CAPTURE_PERIOD_COUNT 2
@@ -176,9 +203,94 @@ enum {
 #define COMPRESS_OFFLOAD_PLAYBACK_LATENCY 96
 #define COMPRESS_PLAYBACK_VOLUME_MAX 0x10000 //NV suggested value
 
+/* The deep buffer output opens the playback PCM of the primary output: it is
+ * not declared in audio_policy.conf, where both would be active at once.
+ */
 #define DEEP_BUFFER_OUTPUT_SAMPLING_RATE 48000
 #define DEEP_BUFFER_OUTPUT_PERIOD_SIZE 480
 #define DEEP_BUFFER_OUTPUT_PERIOD_COUNT 8
+/* Deep buffer PCM configuration while the screen is off: the playback thread
+ * is only woken up when three periods can be written.
+ */
+#define DEEP_BUFFER_SCREEN_OFF_PERIOD_SIZE 3840
+#define DEEP_BUFFER_SCREEN_OFF_PERIOD_COUNT 4
+#define DEEP_BUFFER_SCREEN_OFF_AVAILABLE_MIN (DEEP_BUFFER_SCREEN_OFF_PERIOD_SIZE * 3)
+/* Waits for the driver to play its queue before switching, see out_drain_pcm_devices_l() */
+#define PCM_DRAIN_MAX_TRIES 4
+
+/* Amplifier warm-up keep-alive played by dummybuf_thread() */
+#define DUMMYBUF_TIMEOUT_MS 18000
+/* While the PCM cannot be opened, the keep-alive retries after
+ * DUMMYBUF_RETRY_MS, doubling the delay up to DUMMYBUF_RETRY_MAX_MS, and gives
+ * up after DUMMYBUF_MAX_RETRIES attempts.
+ */
+#define DUMMYBUF_RETRY_MS 10
+#define DUMMYBUF_RETRY_MAX_MS 640
+#define DUMMYBUF_MAX_RETRIES 8
+
+/* Time the PCM devices of an output stay open after out_standby()
+ * (audio_hal.warm_standby_ms, 0 disables warm standby). Off by default: the
+ * held playback PCM is not handed over, so the other outputs, the keep-alive
+ * and the latency measurement cannot open it meanwhile. Only enable it with a
+ * single output on that PCM, keeping in mind that it adds to the standby delay
+ * of AudioFlinger.
+ */
+#define WARM_STANDBY_DEFAULT_MS 0
+
+/* In place xrun recovery, see out_pcm_recover_xrun(): attempts before falling
+ * back to standby, and size in samples of the silence buffer
+ */
+#define PCM_XRUN_MAX_RETRIES 2
+#define PCM_XRUN_SILENCE_SIZE 2048
+
+/* PCM handles opened ahead of time (audio_hal.pcm_pool), see pcm_pool_get().
+ * A handle nobody took is closed after PCM_POOL_IDLE_MS, like an output in
+ * warm standby, and opened again once a stream used the device.
+ */
+#define PCM_POOL_SIZE 2
+#define PCM_POOL_IDLE_MS 3000
+
+/* Decoupled writer for the low latency output (audio_hal.async_write) */
+#define ASYNC_WRITER_PERIOD_COUNT 2
+
+/* PCM device profile tuning, see pcm_profiles_load(). Values outside of these
+ * ranges are rejected.
+ */
+#define PCM_PROFILES_CONF_FILE_PATH "/system/etc/audio_pcm_profiles.conf"
+#define PCM_PROFILES_CONF_OVERRIDE_PATH "/data/misc/audio/audio_pcm_profiles.conf"
+#define PCM_PROFILE_MAX_CARDS 32
+#define PCM_PROFILE_MAX_DEVICES 64
+#define PCM_PROFILE_MAX_CHANNELS 8
+#define PCM_PROFILE_MIN_RATE 8000
+#define PCM_PROFILE_MAX_RATE 192000
+#define PCM_PROFILE_MIN_PERIOD_SIZE 16
+#define PCM_PROFILE_MAX_PERIOD_SIZE 16384
+#define PCM_PROFILE_MAX_PERIOD_COUNT 32
+
+/* Mixer paths of each card and their compiled form, see route_cache.h. The
+ * host benchmark overrides them.
+ */
+#ifndef MIXER_PATHS_XML_PATH
+#define MIXER_PATHS_XML_PATH "/system/etc/mixer_paths_%d.xml"
+#endif
+#ifndef MIXER_PATHS_COMPILED_PATH
+#define MIXER_PATHS_COMPILED_PATH "/data/misc/audio/mixer_paths_%d.bin"
+#endif
+
+/* Post-AP render latency table, see latency_table_load() */
+#define LATENCY_CONF_FILE_PATH "/system/etc/audio_latency.conf"
+#define LATENCY_CONF_OVERRIDE_PATH "/data/misc/audio/audio_latency.conf"
+#define LATENCY_UNKNOWN (-1)
+/* Loopback measurement: silence before the probe burst, burst length and
+ * capture window after it, all in ms. The result is averaged over
+ * LATENCY_MEASURE_RUNS runs.
+ */
+#define LATENCY_MEASURE_LEAD_MS 300
+#define LATENCY_MEASURE_PROBE_MS 2
+#define LATENCY_MEASURE_WINDOW_MS 500
+#define LATENCY_MEASURE_RUNS 3
+#define LATENCY_MEASURE_CAPTURE_PERIOD_COUNT 4
+#define LATENCY_MEASURE_MIN_THRESHOLD 1024
 
 #define MAX_SUPPORTED_CHANNEL_MASKS 2
 
@@ -229,6 +341,18 @@ enum {
     OFFLOAD_STATE_PAUSED_FLUSHED,
 };
 
+/* TFA9895 speaker amplifier configuration, driven by amp_config_thread() */
+enum {
+    AMP_STATE_READY,            /* amplifier configured for the current mode */
+    AMP_STATE_PENDING,          /* configuration requested, waiting for speaker playback */
+    AMP_STATE_WAIT_I2S,         /* speaker playback started, waiting for a stable I2S clock */
+    AMP_STATE_I2S_READY,        /* enough playback for the worker to configure the amplifier */
+    AMP_STATE_CONFIGURING,      /* worker is calling set_amp_mode() */
+};
+
+/* the amplifier needs a running I2S clock before receiving DSP commands */
+#define AMP_I2S_SETTLE_MS 100
+
 typedef enum {
     PCM_PLAYBACK = 0x1,
     PCM_CAPTURE = 0x2,
@@ -237,18 +361,97 @@ typedef enum {
     PCM_CAPTURE_LOW_LATENCY = 0x10,
 } usecase_type_t;
 
+/* Entry of the fixed size offload command queue, see send_offload_cmd_l() */
 struct offload_cmd {
-    struct listnode node;
     int             cmd;
-    int             data[];
+    int64_t         queued_ns; /* CLOCK_MONOTONIC time the command was queued */
+};
+
+/* At most one WAIT_FOR_BUFFER is queued at a time, the other commands are
+ * serialized by the framework so a few entries are enough.
+ */
+#define OFFLOAD_CMD_QUEUE_SIZE 8
+/* entries only used by WAIT_FOR_BUFFER and EXIT */
+#define OFFLOAD_CMD_RESERVED_SLOTS 2
+
+struct offload_cmd_stats {
+    uint32_t        sent;
+    uint32_t        coalesced;  /* WAIT_FOR_BUFFER dropped because one was queued */
+    uint32_t        max_depth;
+    uint32_t        waits;      /* completed compress_wait() calls */
+    int64_t         queue_ns_total; /* time between queueing and processing */
+    int64_t         queue_ns_max;
+    int64_t         wait_ns_total;  /* time blocked in compress_wait() */
+    int64_t         wait_ns_max;
+};
+
+/* Measured delay between the application processor and the transducer */
+struct latency_entry {
+    int32_t                    us;  /* LATENCY_UNKNOWN if not calibrated */
+    bool                       measured; /* loaded from the override file or measured */
 };
 
 struct pcm_device_profile {
+    const char        *name; /* in the profiles file and the dumps */
     struct pcm_config config;
     int               card;
     int               id;
     usecase_type_t    type;
     audio_devices_t   devices;
+    bool              tuned; /* loaded from the profiles file */
+};
+
+/* Timings and events of a stream, see out_dump() and in_dump() */
+struct stream_stats {
+    struct audio_histogram     io;             /* out_write() or in_read() */
+    struct audio_histogram     io_cpu;         /* CPU time of the calling thread in io */
+    struct audio_histogram     pcm;            /* PCM writes or reads */
+    struct audio_histogram     lock_wait;      /* stream mutex */
+    struct audio_histogram     pre_lock_wait;
+    uint32_t                   xruns;          /* PCM buffer ran empty or full */
+    volatile int32_t           xrun_recoveries; /* seen by the HAL, updated atomically */
+    uint32_t                   pcm_errors;
+    uint32_t                   standby_count;
+    uint32_t                   warm_standby_count;
+    int64_t                    last_pcm_ns;    /* end of the last PCM transfer, 0 in standby */
+};
+
+/* Cached LPCM capabilities of the HDMI sink, invalidated on hotplug */
+struct hdmi_caps {
+    bool                       valid;
+    int                        max_channels;
+    uint32_t                   lpcm_rates; /* CEA-861 SAD sample rate bits */
+    int                        sad_count;
+};
+
+/* Writes to a secondary PCM device of a stream from its own thread, see out_write_pcm_devices() */
+struct pcm_device_worker {
+    bool                       active;
+    pthread_t                  thread;
+    pthread_mutex_t            lock;
+    pthread_cond_t             cond;
+    bool                       exit;
+    bool                       pending;
+    struct stream_out*         out;
+    const void*                buffer;
+    size_t                     bytes;
+};
+
+/* A PCM device of the pool. pcm is an idle handle opened and prepared with flags
+ * and config. While the device is used by a stream, busy is set and lent is the
+ * pooled handle given to the stream, if any.
+ * Protected by the audio_device pcm_pool_lock.
+ */
+struct pcm_pool_entry {
+    struct pcm_device_profile*  profile;
+    unsigned int                flags;
+    struct pcm_config           config;
+    struct pcm*                 pcm;
+    struct pcm*                 lent;
+    bool                        busy;
+    bool                        opening;
+    bool                        refill;
+    int64_t                     idle_since_ns; /* CLOCK_MONOTONIC time pcm became idle */
 };
 
 struct pcm_device {
@@ -261,6 +464,17 @@ struct pcm_device {
     int16_t*                   res_buffer;
     size_t                     res_byte_count;
     int                        sound_trigger_handle;
+    unsigned int               flags; /* pcm_open() flags, includes PCM_MMAP in mmap mode */
+    unsigned int               channels; /* channel count the PCM was opened with */
+    /* channel conversion when the PCM has fewer or more channels than the stream */
+    int16_t*                   remix_buffer;
+    size_t                     remix_frames;
+    struct pcm_device_worker   worker;
+    unsigned int               period_size; /* silence queued after an underrun */
+    unsigned int               xrun_streak; /* consecutive xruns without a transfer */
+    /* capture: hardware timestamp and avail after the last read, see in_pcm_read() */
+    int64_t                    read_tstamp_ns;
+    unsigned int               read_avail;
 };
 
 struct stream_out {
@@ -290,7 +504,12 @@ struct stream_out {
     int                         offload_state;
     pthread_cond_t              offload_cond;
     pthread_t                   offload_thread;
-    struct listnode             offload_cmd_list;
+    /* command ring protected by lock */
+    struct offload_cmd          offload_cmds[OFFLOAD_CMD_QUEUE_SIZE];
+    unsigned int                offload_cmd_head;
+    unsigned int                offload_cmd_count;
+    bool                        offload_wait_queued;
+    struct offload_cmd_stats    offload_stats;
     bool                        offload_thread_blocked;
 
     stream_callback_t           offload_callback;
@@ -301,15 +520,65 @@ struct stream_out {
     struct audio_device*        dev;
 
 #ifdef PREPROCESSING_ENABLED
+    // last echo reference written, only used to stop it on standby
     struct echo_reference_itfe *echo_reference;
-    // echo_reference_generation indicates if the echo reference used by the output stream is
-    // in sync with the one known by the audio_device. When different from the generation stored
-    // in the audio_device the output stream must release the echo reference.
-    // always modified with audio device and stream mutex locked.
-    int32_t echo_reference_generation;
+    // set while a buffer is written to the echo reference, see put_echo_reference()
+    volatile int32_t             echo_reference_writing;
 #endif
 
-    bool                         is_fastmixer_affinity_set;
+    int                          fast_tid; /* thread writing, placed by out_write() */
+    /* PCM configuration of the deep buffer output, follows the screen state.
+     * Only changed when leaving standby, while nothing is queued in the driver.
+     */
+    const struct pcm_config*     deep_buffer_config;
+    /* 24 bit and float streams are converted to 16 bit into convert_buf,
+     * convert_frames at a time, before being written to the PCM devices.
+     */
+    int16_t*                     convert_buf;
+    size_t                       convert_frames;
+    struct dsp_dither            dither;
+    bool                         dither_enabled;
+
+    /* post-AP latency of the current route, updated by select_devices() */
+    volatile int32_t             render_latency_us;
+    /* set once the driver refused to open the PCM in mmap mode */
+    bool                         mmap_refused;
+
+    /* Warm standby: after out_standby() the PCM devices stay open and prepared
+     * and the usecase keeps its route until warm_standby_deadline_ns, when
+     * warm_standby_thread puts the output in standby for real. Protected by lock.
+     */
+    bool                         warm_standby;
+    bool                         warm_standby_enabled;
+    bool                         warm_standby_thread_exit;
+    int64_t                      warm_standby_deadline_ns;
+    pthread_cond_t               warm_standby_cond;
+    pthread_t                    warm_standby_thread;
+
+    /* backing store of the pcm_device resampler buffers, see out_alloc_res_buffers() */
+    int8_t*                      res_arena;
+    size_t                       res_arena_size;
+
+    /* Decoupled PCM writer: out_write() queues into ring_buf and writer_thread
+     * drains it to the PCM devices. ring_wr is only advanced by out_write() and
+     * ring_rd only by the writer thread, so the data path is lock free.
+     * writer_lock/writer_cond are only used to sleep and wake up either side.
+     */
+    bool                        writer_enabled;
+    pthread_t                   writer_thread;
+    pthread_mutex_t             writer_lock;
+    pthread_cond_t              writer_cond;
+    bool                        writer_exit;
+    bool                        writer_paused;
+    bool                        writer_busy;
+    int                         writer_status;
+    int8_t*                     ring_buf;
+    size_t                      ring_frames; /* power of 2 */
+    size_t                      ring_frame_size;
+    volatile int32_t            ring_rd;
+    volatile int32_t            ring_wr;
+
+    struct stream_stats         stats;
 };
 
 struct stream_in {
@@ -337,16 +606,13 @@ struct stream_in {
     size_t                              read_buf_size;
     size_t                              read_buf_frames;
 
-    int16_t *proc_buf_in;
+    struct capture_ring proc_ring; /* input of the pre-processing */
     int16_t *proc_buf_out;
     size_t proc_buf_size;
-    size_t proc_buf_frames;
 
 #ifdef PREPROCESSING_ENABLED
     struct echo_reference_itfe *echo_reference;
-    int16_t *ref_buf;
-    size_t ref_buf_size;
-    size_t ref_buf_frames;
+    struct capture_ring ref_ring;  /* echo reference frames not yet processed */
 
 #ifdef HW_AEC_LOOPBACK
     bool hw_echo_reference;
@@ -362,7 +628,9 @@ struct stream_in {
 #endif
 
     struct audio_device*                dev;
-    bool                                is_fastcapture_affinity_set;
+    int                                 fast_tid; /* thread reading, placed by in_read() */
+
+    struct stream_stats                 stats;
 };
 
 struct mixer_card {
@@ -370,7 +638,7 @@ struct mixer_card {
     struct listnode     uc_list_node[AUDIO_USECASE_MAX];
     int                 card;
     struct mixer*       mixer;
-    struct audio_route* audio_route;
+    struct route_cache* route_cache;
 };
 
 struct audio_usecase {
@@ -402,6 +670,7 @@ struct audio_device {
     struct listnode         usecase_list;
     bool                    speaker_lr_swap;
     unsigned int            cur_hdmi_channels;
+    struct hdmi_caps        hdmi_caps;
     int                     dualmic_config;
     bool                    ns_in_voice_rec;
 
@@ -410,13 +679,13 @@ struct audio_device {
     int                     (*offload_fx_stop_output)(audio_io_handle_t);
 
 #ifdef PREPROCESSING_ENABLED
-    struct echo_reference_itfe* echo_reference;
-    // echo_reference_generation indicates if the echo reference used by the output stream is
-    // in sync with the one known by the audio_device.
-    // incremented atomically with a memory barrier and audio device mutex locked but WITHOUT
-    // stream mutex locked: the stream will load it atomically with a barrier and re-read it
-    // with audio device mutex if needed
-    volatile int32_t        echo_reference_generation;
+    // modified with the audio device mutex locked, read by the primary output
+    // without it while echo_reference_published is set, see put_echo_reference()
+    struct echo_reference_itfe *echo_reference;
+    volatile int32_t        echo_reference_published;
+    volatile int32_t        echo_reference_waiting;
+    pthread_mutex_t         echo_reference_lock;
+    pthread_cond_t          echo_reference_cond;
 #endif
 
     void*                   htc_acoustic_lib;
@@ -431,17 +700,59 @@ struct audio_device {
     int                     (*sound_trigger_close_for_streaming)(int);
 
     int                     tfa9895_init;
-    int                     tfa9895_mode_change;
     pthread_mutex_t         tfa9895_lock;
 
-    int                     dummybuf_thread_timeout;
+    volatile int32_t        amp_state;
+    uint32_t                amp_i2s_frames;
+    bool                    amp_thread_exit;
+    pthread_mutex_t         amp_lock;
+    pthread_cond_t          amp_cond;
+    pthread_t               amp_thread;
+
     int                     dummybuf_thread_cancel;
     int                     dummybuf_thread_active;
+    int                     dummybuf_thread_running;
     audio_devices_t         dummybuf_thread_devices;
     pthread_mutex_t         dummybuf_thread_lock;
+    pthread_cond_t          dummybuf_thread_cond;
     pthread_t               dummybuf_thread;
 
     pthread_mutex_t         lock_inputs; /* see note below on mutex acquisition order */
+
+    /* updated with lock held, see lock_audio_device() */
+    struct audio_histogram  lock_wait;
+    struct audio_histogram  select_devices_time;
+    struct audio_histogram  select_devices_cpu;
+
+    bool                    async_write;
+    bool                    adaptive_deep_buffer;
+    bool                    dither_output;
+    bool                    compiled_mixer_paths;
+    int                     warm_standby_ms;
+    int                     period_size_override; /* audio_hal.period_size, 0 if unset */
+
+    struct pcm_pool_entry   pcm_pool[PCM_POOL_SIZE];
+    volatile int32_t        pcm_pool_count; /* entries published, see pcm_pool_add() */
+    bool                    pcm_pool_active;
+    pthread_mutex_t         pcm_pool_lock;
+    pthread_cond_t          pcm_pool_cond;
+    pthread_t               pcm_pool_thread;
+    bool                    pcm_pool_exit;
+
+    /* set once the mixers, vendor libraries and amplifier are ready, see adev_wait_init() */
+    volatile int32_t        init_done;
+    int                     init_status;
+    bool                    init_first_open;
+    bool                    init_thread_active;
+    pthread_mutex_t         init_lock;
+    pthread_cond_t          init_cond;
+    pthread_t               init_thread;
+
+    /* indexed by usecase and snd device, SND_DEVICE_NONE holds the usecase default */
+    struct latency_entry    latency_table[AUDIO_USECASE_MAX][SND_DEVICE_MAX];
+    bool                    latency_measuring;
+    snd_device_t            latency_measure_device;
+    pthread_t               latency_measure_thread;
 };
 
 /*
@@ -450,7 +761,14 @@ struct audio_device {
  * stream_in mutex must always be before stream_out mutex
  * if both have to be taken (see get_echo_reference(), put_echo_reference()...)
  * dummybuf_thread mutex is not related to the other mutexes with respect to order.
+ * stream_out writer_lock is taken last, after the stream_out and audio_device mutexes.
+ * amp_lock is taken after the audio_device mutex and is never held while calling into
+ * the amplifier library.
  * lock_inputs must be held in order to either close the input stream, or prevent closure.
+ * pcm_pool_lock is taken last and never held while calling back into the HAL.
+ * echo_reference_lock is taken last, by put_echo_reference() with the audio_device
+ * mutex held and by the primary output without any.
+ * adev_wait_init() is called with no mutex held, init_lock protects nothing else.
  */
 
 #endif // NVIDIA_AUDIO_HW_H
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include "audio_stats.h"
+
+void audio_histogram_add(struct audio_histogram *histogram, int64_t ns)
+{
+    uint32_t us = ns > 0 ? (uint32_t)(ns / 1000) : 0;
+    unsigned int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+
+    if (bucket >= AUDIO_HISTOGRAM_BUCKETS)
+        bucket = AUDIO_HISTOGRAM_BUCKETS - 1;
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += us;
+    if (us > histogram->max_us)
+        histogram->max_us = us;
+}
+
+uint32_t audio_histogram_percentile(const struct audio_histogram *histogram,
+                                    unsigned int permille)
+{
+    uint64_t target = ((uint64_t)histogram->count * permille + 999) / 1000;
+    uint64_t count = 0;
+    unsigned int i;
+
+    if (target == 0)
+        return 0;
+    /* the dumps may run concurrently with updates, count may not match the buckets */
+    for (i = 0; i < AUDIO_HISTOGRAM_BUCKETS - 1; i++) {
+        count += histogram->buckets[i];
+        if (count >= target)
+            return (1u << i) < histogram->max_us ? (1u << i) : histogram->max_us;
+    }
+    return histogram->max_us;
+}
+
+void audio_histogram_dump(const struct audio_histogram *histogram, const char *name, int fd)
+{
+    unsigned int i;
+
+    dprintf(fd, "    %s: %u, avg %u us, p50 %u us, p90 %u us, p99 %u us, max %u us\n", name,
+            histogram->count,
+            histogram->count ? (uint32_t)(histogram->total_us / histogram->count) : 0,
+            audio_histogram_percentile(histogram, 500),
+            audio_histogram_percentile(histogram, 900),
+            audio_histogram_percentile(histogram, 990), histogram->max_us);
+    if (histogram->count == 0)
+        return;
+    dprintf(fd, "     ");
+    for (i = 0; i < AUDIO_HISTOGRAM_BUCKETS - 1; i++) {
+        if (histogram->buckets[i] != 0)
+            dprintf(fd, " <%u:%u", 1u << i, histogram->buckets[i]);
+    }
+    if (histogram->buckets[i] != 0)
+        dprintf(fd, " >=%u:%u", 1u << (i - 1), histogram->buckets[i]);
+    dprintf(fd, " (us)\n");
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_AUDIO_STATS_H
+#define FLOUNDER_AUDIO_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Fixed size duration histograms, cheap enough to stay enabled in the write
+ * and read paths. Bucket 0 counts the durations under 1 us, bucket i those in
+ * [2^(i-1), 2^i) us and the last bucket everything longer.
+ *
+ * Not thread safe: each histogram is updated by a single thread at a time,
+ * usually with the lock it measures held. The dumps may read it concurrently
+ * and see a slightly inconsistent snapshot.
+ */
+
+#define AUDIO_HISTOGRAM_BUCKETS 20
+
+struct audio_histogram {
+    uint32_t buckets[AUDIO_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+void audio_histogram_add(struct audio_histogram *histogram, int64_t ns);
+
+/* Upper bound in us of the given percentile, in 1/1000, at the bucket
+ * resolution: the actual value is at least half of it.
+ */
+uint32_t audio_histogram_percentile(const struct audio_histogram *histogram,
+                                    unsigned int permille);
+
+/* Prints the count, average, percentiles and maximum, then the non empty buckets */
+void audio_histogram_dump(const struct audio_histogram *histogram, const char *name, int fd);
+
+#endif // FLOUNDER_AUDIO_STATS_H
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_capture_ring"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cutils/ashmem.h>
+#include <cutils/log.h>
+
+#include "capture_ring.h"
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b != 0) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Maps an ashmem region twice, back to back. The size is a multiple of both
+ * the page and the frame size.
+ */
+static int8_t *ring_map_mirrored(size_t frames, size_t frame_size, size_t *map_size)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t unit = page_size / gcd(page_size, frame_size) * frame_size;
+    size_t size = (frames * frame_size + unit - 1) / unit * unit;
+    int8_t *base;
+    int fd;
+
+    fd = ashmem_create_region("audio capture ring", size);
+    if (fd < 0)
+        return NULL;
+
+    /* reserve the address range, then replace both halves */
+    base = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+                MAP_FAILED) {
+        munmap(base, size * 2);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    *map_size = size;
+    return base;
+}
+
+static void ring_release(struct capture_ring *ring)
+{
+    if (ring->buf == NULL)
+        return;
+    if (ring->map_size != 0)
+        munmap(ring->buf, ring->map_size * 2);
+    else
+        free(ring->buf);
+    ring->buf = NULL;
+    ring->capacity = 0;
+    ring->map_size = 0;
+}
+
+static int ring_grow(struct capture_ring *ring, size_t frames, size_t frame_size)
+{
+    struct capture_ring grown;
+
+    memset(&grown, 0, sizeof(grown));
+    grown.frame_size = frame_size;
+    grown.buf = ring_map_mirrored(frames, frame_size, &grown.map_size);
+    if (grown.buf != NULL) {
+        grown.capacity = grown.map_size / frame_size;
+    } else {
+        ALOGW("%s: cannot map a mirrored buffer (%d), using a plain one", __func__, errno);
+        grown.capacity = frames * 2;
+        grown.buf = (int8_t *)malloc(grown.capacity * frame_size);
+        if (grown.buf == NULL)
+            return -ENOMEM;
+    }
+
+    /* the queued frames are contiguous in both layouts */
+    if (ring->frames != 0 && ring->frame_size == frame_size) {
+        memcpy(grown.buf, capture_ring_read_ptr(ring), ring->frames * frame_size);
+        grown.frames = ring->frames;
+    }
+    ALOGV("%s: %zu frames of %zu bytes%s", __func__, grown.capacity, frame_size,
+          grown.map_size != 0 ? ", mirrored" : "");
+
+    ring_release(ring);
+    *ring = grown;
+    return 0;
+}
+
+int capture_ring_reserve(struct capture_ring *ring, size_t frames, size_t frame_size)
+{
+    if (frame_size == 0)
+        return -EINVAL;
+    if (ring->frame_size != frame_size) {
+        ring->frames = 0;
+        ring->offset = 0;
+    }
+    if (ring->buf == NULL || ring->frame_size != frame_size || ring->capacity < frames)
+        return ring_grow(ring, frames, frame_size);
+
+    if (ring->map_size == 0 && ring->offset + frames > ring->capacity) {
+        memmove(ring->buf, ring->buf + ring->offset * frame_size, ring->frames * frame_size);
+        ring->offset = 0;
+    }
+    return 0;
+}
+
+void *capture_ring_read_ptr(const struct capture_ring *ring)
+{
+    return ring->buf + ring->offset * ring->frame_size;
+}
+
+void *capture_ring_write_ptr(const struct capture_ring *ring)
+{
+    size_t offset = ring->offset + ring->frames;
+
+    if (ring->map_size != 0 && offset >= ring->capacity)
+        offset -= ring->capacity;
+    return ring->buf + offset * ring->frame_size;
+}
+
+void capture_ring_produce(struct capture_ring *ring, size_t frames)
+{
+    ALOG_ASSERT(ring->frames + frames <= ring->capacity, "capture ring overflow");
+    ring->frames += frames;
+}
+
+void capture_ring_consume(struct capture_ring *ring, size_t frames)
+{
+    if (frames > ring->frames)
+        frames = ring->frames;
+    ring->frames -= frames;
+    ring->offset += frames;
+    if (ring->map_size != 0) {
+        if (ring->offset >= ring->capacity)
+            ring->offset -= ring->capacity;
+    } else if (ring->frames == 0) {
+        ring->offset = 0;
+    }
+}
+
+void capture_ring_reset(struct capture_ring *ring)
+{
+    ring->frames = 0;
+    ring->offset = 0;
+}
+
+void capture_ring_free(struct capture_ring *ring)
+{
+    ring_release(ring);
+    ring->frame_size = 0;
+    capture_ring_reset(ring);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_CAPTURE_RING_H
+#define FLOUNDER_CAPTURE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frame FIFO of the capture pre-processing, filled by PCM or echo reference
+ * reads and drained by the effects. Frames are released by moving an index and
+ * both the frames queued and the free space are always contiguous in memory,
+ * so they can be handed to the effects and to the readers in place.
+ *
+ * The buffer is an ashmem region mapped twice, back to back, so that a window
+ * running past its end continues at its start. If that fails, it is a plain
+ * buffer twice the size requested, where the queued frames are moved back to
+ * the start once the free space left at the end is too short, about once per
+ * reservation size read.
+ *
+ * Not thread safe: used by the capture thread, with in->lock held.
+ */
+
+struct capture_ring {
+    int8_t *buf;
+    size_t frame_size;
+    size_t capacity;        /* in frames */
+    size_t offset;          /* of the oldest frame queued */
+    size_t frames;          /* queued */
+    size_t map_size;        /* size of each of the two mappings, 0 if not mirrored */
+};
+
+/* Makes the next windows of up to frames frames contiguous: the free space
+ * after the queued frames, then the queued frames once filled up to frames.
+ * Allocates only when frames or frame_size grow, a change of frame_size drops
+ * the queued frames.
+ */
+int capture_ring_reserve(struct capture_ring *ring, size_t frames, size_t frame_size);
+
+void *capture_ring_read_ptr(const struct capture_ring *ring);
+void *capture_ring_write_ptr(const struct capture_ring *ring);
+void capture_ring_produce(struct capture_ring *ring, size_t frames);
+void capture_ring_consume(struct capture_ring *ring, size_t frames);
+
+/* Drops the queued frames, keeps the buffer */
+void capture_ring_reset(struct capture_ring *ring);
+void capture_ring_free(struct capture_ring *ring);
+
+#endif // FLOUNDER_CAPTURE_RING_H
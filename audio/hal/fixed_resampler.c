@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_fixed_resampler"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "audio_dsp.h"
+#include "fixed_resampler.h"
+
+/* passband edge, as a fraction of the Nyquist frequency of the lower rate */
+#define FIXED_RESAMPLER_CUTOFF 0.9
+/* about 80 dB of stopband attenuation */
+#define FIXED_RESAMPLER_KAISER_BETA 8.0
+/* input frames appended to the history at a time */
+#define FIXED_RESAMPLER_CHUNK_FRAMES 256
+
+struct fixed_resampler {
+    struct resampler_itfe itfe;     /* first, what the callers see */
+    struct resampler_buffer_provider *provider;
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t channels;
+    bool decimate;
+    unsigned int factor;
+    unsigned int taps;              /* input frames of the window of one output */
+    unsigned int phases;            /* factor when interpolating, else 1 */
+    int16_t *coefs;                 /* phases * taps, reversed to follow the input */
+    /* input of each channel, one after the other: x_capacity frames each */
+    int16_t *x;
+    size_t x_capacity;
+    size_t x_frames;
+    size_t pos;                     /* start of the window of the next output */
+    unsigned int phase;
+};
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/* Designs the prototype lowpass at the higher rate and splits it in phases */
+static int fixed_resampler_design(struct fixed_resampler *rsmp)
+{
+    size_t length = rsmp->taps * rsmp->phases;
+    double fc = FIXED_RESAMPLER_CUTOFF * 0.5 / rsmp->factor;
+    double center = (length - 1) / 2.0;
+    double *h;
+    double sum = 0.0, scale;
+    unsigned int p, i;
+    size_t k;
+    int32_t abs_sum;
+    int ret = 0;
+
+    h = (double *)malloc(length * sizeof(double));
+    if (h == NULL)
+        return -ENOMEM;
+    for (k = 0; k < length; k++) {
+        double t = k - center;
+        double r = t / (center + 0.5);
+        double sinc = t == 0.0 ? 1.0 : sin(2.0 * M_PI * fc * t) / (2.0 * M_PI * fc * t);
+
+        h[k] = 2.0 * fc * sinc * bessel_i0(FIXED_RESAMPLER_KAISER_BETA * sqrt(1.0 - r * r)) /
+               bessel_i0(FIXED_RESAMPLER_KAISER_BETA);
+        sum += h[k];
+    }
+
+    /* unity gain at DC, for each phase when interpolating */
+    scale = rsmp->phases * 32768.0 / sum;
+    for (p = 0; p < rsmp->phases; p++) {
+        abs_sum = 0;
+        for (i = 0; i < rsmp->taps; i++) {
+            long q = lrint(h[p + (size_t)(rsmp->taps - 1 - i) * rsmp->phases] * scale);
+
+            if (q > INT16_MAX)
+                q = INT16_MAX;
+            else if (q < INT16_MIN)
+                q = INT16_MIN;
+            rsmp->coefs[p * rsmp->taps + i] = (int16_t)q;
+            abs_sum += q < 0 ? -q : q;
+        }
+        /* keeps the sums of dsp_dot_s16() within 32 bits */
+        if (abs_sum > INT16_MAX * 2) {
+            ALOGW("%s: phase %u gain too high (%d)", __func__, p, abs_sum);
+            ret = -EINVAL;
+        }
+    }
+    free(h);
+    return ret;
+}
+
+static void fixed_resampler_reset(struct resampler_itfe *resampler)
+{
+    struct fixed_resampler *rsmp = (struct fixed_resampler *)resampler;
+
+    /* silence before the first frame, the window of the first output ends on it */
+    memset(rsmp->x, 0, rsmp->x_capacity * rsmp->channels * sizeof(int16_t));
+    rsmp->x_frames = rsmp->taps - 1;
+    rsmp->pos = 0;
+    rsmp->phase = 0;
+}
+
+/* Computes up to frames output frames from the input available */
+static size_t fixed_resampler_process(struct fixed_resampler *rsmp, int16_t *out, size_t frames)
+{
+    size_t done = 0;
+    uint32_t ch;
+
+    while (done < frames && rsmp->pos + rsmp->taps <= rsmp->x_frames) {
+        const int16_t *coefs = rsmp->coefs + rsmp->phase * rsmp->taps;
+
+        for (ch = 0; ch < rsmp->channels; ch++) {
+            int32_t acc = dsp_dot_s16(coefs, rsmp->x + ch * rsmp->x_capacity + rsmp->pos,
+                                      rsmp->taps);
+
+            acc = (acc + (1 << 14)) >> 15;
+            if (acc > INT16_MAX)
+                acc = INT16_MAX;
+            else if (acc < INT16_MIN)
+                acc = INT16_MIN;
+            *out++ = (int16_t)acc;
+        }
+        done++;
+
+        if (rsmp->decimate) {
+            rsmp->pos += rsmp->factor;
+        } else if (++rsmp->phase == rsmp->phases) {
+            rsmp->phase = 0;
+            rsmp->pos++;
+        }
+    }
+    return done;
+}
+
+/* Appends up to frames interleaved input frames, returns the number taken */
+static size_t fixed_resampler_append(struct fixed_resampler *rsmp, const int16_t *in,
+                                     size_t frames)
+{
+    uint8_t map;
+    uint32_t ch;
+
+    /* drop the frames before the next window, less than taps frames are kept as
+     * this is only called once the window runs past the input */
+    if (rsmp->pos > 0) {
+        size_t kept = rsmp->x_frames - rsmp->pos;
+
+        for (ch = 0; ch < rsmp->channels; ch++) {
+            int16_t *x = rsmp->x + ch * rsmp->x_capacity;
+
+            memmove(x, x + rsmp->pos, kept * sizeof(int16_t));
+        }
+        rsmp->x_frames = kept;
+        rsmp->pos = 0;
+    }
+
+    if (frames > rsmp->x_capacity - rsmp->x_frames)
+        frames = rsmp->x_capacity - rsmp->x_frames;
+    for (ch = 0; ch < rsmp->channels; ch++) {
+        map = ch;
+        dsp_extract_channels_s16(rsmp->x + ch * rsmp->x_capacity + rsmp->x_frames, 1,
+                                 in, rsmp->channels, &map, frames);
+    }
+    rsmp->x_frames += frames;
+    return frames;
+}
+
+static int fixed_resampler_resample_from_input(struct resampler_itfe *resampler,
+                                               int16_t *in, size_t *inFrameCount,
+                                               int16_t *out, size_t *outFrameCount)
+{
+    struct fixed_resampler *rsmp = (struct fixed_resampler *)resampler;
+    size_t in_done = 0, out_done = 0;
+
+    if (in == NULL || out == NULL || inFrameCount == NULL || outFrameCount == NULL)
+        return -EINVAL;
+
+    for (;;) {
+        out_done += fixed_resampler_process(rsmp, out + out_done * rsmp->channels,
+                                            *outFrameCount - out_done);
+        if (out_done == *outFrameCount || in_done == *inFrameCount)
+            break;
+        in_done += fixed_resampler_append(rsmp, in + in_done * rsmp->channels,
+                                          *inFrameCount - in_done);
+    }
+    *inFrameCount = in_done;
+    *outFrameCount = out_done;
+    return 0;
+}
+
+static int fixed_resampler_resample_from_provider(struct resampler_itfe *resampler,
+                                                  int16_t *out, size_t *outFrameCount)
+{
+    struct fixed_resampler *rsmp = (struct fixed_resampler *)resampler;
+    struct resampler_buffer buf;
+    size_t out_done = 0;
+    size_t taken;
+
+    if (rsmp->provider == NULL || out == NULL || outFrameCount == NULL)
+        return -EINVAL;
+
+    for (;;) {
+        out_done += fixed_resampler_process(rsmp, out + out_done * rsmp->channels,
+                                            *outFrameCount - out_done);
+        if (out_done == *outFrameCount)
+            break;
+
+        buf.frame_count = FIXED_RESAMPLER_CHUNK_FRAMES;
+        rsmp->provider->get_next_buffer(rsmp->provider, &buf);
+        if (buf.raw == NULL || buf.frame_count == 0)
+            break;
+        taken = fixed_resampler_append(rsmp, buf.i16, buf.frame_count);
+        buf.frame_count = taken;
+        rsmp->provider->release_buffer(rsmp->provider, &buf);
+    }
+    *outFrameCount = out_done;
+    return 0;
+}
+
+static int32_t fixed_resampler_delay_ns(struct resampler_itfe *resampler)
+{
+    struct fixed_resampler *rsmp = (struct fixed_resampler *)resampler;
+    uint32_t high_rate = rsmp->decimate ? rsmp->in_rate : rsmp->out_rate;
+    int64_t delay_ns;
+
+    /* half of the filter, plus the input frames past the next window */
+    delay_ns = (int64_t)(rsmp->taps * rsmp->phases - 1) * 500000000LL / high_rate;
+    if (rsmp->x_frames > rsmp->pos + rsmp->taps - 1)
+        delay_ns += (int64_t)(rsmp->x_frames - rsmp->pos - rsmp->taps + 1) * 1000000000LL /
+                    rsmp->in_rate;
+    return (int32_t)delay_ns;
+}
+
+int create_fixed_resampler(uint32_t in_rate, uint32_t out_rate, uint32_t channels,
+                           struct resampler_buffer_provider *provider,
+                           struct resampler_itfe **resampler)
+{
+    struct fixed_resampler *rsmp;
+    int ret;
+
+    if (resampler == NULL || channels == 0 || in_rate == 0 || out_rate == 0 ||
+            in_rate == out_rate)
+        return -EINVAL;
+    if (in_rate > out_rate ? in_rate % out_rate != 0 : out_rate % in_rate != 0)
+        return -EINVAL;
+    if ((in_rate > out_rate ? in_rate / out_rate : out_rate / in_rate) >
+            FIXED_RESAMPLER_MAX_FACTOR)
+        return -EINVAL;
+
+    rsmp = (struct fixed_resampler *)calloc(1, sizeof(struct fixed_resampler));
+    if (rsmp == NULL)
+        return -ENOMEM;
+
+    rsmp->itfe.reset = fixed_resampler_reset;
+    rsmp->itfe.resample_from_provider = fixed_resampler_resample_from_provider;
+    rsmp->itfe.resample_from_input = fixed_resampler_resample_from_input;
+    rsmp->itfe.delay_ns = fixed_resampler_delay_ns;
+    rsmp->provider = provider;
+    rsmp->in_rate = in_rate;
+    rsmp->out_rate = out_rate;
+    rsmp->channels = channels;
+    rsmp->decimate = in_rate > out_rate;
+    if (rsmp->decimate) {
+        rsmp->factor = in_rate / out_rate;
+        rsmp->taps = FIXED_RESAMPLER_TAPS * rsmp->factor;
+        rsmp->phases = 1;
+    } else {
+        rsmp->factor = out_rate / in_rate;
+        rsmp->taps = FIXED_RESAMPLER_TAPS;
+        rsmp->phases = rsmp->factor;
+    }
+    rsmp->x_capacity = rsmp->taps + rsmp->factor + FIXED_RESAMPLER_CHUNK_FRAMES;
+
+    rsmp->coefs = (int16_t *)malloc(rsmp->phases * rsmp->taps * sizeof(int16_t));
+    rsmp->x = (int16_t *)malloc(rsmp->x_capacity * channels * sizeof(int16_t));
+    if (rsmp->coefs == NULL || rsmp->x == NULL) {
+        ret = -ENOMEM;
+        goto error;
+    }
+    ret = fixed_resampler_design(rsmp);
+    if (ret != 0)
+        goto error;
+    fixed_resampler_reset(&rsmp->itfe);
+
+    ALOGV("%s: %u Hz to %u Hz, %u channels, %u taps", __func__, in_rate, out_rate, channels,
+          rsmp->taps);
+    *resampler = &rsmp->itfe;
+    return 0;
+
+error:
+    free(rsmp->x);
+    free(rsmp->coefs);
+    free(rsmp);
+    return ret;
+}
+
+bool is_fixed_resampler(const struct resampler_itfe *resampler)
+{
+    return resampler != NULL && resampler->reset == fixed_resampler_reset;
+}
+
+void release_fixed_resampler(struct resampler_itfe *resampler)
+{
+    struct fixed_resampler *rsmp = (struct fixed_resampler *)resampler;
+
+    if (rsmp == NULL)
+        return;
+    free(rsmp->x);
+    free(rsmp->coefs);
+    free(rsmp);
+}
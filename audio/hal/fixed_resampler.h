@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_FIXED_RESAMPLER_H
+#define FLOUNDER_FIXED_RESAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <audio_utils/resampler.h>
+
+/*
+ * Polyphase FIR resampler for rates that are an integer multiple of each
+ * other, e.g. 48 kHz to 16 or 8 kHz and 8 kHz to 48 kHz. Only the output
+ * samples needed are computed: FIXED_RESAMPLER_TAPS taps per output sample
+ * when interpolating, that many per input period of the output when
+ * decimating. The filter is a Kaiser windowed sinc designed once at creation,
+ * with Q15 coefficients, and the inner loop is dsp_dot_s16().
+ *
+ * It implements the resampler_itfe of audio_utils and can replace it, but
+ * must be released with release_fixed_resampler().
+ */
+
+#define FIXED_RESAMPLER_TAPS 32
+/* largest ratio handled, the others are left to the audio_utils resampler */
+#define FIXED_RESAMPLER_MAX_FACTOR 12
+
+/* Returns -EINVAL if the ratio of the rates is not an integer up to
+ * FIXED_RESAMPLER_MAX_FACTOR. provider may be NULL if only
+ * resample_from_input() is used.
+ */
+int create_fixed_resampler(uint32_t in_rate, uint32_t out_rate, uint32_t channels,
+                           struct resampler_buffer_provider *provider,
+                           struct resampler_itfe **resampler);
+
+/* True if resampler was created by create_fixed_resampler() */
+bool is_fixed_resampler(const struct resampler_itfe *resampler);
+
+void release_fixed_resampler(struct resampler_itfe *resampler);
+
+#endif // FLOUNDER_FIXED_RESAMPLER_H
@@ -0,0 +1,962 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_route"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <expat.h>
+
+#include "route_cache.h"
+
+#define ROUTE_CACHE_BUF_SIZE 1024
+/* path changes queued before route_cache_update_mixer() */
+#define ROUTE_CACHE_MAX_OPS 8
+#define ROUTE_CACHE_MEMO_SIZE 32
+/* route_setting.index of a setting that covers all the values of a control */
+#define ROUTE_CACHE_ALL_VALUES -1
+
+/* path indexes must fit the 15 bits of a queued operation */
+#define ROUTE_CACHE_MAX_PATHS 0x7fff
+#define ROUTE_CACHE_MAX_SETTINGS 0x100000
+
+#define ROUTE_CACHE_FILE_MAGIC 0x52544331 /* "RTC1" */
+#define ROUTE_CACHE_FILE_VERSION 1
+
+#define ROUTE_OP(path, apply) ((uint16_t)(((path) << 1) | ((apply) ? 1 : 0)))
+#define ROUTE_OP_PATH(op) ((op) >> 1)
+#define ROUTE_OP_APPLY(op) ((op) & 1)
+
+struct route_ctl {
+    struct mixer_ctl *ctl;
+    unsigned int num_values;
+    int *reset_value;
+    int *new_value;
+    int *hw_value;
+    bool dirty;
+};
+
+struct route_setting {
+    unsigned int ctl;
+    int index;
+    int value;
+};
+
+struct route_path {
+    char *name;
+    struct route_setting *settings;
+    unsigned int count;
+    unsigned int size;
+};
+
+/*
+ * Compiled form of a mixer_paths file, written next to the first successful
+ * parse and mapped read only afterwards. All the fields are 32 bit words in the
+ * device byte order, the file is laid out as:
+ *   header
+ *   uint32_t ctl_ids[num_ctls]           mixer control ids, see mixer_get_ctl()
+ *   struct route_file_path[num_paths]
+ *   struct route_setting[num_settings]   initial settings first, then the paths
+ *   char names[names_size]               path names, NUL terminated
+ * The settings and names are used in place from the mapping.
+ */
+struct route_file_header {
+    uint32_t magic;
+    uint32_t version;
+    /* source XML the file was compiled from */
+    uint32_t xml_size;
+    uint32_t xml_mtime_sec;
+    uint32_t xml_mtime_nsec;
+    uint32_t xml_hash;
+    /* controls of the card, a kernel update may renumber them */
+    uint32_t mixer_num_ctls;
+    uint32_t mixer_hash;
+    uint32_t num_ctls;
+    uint32_t num_paths;
+    uint32_t num_settings;
+    uint32_t num_init_settings;
+    uint32_t names_size;
+    uint32_t payload_hash;
+};
+
+struct route_file_path {
+    uint32_t name;
+    uint32_t first_setting;
+    uint32_t num_settings;
+};
+
+struct route_source {
+    uint32_t size;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t hash;
+};
+
+/* Final values of the controls touched by a sequence of path changes */
+struct route_transition {
+    uint16_t ops[ROUTE_CACHE_MAX_OPS];
+    unsigned int num_ops;
+    struct route_setting *deltas;
+    unsigned int num_deltas;
+};
+
+struct route_cache {
+    struct mixer *mixer;
+    struct route_ctl *ctls;
+    unsigned int num_ctls;
+    unsigned int ctls_size;
+    struct route_path *paths;
+    unsigned int num_paths;
+    unsigned int paths_size;
+    /* settings of the controls outside of any path, applied at init */
+    struct route_path init;
+
+    /* compiled file the settings and path names point into, if loaded from it */
+    void *map;
+    size_t map_size;
+
+    unsigned int *dirty;
+    unsigned int num_dirty;
+    uint16_t pending[ROUTE_CACHE_MAX_OPS];
+    unsigned int num_pending;
+    struct route_transition memo[ROUTE_CACHE_MEMO_SIZE];
+
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int writes;
+    bool compiled;
+
+    /* parser state */
+    struct route_path *cur_path;
+    unsigned int path_depth;
+    bool parse_error;
+};
+
+static uint32_t route_hash(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static int route_find_ctl(struct route_cache *cache, struct mixer_ctl *ctl)
+{
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ctls; i++) {
+        if (cache->ctls[i].ctl == ctl)
+            return i;
+    }
+    return -1;
+}
+
+/* Tracks a control, starting from its current value */
+static int route_track_ctl(struct route_cache *cache, struct mixer_ctl *ctl)
+{
+    struct route_ctl *rctl;
+    unsigned int i;
+
+    if (cache->num_ctls == cache->ctls_size) {
+        struct route_ctl *ctls;
+        unsigned int size = cache->ctls_size ? cache->ctls_size * 2 : 16;
+
+        ctls = realloc(cache->ctls, size * sizeof(struct route_ctl));
+        if (ctls == NULL)
+            return -ENOMEM;
+        cache->ctls = ctls;
+        cache->ctls_size = size;
+    }
+
+    rctl = &cache->ctls[cache->num_ctls];
+    memset(rctl, 0, sizeof(*rctl));
+    rctl->ctl = ctl;
+    rctl->num_values = mixer_ctl_get_num_values(ctl);
+    rctl->reset_value = calloc(rctl->num_values * 3, sizeof(int));
+    if (rctl->reset_value == NULL)
+        return -ENOMEM;
+    rctl->new_value = rctl->reset_value + rctl->num_values;
+    rctl->hw_value = rctl->new_value + rctl->num_values;
+    for (i = 0; i < rctl->num_values; i++) {
+        rctl->hw_value[i] = mixer_ctl_get_value(ctl, i);
+        rctl->new_value[i] = rctl->hw_value[i];
+    }
+
+    return cache->num_ctls++;
+}
+
+static int route_add_ctl(struct route_cache *cache, const char *name)
+{
+    struct mixer_ctl *ctl = mixer_get_ctl_by_name(cache->mixer, name);
+    int index;
+
+    if (ctl == NULL) {
+        ALOGW("%s: unknown control '%s'", __func__, name);
+        return -ENOENT;
+    }
+    index = route_find_ctl(cache, ctl);
+    if (index >= 0)
+        return index;
+    return route_track_ctl(cache, ctl);
+}
+
+static int route_parse_value(struct route_ctl *rctl, const char *string)
+{
+    unsigned int i;
+
+    if (mixer_ctl_get_type(rctl->ctl) == MIXER_CTL_TYPE_ENUM) {
+        for (i = 0; i < mixer_ctl_get_num_enums(rctl->ctl); i++) {
+            if (strcmp(string, mixer_ctl_get_enum_string(rctl->ctl, i)) == 0)
+                return i;
+        }
+        ALOGW("%s: unknown value '%s' for '%s'", __func__, string,
+              mixer_ctl_get_name(rctl->ctl));
+        return -EINVAL;
+    }
+    return atoi(string);
+}
+
+/* Sets the logical value of a control, mixer writes are deferred to route_update() */
+static void route_set_value(struct route_cache *cache, unsigned int ctl, int index, int value)
+{
+    struct route_ctl *rctl = &cache->ctls[ctl];
+    unsigned int i;
+
+    if (index == ROUTE_CACHE_ALL_VALUES) {
+        for (i = 0; i < rctl->num_values; i++)
+            rctl->new_value[i] = value;
+    } else if ((unsigned int)index < rctl->num_values) {
+        rctl->new_value[index] = value;
+    }
+    if (!rctl->dirty) {
+        rctl->dirty = true;
+        cache->dirty[cache->num_dirty++] = ctl;
+    }
+}
+
+static int route_path_add_setting(struct route_path *path, const struct route_setting *setting)
+{
+    if (path->count == path->size) {
+        struct route_setting *settings;
+        unsigned int size = path->size ? path->size * 2 : 8;
+
+        settings = realloc(path->settings, size * sizeof(struct route_setting));
+        if (settings == NULL)
+            return -ENOMEM;
+        path->settings = settings;
+        path->size = size;
+    }
+    path->settings[path->count++] = *setting;
+    return 0;
+}
+
+static void route_start_tag(void *data, const XML_Char *tag_name, const XML_Char **attr)
+{
+    struct route_cache *cache = (struct route_cache *)data;
+    const XML_Char *name = NULL;
+    const XML_Char *value = NULL;
+    const XML_Char *id = NULL;
+    struct route_setting setting;
+    struct route_path *path;
+    unsigned int i;
+    int index;
+    int ctl;
+
+    for (i = 0; attr[i] != NULL; i += 2) {
+        if (strcmp(attr[i], "name") == 0)
+            name = attr[i + 1];
+        else if (strcmp(attr[i], "value") == 0)
+            value = attr[i + 1];
+        else if (strcmp(attr[i], "id") == 0)
+            id = attr[i + 1];
+    }
+
+    if (strcmp(tag_name, "path") == 0) {
+        if (name == NULL) {
+            ALOGE("%s: path without a name", __func__);
+            cache->parse_error = true;
+            return;
+        }
+        if (cache->path_depth++ > 0) {
+            /* a path used inside another one brings its settings along */
+            index = route_cache_get_path(cache, name);
+            if (index < 0 || &cache->paths[index] == cache->cur_path) {
+                ALOGE("%s: path '%s' used before being defined", __func__, name);
+                cache->parse_error = true;
+                return;
+            }
+            path = &cache->paths[index];
+            for (i = 0; i < path->count; i++) {
+                if (route_path_add_setting(cache->cur_path, &path->settings[i]) != 0)
+                    cache->parse_error = true;
+            }
+            return;
+        }
+        if (route_cache_get_path(cache, name) >= 0) {
+            ALOGE("%s: path '%s' defined twice", __func__, name);
+            cache->parse_error = true;
+            return;
+        }
+        if (cache->num_paths == cache->paths_size) {
+            unsigned int size = cache->paths_size ? cache->paths_size * 2 : 16;
+
+            path = realloc(cache->paths, size * sizeof(struct route_path));
+            if (path == NULL) {
+                cache->parse_error = true;
+                return;
+            }
+            cache->paths = path;
+            cache->paths_size = size;
+        }
+        path = &cache->paths[cache->num_paths++];
+        memset(path, 0, sizeof(*path));
+        path->name = strdup(name);
+        if (path->name == NULL)
+            cache->parse_error = true;
+        cache->cur_path = path;
+    } else if (strcmp(tag_name, "ctl") == 0) {
+        if (name == NULL || value == NULL) {
+            ALOGE("%s: ctl without a name or a value", __func__);
+            cache->parse_error = true;
+            return;
+        }
+        ctl = route_add_ctl(cache, name);
+        if (ctl == -ENOMEM)
+            cache->parse_error = true;
+        if (ctl < 0)
+            return;
+        setting.ctl = ctl;
+        setting.index = id != NULL ? atoi(id) : ROUTE_CACHE_ALL_VALUES;
+        setting.value = route_parse_value(&cache->ctls[ctl], value);
+        if (setting.value < 0 && mixer_ctl_get_type(cache->ctls[ctl].ctl) == MIXER_CTL_TYPE_ENUM)
+            return;
+
+        /* outside of a path, an initial mixer setting */
+        if (route_path_add_setting(cache->cur_path != NULL ? cache->cur_path : &cache->init,
+                                   &setting) != 0)
+            cache->parse_error = true;
+    }
+}
+
+static void route_end_tag(void *data, const XML_Char *tag_name)
+{
+    struct route_cache *cache = (struct route_cache *)data;
+
+    if (strcmp(tag_name, "path") == 0 && cache->path_depth > 0) {
+        if (--cache->path_depth == 0)
+            cache->cur_path = NULL;
+    }
+}
+
+static int route_parse(struct route_cache *cache, const char *xml_path)
+{
+    XML_Parser parser;
+    FILE *file;
+    void *buf;
+    int bytes;
+    int ret = 0;
+
+    file = fopen(xml_path, "r");
+    if (file == NULL) {
+        ALOGE("%s: cannot open %s", __func__, xml_path);
+        return -ENOENT;
+    }
+    parser = XML_ParserCreate(NULL);
+    if (parser == NULL) {
+        fclose(file);
+        return -ENOMEM;
+    }
+    XML_SetUserData(parser, cache);
+    XML_SetElementHandler(parser, route_start_tag, route_end_tag);
+
+    for (;;) {
+        buf = XML_GetBuffer(parser, ROUTE_CACHE_BUF_SIZE);
+        if (buf == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+        bytes = fread(buf, 1, ROUTE_CACHE_BUF_SIZE, file);
+        if (bytes < 0 ||
+                XML_ParseBuffer(parser, bytes, bytes == 0) == XML_STATUS_ERROR) {
+            ALOGE("%s: %s at line %lu", __func__,
+                  XML_ErrorString(XML_GetErrorCode(parser)),
+                  XML_GetCurrentLineNumber(parser));
+            ret = -EINVAL;
+            break;
+        }
+        if (cache->parse_error) {
+            ret = -EINVAL;
+            break;
+        }
+        if (bytes == 0)
+            break;
+    }
+
+    XML_ParserFree(parser);
+    fclose(file);
+    return ret;
+}
+
+static int route_read_source(const char *xml_path, struct route_source *source)
+{
+    char buf[ROUTE_CACHE_BUF_SIZE];
+    struct stat st;
+    ssize_t bytes;
+    int fd;
+
+    fd = open(xml_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -errno;
+    }
+    source->size = st.st_size;
+    source->mtime_sec = st.st_mtim.tv_sec;
+    source->mtime_nsec = st.st_mtim.tv_nsec;
+    /* the mtime alone is not enough, system images are built with fixed timestamps */
+    source->hash = 2166136261u;
+    while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+        source->hash = route_hash(source->hash, buf, bytes);
+    close(fd);
+    return bytes < 0 ? -EIO : 0;
+}
+
+/* Identifies the layout of the tracked controls: names, types, sizes and enum values */
+static uint32_t route_mixer_hash(struct route_cache *cache)
+{
+    struct mixer_ctl *ctl;
+    const char *string;
+    uint32_t hash = 2166136261u;
+    uint32_t word;
+    unsigned int i, j;
+
+    for (i = 0; i < cache->num_ctls; i++) {
+        ctl = cache->ctls[i].ctl;
+        string = mixer_ctl_get_name(ctl);
+        hash = route_hash(hash, string, strlen(string) + 1);
+        word = mixer_ctl_get_type(ctl);
+        hash = route_hash(hash, &word, sizeof(word));
+        hash = route_hash(hash, &cache->ctls[i].num_values, sizeof(cache->ctls[i].num_values));
+        if (word != MIXER_CTL_TYPE_ENUM)
+            continue;
+        for (j = 0; j < mixer_ctl_get_num_enums(ctl); j++) {
+            string = mixer_ctl_get_enum_string(ctl, j);
+            hash = route_hash(hash, string, strlen(string) + 1);
+        }
+    }
+    return hash;
+}
+
+static bool route_setting_valid(struct route_cache *cache, const struct route_setting *setting)
+{
+    return setting->ctl < cache->num_ctls &&
+            (setting->index == ROUTE_CACHE_ALL_VALUES ||
+             (setting->index >= 0 &&
+              (unsigned int)setting->index < cache->ctls[setting->ctl].num_values));
+}
+
+/* Releases the controls and paths, e.g. after a compiled file failed validation */
+static void route_clear(struct route_cache *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ctls; i++)
+        free(cache->ctls[i].reset_value);
+    if (cache->map == NULL) {
+        for (i = 0; i < cache->num_paths; i++) {
+            free(cache->paths[i].name);
+            free(cache->paths[i].settings);
+        }
+        free(cache->init.settings);
+    } else {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+    }
+    free(cache->ctls);
+    free(cache->paths);
+    cache->ctls = NULL;
+    cache->num_ctls = 0;
+    cache->ctls_size = 0;
+    cache->paths = NULL;
+    cache->num_paths = 0;
+    cache->paths_size = 0;
+    memset(&cache->init, 0, sizeof(cache->init));
+}
+
+static int route_load_file(struct route_cache *cache, const char *file_path,
+                           const struct route_source *source)
+{
+    const struct route_file_header *header;
+    const struct route_file_path *file_paths;
+    const uint32_t *ctl_ids;
+    struct route_setting *settings;
+    struct mixer_ctl *ctl;
+    unsigned int mixer_num_ctls = mixer_get_num_ctls(cache->mixer);
+    const char *names;
+    struct stat st;
+    size_t size;
+    void *map;
+    unsigned int i;
+    int fd;
+
+    fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -ENOENT;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct route_file_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+    cache->map = map;
+    cache->map_size = st.st_size;
+
+    header = (const struct route_file_header *)map;
+    if (header->magic != ROUTE_CACHE_FILE_MAGIC || header->version != ROUTE_CACHE_FILE_VERSION ||
+            header->xml_size != source->size || header->xml_mtime_sec != source->mtime_sec ||
+            header->xml_mtime_nsec != source->mtime_nsec || header->xml_hash != source->hash) {
+        ALOGV("%s: %s is stale", __func__, file_path);
+        goto error;
+    }
+    if (header->mixer_num_ctls != mixer_num_ctls || header->num_ctls > mixer_num_ctls ||
+            header->num_paths > ROUTE_CACHE_MAX_PATHS ||
+            header->num_settings > ROUTE_CACHE_MAX_SETTINGS ||
+            header->num_init_settings > header->num_settings ||
+            header->names_size == 0 || header->names_size > cache->map_size) {
+        ALOGW("%s: %s does not match the mixer", __func__, file_path);
+        goto error;
+    }
+    size = sizeof(*header) + header->num_ctls * sizeof(uint32_t) +
+            header->num_paths * sizeof(struct route_file_path) +
+            header->num_settings * sizeof(struct route_setting) + header->names_size;
+    if (size != cache->map_size ||
+            route_hash(2166136261u, header + 1, size - sizeof(*header)) != header->payload_hash) {
+        ALOGW("%s: %s is corrupted", __func__, file_path);
+        goto error;
+    }
+
+    ctl_ids = (const uint32_t *)(header + 1);
+    file_paths = (const struct route_file_path *)(ctl_ids + header->num_ctls);
+    settings = (struct route_setting *)(file_paths + header->num_paths);
+    names = (const char *)(settings + header->num_settings);
+    if (names[header->names_size - 1] != '\0')
+        goto error;
+
+    for (i = 0; i < header->num_ctls; i++) {
+        ctl = ctl_ids[i] < mixer_num_ctls ? mixer_get_ctl(cache->mixer, ctl_ids[i]) : NULL;
+        if (ctl == NULL || route_track_ctl(cache, ctl) < 0)
+            goto error;
+    }
+    if (route_mixer_hash(cache) != header->mixer_hash) {
+        ALOGW("%s: %s does not match the mixer", __func__, file_path);
+        goto error;
+    }
+    for (i = 0; i < header->num_settings; i++) {
+        if (!route_setting_valid(cache, &settings[i]))
+            goto error;
+    }
+
+    cache->paths = calloc(header->num_paths ? header->num_paths : 1, sizeof(struct route_path));
+    if (cache->paths == NULL)
+        goto error;
+    cache->paths_size = header->num_paths;
+    for (i = 0; i < header->num_paths; i++) {
+        if (file_paths[i].name >= header->names_size ||
+                file_paths[i].first_setting > header->num_settings ||
+                file_paths[i].num_settings > header->num_settings - file_paths[i].first_setting)
+            goto error;
+        /* read only, only the XML parser modifies paths */
+        cache->paths[i].name = (char *)names + file_paths[i].name;
+        cache->paths[i].settings = settings + file_paths[i].first_setting;
+        cache->paths[i].count = file_paths[i].num_settings;
+        cache->num_paths++;
+    }
+    cache->init.settings = settings;
+    cache->init.count = header->num_init_settings;
+    return 0;
+
+error:
+    route_clear(cache);
+    return -EINVAL;
+}
+
+static int route_ctl_id(struct route_cache *cache, struct mixer_ctl *ctl)
+{
+    unsigned int i;
+
+    for (i = 0; i < mixer_get_num_ctls(cache->mixer); i++) {
+        if (mixer_get_ctl(cache->mixer, i) == ctl)
+            return i;
+    }
+    return -1;
+}
+
+/* Compiles the parsed paths, written to a temporary file renamed over the
+ * previous one so that a reader never maps a partial file.
+ */
+static int route_save_file(struct route_cache *cache, const char *file_path,
+                           const struct route_source *source)
+{
+    struct route_file_header *header;
+    struct route_file_path *file_paths;
+    struct route_setting *settings;
+    uint32_t *ctl_ids;
+    char *names;
+    char tmp_path[PATH_MAX];
+    unsigned int num_settings = cache->init.count;
+    size_t names_size = 0;
+    size_t size;
+    void *buf;
+    unsigned int i;
+    int id;
+    int fd;
+    int ret = 0;
+
+    for (i = 0; i < cache->num_paths; i++) {
+        num_settings += cache->paths[i].count;
+        names_size += strlen(cache->paths[i].name) + 1;
+    }
+    /* keeps the file size a multiple of 4 and names_size non zero */
+    names_size = (names_size + 4) & ~(size_t)3;
+    size = sizeof(*header) + cache->num_ctls * sizeof(uint32_t) +
+            cache->num_paths * sizeof(struct route_file_path) +
+            num_settings * sizeof(struct route_setting) + names_size;
+    buf = calloc(1, size);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    header = (struct route_file_header *)buf;
+    ctl_ids = (uint32_t *)(header + 1);
+    file_paths = (struct route_file_path *)(ctl_ids + cache->num_ctls);
+    settings = (struct route_setting *)(file_paths + cache->num_paths);
+    names = (char *)(settings + num_settings);
+
+    for (i = 0; i < cache->num_ctls; i++) {
+        id = route_ctl_id(cache, cache->ctls[i].ctl);
+        if (id < 0) {
+            ret = -EINVAL;
+            goto exit;
+        }
+        ctl_ids[i] = id;
+    }
+    memcpy(settings, cache->init.settings, cache->init.count * sizeof(struct route_setting));
+    num_settings = cache->init.count;
+    names_size = 0;
+    for (i = 0; i < cache->num_paths; i++) {
+        file_paths[i].name = names_size;
+        file_paths[i].first_setting = num_settings;
+        file_paths[i].num_settings = cache->paths[i].count;
+        memcpy(settings + num_settings, cache->paths[i].settings,
+               cache->paths[i].count * sizeof(struct route_setting));
+        num_settings += cache->paths[i].count;
+        strcpy(names + names_size, cache->paths[i].name);
+        names_size += strlen(cache->paths[i].name) + 1;
+    }
+
+    header->magic = ROUTE_CACHE_FILE_MAGIC;
+    header->version = ROUTE_CACHE_FILE_VERSION;
+    header->xml_size = source->size;
+    header->xml_mtime_sec = source->mtime_sec;
+    header->xml_mtime_nsec = source->mtime_nsec;
+    header->xml_hash = source->hash;
+    header->mixer_num_ctls = mixer_get_num_ctls(cache->mixer);
+    header->mixer_hash = route_mixer_hash(cache);
+    header->num_ctls = cache->num_ctls;
+    header->num_paths = cache->num_paths;
+    header->num_settings = num_settings;
+    header->num_init_settings = cache->init.count;
+    header->names_size = (char *)buf + size - names;
+    header->payload_hash = route_hash(2166136261u, header + 1, size - sizeof(*header));
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        ret = -errno;
+        goto exit;
+    }
+    if (write(fd, buf, size) != (ssize_t)size || fsync(fd) != 0)
+        ret = -EIO;
+    close(fd);
+    if (ret == 0 && rename(tmp_path, file_path) != 0)
+        ret = -errno;
+    if (ret != 0)
+        unlink(tmp_path);
+
+exit:
+    free(buf);
+    return ret;
+}
+
+/* Writes the values of the dirty controls that differ from the hardware */
+static int route_update(struct route_cache *cache)
+{
+    struct route_ctl *rctl;
+    unsigned int i, j;
+    int ret = 0;
+
+    for (i = 0; i < cache->num_dirty; i++) {
+        rctl = &cache->ctls[cache->dirty[i]];
+        for (j = 0; j < rctl->num_values; j++) {
+            if (rctl->new_value[j] == rctl->hw_value[j])
+                continue;
+            if (mixer_ctl_set_value(rctl->ctl, j, rctl->new_value[j]) != 0) {
+                ALOGE("%s: cannot set '%s'[%u] to %d", __func__,
+                      mixer_ctl_get_name(rctl->ctl), j, rctl->new_value[j]);
+                ret = -EIO;
+                continue;
+            }
+            rctl->hw_value[j] = rctl->new_value[j];
+            cache->writes++;
+        }
+        rctl->dirty = false;
+    }
+    cache->num_dirty = 0;
+    return ret;
+}
+
+/* Appends a setting to a transition. Earlier settings it overrides are dropped
+ * so that each control value is only set once.
+ */
+static void route_transition_add(struct route_transition *transition,
+                                 const struct route_setting *setting)
+{
+    struct route_setting *delta;
+    unsigned int i = 0;
+
+    while (i < transition->num_deltas) {
+        delta = &transition->deltas[i];
+        if (delta->ctl == setting->ctl &&
+                (setting->index == ROUTE_CACHE_ALL_VALUES || delta->index == setting->index)) {
+            memmove(delta, delta + 1,
+                    (transition->num_deltas - i - 1) * sizeof(struct route_setting));
+            transition->num_deltas--;
+            continue;
+        }
+        i++;
+    }
+    transition->deltas[transition->num_deltas++] = *setting;
+}
+
+/* Computes the control values resulting from the pending path changes. A reset
+ * restores the initial value of every value of the path controls, as
+ * audio_route_reset_path() does.
+ */
+static int route_transition_build(struct route_cache *cache,
+                                  struct route_transition *transition)
+{
+    struct route_setting setting;
+    struct route_path *path;
+    struct route_ctl *rctl;
+    unsigned int size = 0;
+    unsigned int i, j, k;
+
+    for (i = 0; i < cache->num_pending; i++) {
+        path = &cache->paths[ROUTE_OP_PATH(cache->pending[i])];
+        for (j = 0; j < path->count; j++)
+            size += cache->ctls[path->settings[j].ctl].num_values;
+    }
+
+    free(transition->deltas);
+    transition->deltas = malloc((size ? size : 1) * sizeof(struct route_setting));
+    transition->num_deltas = 0;
+    transition->num_ops = 0;
+    if (transition->deltas == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < cache->num_pending; i++) {
+        path = &cache->paths[ROUTE_OP_PATH(cache->pending[i])];
+        for (j = 0; j < path->count; j++) {
+            if (ROUTE_OP_APPLY(cache->pending[i])) {
+                route_transition_add(transition, &path->settings[j]);
+                continue;
+            }
+            rctl = &cache->ctls[path->settings[j].ctl];
+            setting.ctl = path->settings[j].ctl;
+            for (k = 0; k < rctl->num_values; k++) {
+                setting.index = k;
+                setting.value = rctl->reset_value[k];
+                route_transition_add(transition, &setting);
+            }
+        }
+    }
+    memcpy(transition->ops, cache->pending, cache->num_pending * sizeof(uint16_t));
+    transition->num_ops = cache->num_pending;
+    return 0;
+}
+
+static struct route_transition *route_transition_get(struct route_cache *cache)
+{
+    struct route_transition *transition;
+    uint32_t hash = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < cache->num_pending; i++)
+        hash = (hash ^ cache->pending[i]) * 16777619u;
+    transition = &cache->memo[hash % ROUTE_CACHE_MEMO_SIZE];
+
+    if (transition->num_ops == cache->num_pending &&
+            memcmp(transition->ops, cache->pending,
+                   cache->num_pending * sizeof(uint16_t)) == 0) {
+        cache->hits++;
+        return transition;
+    }
+    cache->misses++;
+    if (route_transition_build(cache, transition) != 0)
+        return NULL;
+    return transition;
+}
+
+static int route_queue(struct route_cache *cache, const char *name, bool apply)
+{
+    int path = route_cache_get_path(cache, name);
+
+    if (path < 0) {
+        ALOGE("%s: unknown path '%s'", __func__, name);
+        return -EINVAL;
+    }
+    if (cache->num_pending == ROUTE_CACHE_MAX_OPS)
+        route_cache_update_mixer(cache);
+    cache->pending[cache->num_pending++] = ROUTE_OP(path, apply);
+    return 0;
+}
+
+int route_cache_get_path(struct route_cache *cache, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < cache->num_paths; i++) {
+        if (strcmp(cache->paths[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int route_cache_apply_path(struct route_cache *cache, const char *name)
+{
+    return route_queue(cache, name, true);
+}
+
+int route_cache_reset_path(struct route_cache *cache, const char *name)
+{
+    return route_queue(cache, name, false);
+}
+
+int route_cache_update_mixer(struct route_cache *cache)
+{
+    struct route_transition *transition;
+    unsigned int i;
+
+    if (cache->num_pending > 0) {
+        transition = route_transition_get(cache);
+        cache->num_pending = 0;
+        if (transition == NULL)
+            return -ENOMEM;
+        for (i = 0; i < transition->num_deltas; i++)
+            route_set_value(cache, transition->deltas[i].ctl, transition->deltas[i].index,
+                            transition->deltas[i].value);
+    }
+    return route_update(cache);
+}
+
+struct route_cache *route_cache_init(struct mixer *mixer, const char *xml_path,
+                                     const char *file_path)
+{
+    struct route_cache *cache;
+    struct route_source source;
+    struct route_setting *setting;
+    unsigned int i;
+    int ret;
+
+    cache = calloc(1, sizeof(struct route_cache));
+    if (cache == NULL)
+        return NULL;
+    cache->mixer = mixer;
+
+    /* a control is listed at most once in the dirty list */
+    cache->dirty = calloc(mixer_get_num_ctls(mixer), sizeof(unsigned int));
+    if (cache->dirty == NULL)
+        goto error;
+
+    if (file_path != NULL && route_read_source(xml_path, &source) != 0)
+        file_path = NULL;
+    if (file_path != NULL && route_load_file(cache, file_path, &source) == 0) {
+        cache->compiled = true;
+    } else {
+        if (route_parse(cache, xml_path) != 0)
+            goto error;
+        if (file_path != NULL) {
+            ret = route_save_file(cache, file_path, &source);
+            if (ret != 0)
+                ALOGW("%s: cannot write %s: %s", __func__, file_path, strerror(-ret));
+        }
+    }
+
+    /* apply the initial settings, they are then the values restored by a reset */
+    for (i = 0; i < cache->init.count; i++) {
+        setting = &cache->init.settings[i];
+        route_set_value(cache, setting->ctl, setting->index, setting->value);
+    }
+    route_update(cache);
+    for (i = 0; i < cache->num_ctls; i++)
+        memcpy(cache->ctls[i].reset_value, cache->ctls[i].new_value,
+               cache->ctls[i].num_values * sizeof(int));
+
+    ALOGV("%s: %u paths, %u controls%s", __func__, cache->num_paths, cache->num_ctls,
+          cache->compiled ? " (compiled)" : "");
+    return cache;
+
+error:
+    route_cache_free(cache);
+    return NULL;
+}
+
+void route_cache_free(struct route_cache *cache)
+{
+    unsigned int i;
+
+    if (cache == NULL)
+        return;
+    route_clear(cache);
+    for (i = 0; i < ROUTE_CACHE_MEMO_SIZE; i++)
+        free(cache->memo[i].deltas);
+    free(cache->dirty);
+    free(cache);
+}
+
+void route_cache_dump(struct route_cache *cache, int fd)
+{
+    dprintf(fd, "Route cache: %u paths %u controls, %s\n", cache->num_paths, cache->num_ctls,
+            cache->compiled ? "compiled" : "parsed");
+    dprintf(fd, "  transitions: %u cached %u built, %u controls written\n",
+            cache->hits, cache->misses, cache->writes);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_ROUTE_CACHE_H
+#define FLOUNDER_ROUTE_CACHE_H
+
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Mixer paths of a card, loaded from its mixer_paths XML file. Paths are
+ * applied and reset with the audio_route semantics, but only the controls
+ * named in the file are tracked and only those actually changed are written.
+ *
+ * Path changes are queued until route_cache_update_mixer(). The controls
+ * touched by a sequence of changes, with their final values, are computed
+ * once and kept in a small table keyed by the sequence: a transition seen
+ * before, e.g. speaker to headphones, costs one lookup and the writes of the
+ * controls whose value differs.
+ *
+ * The paths can be compiled to a binary file holding the mixer control ids and
+ * enum values already resolved. It is mapped instead of parsing the XML when it
+ * matches the size, mtime and content hash of the XML and the controls of the
+ * card, and rewritten otherwise.
+ *
+ * It parses the XML itself rather than wrapping audio_route: audio_route keeps
+ * its paths and controls private, so a cache on top of it could neither list
+ * the controls a transition touches nor avoid audio_route_update_mixer()
+ * comparing every control of the card, nor load the compiled file.
+ *
+ * Not thread safe: the HAL calls it with adev->lock held.
+ */
+
+struct route_cache;
+
+/* file_path is the compiled paths file to use or create, NULL to always parse the XML */
+struct route_cache *route_cache_init(struct mixer *mixer, const char *xml_path,
+                                     const char *file_path);
+void route_cache_free(struct route_cache *cache);
+
+/* Index of a path, or -1 if the file does not define it */
+int route_cache_get_path(struct route_cache *cache, const char *name);
+
+int route_cache_apply_path(struct route_cache *cache, const char *name);
+int route_cache_reset_path(struct route_cache *cache, const char *name);
+
+/* Writes the controls changed by the paths applied and reset since the last call */
+int route_cache_update_mixer(struct route_cache *cache);
+
+void route_cache_dump(struct route_cache *cache, int fd);
+
+#endif // FLOUNDER_ROUTE_CACHE_H
@@ -0,0 +1,81 @@
+LOCAL_PATH := $(call my-dir)
+
+# Bit-exactness tests of the sample processing kernels of audio_dsp.c against
+# the loops they replaced. The NEON versions are only covered on the target.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_dsp_tests_flounder
+LOCAL_SRC_FILES := \
+	audio_dsp_tests.cpp \
+	../audio_dsp.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_CFLAGS += -Wall -Werror
+LOCAL_ARM_MODE := arm
+
+include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_dsp_tests_flounder
+LOCAL_SRC_FILES := \
+	audio_dsp_tests.cpp \
+	../audio_dsp.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_CFLAGS += -Wall -Werror
+
+include $(BUILD_HOST_NATIVE_TEST)
+
+# Timing of the capture channel extraction
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_dsp_benchmark_flounder
+LOCAL_SRC_FILES := \
+	audio_dsp_benchmark.c \
+	../audio_dsp.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_CFLAGS += -Wall -Werror
+LOCAL_ARM_MODE := arm
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+# audio_hw.c on a host, over the simulated ALSA devices of sim_backend.h, with
+# the mixer paths of the tree. Run it from anywhere, see its usage for the
+# streams and rates.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_benchmark_flounder
+LOCAL_SRC_FILES := \
+	audio_hw_benchmark.c \
+	sim_tinyalsa.c \
+	sim_tinycompress.c \
+	sim_audio_utils.c \
+	sim_properties.c \
+	../audio_hw.c \
+	../audio_dsp.c \
+	../audio_stats.c \
+	../capture_ring.c \
+	../fixed_resampler.c \
+	../route_cache.c \
+	../thread_placement.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/tinyalsa/include \
+	external/tinycompress/include \
+	external/expat/lib \
+	$(call include-path-for, audio-utils) \
+	$(call include-path-for, audio-effects)
+LOCAL_CFLAGS += -DPREPROCESSING_ENABLED -DHW_AEC_LOOPBACK
+LOCAL_CFLAGS += \
+	-DMIXER_PATHS_XML_PATH='"$(abspath $(LOCAL_PATH)/../../..)/mixer_paths_%d.xml"' \
+	-DMIXER_PATHS_COMPILED_PATH='"/tmp/mixer_paths_%d.bin"'
+# libaudioutils and the system properties are not built for the host, see
+# sim_audio_utils.c and sim_properties.c
+LOCAL_STATIC_LIBRARIES := \
+	libexpat \
+	libcutils \
+	liblog
+LOCAL_LDLIBS := -lpthread -ldl -lrt -lm
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times the capture channel extraction of dsp_extract_channels_s16() against
+ * the per frame loop it replaced, on buffers the size of a capture period.
+ *
+ * usage: audio_dsp_benchmark [iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio_dsp.h"
+
+#define BENCH_FRAMES 1024           /* CAPTURE_PERIOD_SIZE */
+#define BENCH_MAX_CHANNELS 6
+#define BENCH_DEFAULT_ITERATIONS 20000
+
+struct bench_layout {
+    unsigned int dst_channels;
+    unsigned int src_channels;
+};
+
+static const struct bench_layout bench_layouts[] = {
+    { 1, 2 },
+    { 1, 4 },
+    { 2, 4 },
+    { 2, 6 },
+};
+
+static int16_t bench_src[BENCH_FRAMES * BENCH_MAX_CHANNELS];
+static int16_t bench_dst[BENCH_FRAMES * BENCH_MAX_CHANNELS];
+
+static int64_t bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the loop of read_and_process_frames() before dsp_extract_channels_s16() */
+static void extract_reference(int16_t *dst, unsigned int dst_channels,
+                              const int16_t *src, unsigned int src_channels, size_t frames)
+{
+    size_t i;
+
+    if (dst_channels == 1) {
+        for (i = frames; i > 0; i--) {
+            *dst++ = *src;
+            src += src_channels;
+        }
+    } else {
+        for (i = frames; i > 0; i--) {
+            memcpy(dst, src, dst_channels * sizeof(int16_t));
+            dst += dst_channels;
+            src += src_channels;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    const struct bench_layout *layout;
+    int64_t start_ns, reference_ns, kernel_ns;
+    unsigned int l;
+    size_t i;
+    int n;
+
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(bench_src) / sizeof(bench_src[0]); i++)
+        bench_src[i] = (int16_t)(i * 2654435761u >> 16);
+
+    printf("%d iterations of %d frames, ns per frame\n", iterations, BENCH_FRAMES);
+    printf("layout  reference  kernel  speedup\n");
+    for (l = 0; l < sizeof(bench_layouts) / sizeof(bench_layouts[0]); l++) {
+        layout = &bench_layouts[l];
+
+        start_ns = bench_ns();
+        for (n = 0; n < iterations; n++)
+            extract_reference(bench_dst, layout->dst_channels, bench_src,
+                              layout->src_channels, BENCH_FRAMES);
+        reference_ns = bench_ns() - start_ns;
+
+        start_ns = bench_ns();
+        for (n = 0; n < iterations; n++)
+            dsp_extract_channels_s16(bench_dst, layout->dst_channels, bench_src,
+                                     layout->src_channels, NULL, BENCH_FRAMES);
+        kernel_ns = bench_ns() - start_ns;
+
+        printf("%u to %u  %9.3f  %6.3f  %6.2fx\n", layout->src_channels, layout->dst_channels,
+               (double)reference_ns / iterations / BENCH_FRAMES,
+               (double)kernel_ns / iterations / BENCH_FRAMES,
+               kernel_ns > 0 ? (double)reference_ns / kernel_ns : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "audio_dsp.h"
+}
+
+/* Longest run checked: covers the NEON blocks of 4 and 8 frames and every tail */
+static const size_t kMaxFrames = 203;
+
+/* Loop of read_and_process_frames() that dsp_extract_channels_s16() replaced:
+ * keeps the dst_channels first channels.
+ */
+static void extract_reference(int16_t *dst, unsigned int dst_channels,
+                              const int16_t *src, unsigned int src_channels, size_t frames)
+{
+    size_t i;
+
+    if (dst_channels == 1) {
+        for (i = frames; i > 0; i--) {
+            *dst++ = *src;
+            src += src_channels;
+        }
+    } else {
+        for (i = frames; i > 0; i--) {
+            memcpy(dst, src, dst_channels * sizeof(int16_t));
+            dst += dst_channels;
+            src += src_channels;
+        }
+    }
+}
+
+static void extract_map_reference(int16_t *dst, unsigned int dst_channels,
+                                  const int16_t *src, unsigned int src_channels,
+                                  const uint8_t *map, size_t frames)
+{
+    size_t i;
+    unsigned int ch;
+
+    for (i = 0; i < frames; i++)
+        for (ch = 0; ch < dst_channels; ch++)
+            dst[i * dst_channels + ch] = src[i * src_channels + map[ch]];
+}
+
+static std::vector<int16_t> random_samples(size_t count, unsigned int seed)
+{
+    std::vector<int16_t> samples(count);
+    size_t i;
+
+    srand(seed);
+    for (i = 0; i < count; i++)
+        samples[i] = (int16_t)(rand() & 0xFFFF);
+    return samples;
+}
+
+/* Runs the kernel and the reference for every frame count up to kMaxFrames.
+ * The destination is one frame longer than needed, to catch overruns.
+ */
+static void check_extract(unsigned int dst_channels, unsigned int src_channels,
+                          const uint8_t *map)
+{
+    std::vector<int16_t> src = random_samples((kMaxFrames + 1) * src_channels,
+                                              dst_channels * 16 + src_channels);
+    std::vector<int16_t> expected((kMaxFrames + 1) * dst_channels);
+    std::vector<int16_t> actual((kMaxFrames + 1) * dst_channels);
+    size_t frames;
+
+    for (frames = 0; frames <= kMaxFrames; frames++) {
+        std::fill(expected.begin(), expected.end(), 0x5A5A);
+        std::fill(actual.begin(), actual.end(), 0x5A5A);
+        if (map == NULL)
+            extract_reference(&expected[0], dst_channels, &src[0], src_channels, frames);
+        else
+            extract_map_reference(&expected[0], dst_channels, &src[0], src_channels, map,
+                                  frames);
+        dsp_extract_channels_s16(&actual[0], dst_channels, &src[0], src_channels, map,
+                                 frames);
+        ASSERT_EQ(expected, actual) << dst_channels << " of " << src_channels
+                                    << " channels, " << frames << " frames";
+    }
+}
+
+TEST(ExtractChannels, FirstChannels) {
+    check_extract(1, 2, NULL);
+    check_extract(1, 3, NULL);
+    check_extract(1, 4, NULL);
+    check_extract(2, 3, NULL);
+    check_extract(2, 4, NULL);
+    check_extract(2, 6, NULL);
+    check_extract(3, 4, NULL);
+}
+
+TEST(ExtractChannels, MappedOneChannel) {
+    static const uint8_t second[] = { 1 };
+    static const uint8_t fourth[] = { 3 };
+
+    check_extract(1, 2, second);
+    check_extract(1, 4, second);
+    check_extract(1, 4, fourth);
+}
+
+TEST(ExtractChannels, MappedPair) {
+    static const uint8_t aligned[] = { 2, 3 };
+    static const uint8_t unaligned[] = { 1, 2 };
+    static const uint8_t swapped[] = { 1, 0 };
+
+    check_extract(2, 4, aligned);
+    check_extract(2, 4, unaligned);
+    check_extract(2, 4, swapped);
+    check_extract(2, 6, aligned);
+}
+
+TEST(ExtractChannels, MappedAny) {
+    static const uint8_t map[] = { 5, 0, 3 };
+
+    check_extract(3, 6, map);
+}
+
+TEST(ExtractChannels, UnalignedBuffers) {
+    std::vector<int16_t> src = random_samples(kMaxFrames * 4 + 1, 1);
+    std::vector<int16_t> expected(kMaxFrames * 2 + 1);
+    std::vector<int16_t> actual(kMaxFrames * 2 + 1);
+
+    /* odd sample offsets: the 32 bit lanes of the 4 to 2 kernel are not aligned */
+    extract_reference(&expected[1], 2, &src[1], 4, kMaxFrames);
+    dsp_extract_channels_s16(&actual[1], 2, &src[1], 4, NULL, kMaxFrames);
+    ASSERT_EQ(expected, actual);
+}
+
+static int32_t dot_reference(const int16_t *a, const int16_t *b, size_t count)
+{
+    int32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        sum += (int32_t)a[i] * b[i];
+    return sum;
+}
+
+TEST(DotProduct, MatchesReference) {
+    /* scaled down so that the sums of the products cannot overflow */
+    std::vector<int16_t> a = random_samples(64, 2);
+    std::vector<int16_t> b = random_samples(64, 3);
+    size_t count;
+
+    for (count = 0; count < a.size(); count++) {
+        a[count] /= 2;
+        b[count] /= 64;
+    }
+    for (count = 0; count <= a.size(); count++)
+        ASSERT_EQ(dot_reference(&a[0], &b[0], count), dsp_dot_s16(&a[0], &b[0], count))
+            << count << " samples";
+}
+
+TEST(Dither, TriangularOneLsb) {
+    /* silence dithered with +/-1 LSB TPDF noise rounds to -1, 0 and +1 LSB
+     * with probabilities 1/8, 3/4 and 1/8
+     */
+    static const size_t kSamples = 1 << 16;
+    std::vector<float> src(kSamples, 0.0f);
+    std::vector<int16_t> dst(kSamples);
+    struct dsp_dither dither;
+    size_t counts[3] = { 0, 0, 0 };
+    size_t i;
+
+    dsp_dither_init(&dither, 1);
+    dsp_float_to_s16(&dst[0], &src[0], kSamples, &dither);
+    for (i = 0; i < kSamples; i++) {
+        ASSERT_GE(dst[i], -1);
+        ASSERT_LE(dst[i], 1);
+        counts[dst[i] + 1]++;
+    }
+    EXPECT_NEAR(counts[0], kSamples / 8, kSamples / 64);
+    EXPECT_NEAR(counts[1], kSamples * 3 / 4, kSamples / 64);
+    EXPECT_NEAR(counts[2], kSamples / 8, kSamples / 64);
+
+    /* consecutive samples are not correlated */
+    size_t same = 0;
+    for (i = 1; i < kSamples; i++)
+        same += dst[i] == dst[i - 1];
+    EXPECT_NEAR(same, kSamples * (1.0 / 64 + 9.0 / 16 + 1.0 / 64), kSamples / 64);
+}
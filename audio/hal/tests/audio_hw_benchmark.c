@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmark of the HAL: audio_hw.c runs against the simulated tinyalsa and
+ * tinycompress of sim_backend.h and its entry points are called the way
+ * AudioFlinger does, one thread per stream:
+ * - out_write() on the low latency or the deep buffer output, one buffer at a
+ *   time. They share the playback PCM, so only one of them runs.
+ * - in_read() on a capture stream
+ * - out_write() on a compress offload output, waiting for the write ready
+ *   callback when the write is partial
+ * - set_parameters("routing=...") on the playback output, alternating
+ *   speaker and headphones at a given rate, which runs select_devices()
+ * The latency percentiles and the thread CPU time of the calls are reported
+ * per entry point, with the xruns and mixer writes of the simulated devices.
+ *
+ * The mixer paths are read from the tree, see Android.mk.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/atomic.h>
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#include "sim_backend.h"
+
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_DEFAULT_ROUTING_HZ 2
+#define BENCH_DEFAULT_MIXER_WRITE_US 100
+#define BENCH_DEFAULT_PCM_OPEN_US 2000
+#define BENCH_OFFLOAD_SAMPLE_RATE 44100
+/* longest wait for a write ready callback before checking for the end */
+#define BENCH_OFFLOAD_WAIT_MS 100
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+/* Latency and CPU time of each call to one entry point */
+struct bench_series {
+    const char *name;
+    int64_t *latency_ns;
+    int64_t *cpu_ns;
+    size_t count;
+    size_t size;
+    unsigned int errors;
+};
+
+struct bench_stream {
+    struct bench_series series;
+    pthread_t thread;
+    bool active;
+    struct audio_stream_out *out;
+    struct audio_stream_in *in;
+    void *buffer;
+    size_t bytes;
+    unsigned int stall_ms;      /* once per second, to provoke underruns */
+    unsigned int rate_hz;       /* calls per second when not paced by the device */
+    /* write ready callback of the offload output */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool write_ready;
+    bool wait_ready;            /* the last write was partial */
+    size_t offset;              /* written from the buffer */
+};
+
+static volatile int32_t bench_done;
+
+static int64_t bench_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Storage grows outside of the measured calls */
+static void bench_series_add(struct bench_series *series, int64_t latency_ns, int64_t cpu_ns)
+{
+    if (series->count == series->size) {
+        size_t size = series->size ? series->size * 2 : 1024;
+        int64_t *latency = realloc(series->latency_ns, size * sizeof(int64_t));
+        int64_t *cpu;
+
+        if (latency == NULL)
+            return;
+        series->latency_ns = latency;
+        cpu = realloc(series->cpu_ns, size * sizeof(int64_t));
+        if (cpu == NULL)
+            return;
+        series->cpu_ns = cpu;
+        series->size = size;
+    }
+    series->latency_ns[series->count] = latency_ns;
+    series->cpu_ns[series->count] = cpu_ns;
+    series->count++;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts the latencies, nearest rank percentile */
+static double bench_percentile_us(struct bench_series *series, unsigned int percent)
+{
+    size_t rank;
+
+    if (series->count == 0)
+        return 0.0;
+    rank = (series->count * percent + 99) / 100;
+    if (rank > 0)
+        rank--;
+    return series->latency_ns[rank] / 1000.0;
+}
+
+static void bench_series_print(struct bench_series *series, double seconds)
+{
+    int64_t cpu_total = 0;
+    size_t i;
+
+    if (series->name == NULL)
+        return;
+    for (i = 0; i < series->count; i++)
+        cpu_total += series->cpu_ns[i];
+    qsort(series->latency_ns, series->count, sizeof(int64_t), bench_compare);
+
+    printf("%-24s %7zu %6u %9.1f %9.1f %9.1f %9.1f %9.1f %6.2f\n", series->name,
+           series->count, series->errors,
+           bench_percentile_us(series, 50), bench_percentile_us(series, 90),
+           bench_percentile_us(series, 99),
+           series->count ? series->latency_ns[series->count - 1] / 1000.0 : 0.0,
+           series->count ? cpu_total / 1000.0 / series->count : 0.0,
+           cpu_total / 1e7 / seconds);
+}
+
+/* Resumes a partial write, like AudioFlinger, once the write is ready */
+static ssize_t bench_offload_write(struct bench_stream *stream)
+{
+    ssize_t ret;
+
+    pthread_mutex_lock(&stream->lock);
+    stream->write_ready = false;
+    pthread_mutex_unlock(&stream->lock);
+    ret = stream->out->write(stream->out, (char *)stream->buffer + stream->offset,
+                             stream->bytes - stream->offset);
+    if (ret < 0)
+        return ret;
+    stream->offset += ret;
+    stream->wait_ready = stream->offset < stream->bytes;
+    if (!stream->wait_ready)
+        stream->offset = 0;
+    return ret;
+}
+
+static void bench_offload_wait(struct bench_stream *stream)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->write_ready && !android_atomic_acquire_load(&bench_done)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += BENCH_OFFLOAD_WAIT_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&stream->cond, &stream->lock, &ts);
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static int bench_offload_callback(stream_callback_event_t event, void *param, void *cookie)
+{
+    struct bench_stream *stream = (struct bench_stream *)cookie;
+
+    (void)param;
+    if (event == STREAM_CBK_EVENT_WRITE_READY) {
+        pthread_mutex_lock(&stream->lock);
+        stream->write_ready = true;
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+    return 0;
+}
+
+/* Calls op() until the end of the run, recording each call */
+static void bench_run(struct bench_stream *stream, ssize_t (*op)(struct bench_stream *))
+{
+    int64_t start_ns, cpu_ns, next_ns;
+    int64_t stall_ns = bench_ns(CLOCK_MONOTONIC) + 1000000000LL;
+    int64_t period_ns = stream->rate_hz ? 1000000000LL / stream->rate_hz : 0;
+    ssize_t ret;
+
+    next_ns = bench_ns(CLOCK_MONOTONIC);
+    while (!android_atomic_acquire_load(&bench_done)) {
+        if (period_ns != 0) {
+            next_ns += period_ns;
+            sim_sleep_until_ns(next_ns);
+        }
+        if (stream->stall_ms != 0 && bench_ns(CLOCK_MONOTONIC) >= stall_ns) {
+            usleep(stream->stall_ms * 1000);
+            stall_ns += 1000000000LL;
+        }
+
+        start_ns = bench_ns(CLOCK_MONOTONIC);
+        cpu_ns = bench_ns(CLOCK_THREAD_CPUTIME_ID);
+        ret = op(stream);
+        cpu_ns = bench_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns;
+        bench_series_add(&stream->series, bench_ns(CLOCK_MONOTONIC) - start_ns, cpu_ns);
+        if (ret < 0) {
+            stream->series.errors++;
+            usleep(10000);
+        } else if (stream->wait_ready) {
+            /* not measured, the framework thread sleeps meanwhile */
+            bench_offload_wait(stream);
+        }
+    }
+}
+
+static ssize_t bench_out_write(struct bench_stream *stream)
+{
+    return stream->out->write(stream->out, stream->buffer, stream->bytes);
+}
+
+static ssize_t bench_in_read(struct bench_stream *stream)
+{
+    return stream->in->read(stream->in, stream->buffer, stream->bytes);
+}
+
+static ssize_t bench_route(struct bench_stream *stream)
+{
+    static bool headphones;
+    char routing[32];
+
+    headphones = !headphones;
+    snprintf(routing, sizeof(routing), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+             headphones ? AUDIO_DEVICE_OUT_WIRED_HEADPHONE : AUDIO_DEVICE_OUT_SPEAKER);
+    return stream->out->common.set_parameters(&stream->out->common, routing);
+}
+
+static void *bench_out_thread(void *context)
+{
+    bench_run((struct bench_stream *)context, bench_out_write);
+    return NULL;
+}
+
+static void *bench_in_thread(void *context)
+{
+    bench_run((struct bench_stream *)context, bench_in_read);
+    return NULL;
+}
+
+static void *bench_offload_thread(void *context)
+{
+    bench_run((struct bench_stream *)context, bench_offload_write);
+    return NULL;
+}
+
+static void *bench_route_thread(void *context)
+{
+    bench_run((struct bench_stream *)context, bench_route);
+    return NULL;
+}
+
+static int bench_open_output(struct audio_hw_device *adev, struct bench_stream *stream,
+                             const char *name, audio_output_flags_t flags,
+                             struct audio_config *config)
+{
+    int ret;
+
+    ret = adev->open_output_stream(adev, (audio_io_handle_t)(flags + 1),
+                                   AUDIO_DEVICE_OUT_SPEAKER, flags, config, &stream->out,
+                                   NULL);
+    if (ret != 0) {
+        fprintf(stderr, "cannot open the %s output: %d\n", name, ret);
+        return ret;
+    }
+    stream->series.name = name;
+    stream->bytes = stream->out->common.get_buffer_size(&stream->out->common);
+    stream->buffer = calloc(1, stream->bytes);
+    stream->active = stream->buffer != NULL;
+    return stream->active ? 0 : -ENOMEM;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t seconds] [-l] [-d] [-i] [-o bit_rate] [-r hz] [-s ms]\n"
+            "          [-m us] [-p us] [-v]\n"
+            "  -t  duration of the run, %d s by default\n"
+            "  -l  write the low latency output\n"
+            "  -d  write the deep buffer output instead, both share the PCM\n"
+            "  -i  read a capture stream\n"
+            "  -o  write a compress offload output at this bit rate\n"
+            "  -r  routing changes per second on the playback output, %d by default\n"
+            "  -s  stall the playback writer this long every second\n"
+            "  -m  cost of a mixer control write, %d us by default\n"
+            "  -p  cost of a PCM open, %d us by default\n"
+            "  -v  print the HAL dump at the end\n"
+            "Without any of -l -d -i -o, the low latency output and capture run.\n",
+            name, BENCH_DEFAULT_SECONDS, BENCH_DEFAULT_ROUTING_HZ,
+            BENCH_DEFAULT_MIXER_WRITE_US, BENCH_DEFAULT_PCM_OPEN_US);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_stream low_latency, deep_buffer, capture, offload, routing;
+    struct bench_stream *streams[] = { &low_latency, &deep_buffer, &capture, &offload,
+                                       &routing };
+    struct sim_params params;
+    struct sim_stats stats;
+    struct audio_hw_device *adev;
+    struct audio_config config;
+    struct rusage usage_start, usage_end;
+    hw_device_t *device;
+    unsigned int seconds = BENCH_DEFAULT_SECONDS;
+    unsigned int offload_bit_rate = 0;
+    unsigned int routing_hz = BENCH_DEFAULT_ROUTING_HZ;
+    unsigned int stall_ms = 0;
+    bool low_latency_on = false, deep_buffer_on = false, capture_on = false;
+    bool dump = false;
+    int64_t start_ns;
+    double elapsed, process_cpu;
+    unsigned int i;
+    int opt, ret;
+
+    memset(&params, 0, sizeof(params));
+    params.mixer_write_us = BENCH_DEFAULT_MIXER_WRITE_US;
+    params.pcm_open_us = BENCH_DEFAULT_PCM_OPEN_US;
+    params.mixer_paths = MIXER_PATHS_XML_PATH;
+
+    while ((opt = getopt(argc, argv, "t:ldio:r:s:m:p:v")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'l':
+            low_latency_on = true;
+            break;
+        case 'd':
+            deep_buffer_on = true;
+            break;
+        case 'i':
+            capture_on = true;
+            break;
+        case 'o':
+            offload_bit_rate = atoi(optarg);
+            break;
+        case 'r':
+            routing_hz = atoi(optarg);
+            break;
+        case 's':
+            stall_ms = atoi(optarg);
+            break;
+        case 'm':
+            params.mixer_write_us = atoi(optarg);
+            break;
+        case 'p':
+            params.pcm_open_us = atoi(optarg);
+            break;
+        case 'v':
+            dump = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (seconds == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!low_latency_on && !deep_buffer_on && !capture_on && offload_bit_rate == 0) {
+        low_latency_on = true;
+        capture_on = true;
+    }
+    /* the low latency and deep buffer outputs share the playback PCM */
+    if (low_latency_on && deep_buffer_on) {
+        usage(argv[0]);
+        return 1;
+    }
+    /* routing only reaches select_devices() on an active output */
+    if (routing_hz != 0 && !deep_buffer_on)
+        low_latency_on = true;
+    params.compress_bit_rate = offload_bit_rate;
+    sim_set_params(&params);
+
+    ret = HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+                                                   AUDIO_HARDWARE_INTERFACE, &device);
+    if (ret != 0) {
+        fprintf(stderr, "cannot open the HAL: %d\n", ret);
+        return 1;
+    }
+    adev = (struct audio_hw_device *)device;
+
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        memset(streams[i], 0, sizeof(struct bench_stream));
+        pthread_mutex_init(&streams[i]->lock, (const pthread_mutexattr_t *) NULL);
+        pthread_cond_init(&streams[i]->cond, (const pthread_condattr_t *) NULL);
+    }
+
+    if (low_latency_on) {
+        memset(&config, 0, sizeof(config));
+        config.sample_rate = 48000;
+        config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+        bench_open_output(adev, &low_latency, "out_write low latency",
+                          AUDIO_OUTPUT_FLAG_PRIMARY | AUDIO_OUTPUT_FLAG_FAST, &config);
+        low_latency.stall_ms = stall_ms;
+    }
+    if (deep_buffer_on) {
+        memset(&config, 0, sizeof(config));
+        config.sample_rate = 48000;
+        config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+        bench_open_output(adev, &deep_buffer, "out_write deep buffer",
+                          AUDIO_OUTPUT_FLAG_DEEP_BUFFER, &config);
+        deep_buffer.stall_ms = stall_ms;
+    }
+    if (offload_bit_rate != 0) {
+        memset(&config, 0, sizeof(config));
+        config.sample_rate = BENCH_OFFLOAD_SAMPLE_RATE;
+        config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config.format = AUDIO_FORMAT_MP3;
+        config.offload_info = (audio_offload_info_t)AUDIO_INFO_INITIALIZER;
+        config.offload_info.format = AUDIO_FORMAT_MP3;
+        config.offload_info.sample_rate = BENCH_OFFLOAD_SAMPLE_RATE;
+        config.offload_info.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config.offload_info.bit_rate = offload_bit_rate;
+        if (bench_open_output(adev, &offload, "out_write offload",
+                              AUDIO_OUTPUT_FLAG_DIRECT | AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD |
+                              AUDIO_OUTPUT_FLAG_NON_BLOCKING, &config) == 0)
+            offload.out->set_callback(offload.out, bench_offload_callback, &offload);
+    }
+    if (capture_on) {
+        memset(&config, 0, sizeof(config));
+        config.sample_rate = 48000;
+        config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+        ret = adev->open_input_stream(adev, 1, AUDIO_DEVICE_IN_BUILTIN_MIC, &config,
+                                      &capture.in, AUDIO_INPUT_FLAG_NONE, NULL,
+                                      AUDIO_SOURCE_MIC);
+        if (ret != 0) {
+            fprintf(stderr, "cannot open the capture stream: %d\n", ret);
+        } else {
+            capture.series.name = "in_read";
+            capture.bytes = capture.in->common.get_buffer_size(&capture.in->common);
+            capture.buffer = calloc(1, capture.bytes);
+            capture.active = capture.buffer != NULL;
+        }
+    }
+    if (routing_hz != 0 && (low_latency.active || deep_buffer.active)) {
+        routing.series.name = "set_parameters routing";
+        routing.out = low_latency.active ? low_latency.out : deep_buffer.out;
+        routing.rate_hz = routing_hz;
+        routing.active = true;
+    }
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    start_ns = bench_ns(CLOCK_MONOTONIC);
+    if (low_latency.active)
+        pthread_create(&low_latency.thread, NULL, bench_out_thread, &low_latency);
+    if (deep_buffer.active)
+        pthread_create(&deep_buffer.thread, NULL, bench_out_thread, &deep_buffer);
+    if (offload.active)
+        pthread_create(&offload.thread, NULL, bench_offload_thread, &offload);
+    if (capture.active)
+        pthread_create(&capture.thread, NULL, bench_in_thread, &capture);
+    if (routing.active)
+        pthread_create(&routing.thread, NULL, bench_route_thread, &routing);
+
+    sleep(seconds);
+    android_atomic_release_store(1, &bench_done);
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        if (streams[i]->active)
+            pthread_join(streams[i]->thread, NULL);
+    }
+    elapsed = (bench_ns(CLOCK_MONOTONIC) - start_ns) / 1e9;
+    getrusage(RUSAGE_SELF, &usage_end);
+    process_cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+                  (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+                  ((usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) +
+                   (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec)) / 1e6;
+
+    printf("%.1f s, mixer write %u us, PCM open %u us\n", elapsed, params.mixer_write_us,
+           params.pcm_open_us);
+    printf("%-24s %7s %6s %9s %9s %9s %9s %9s %6s\n", "entry point", "calls", "errors",
+           "p50 us", "p90 us", "p99 us", "max us", "cpu us", "cpu %");
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        if (streams[i]->active)
+            bench_series_print(&streams[i]->series, elapsed);
+    }
+    sim_get_stats(&stats);
+    printf("process cpu %.2f%%\n", process_cpu * 100.0 / elapsed);
+    printf("sim: %d pcm opens, %d busy, %d underruns, %d starved writes, %d overruns, "
+           "%d mixer writes, %d compress writes\n", stats.pcm_opens, stats.pcm_busy,
+           stats.pcm_underruns, stats.pcm_starved, stats.pcm_overruns, stats.mixer_writes, stats.compress_writes);
+
+    if (dump)
+        adev->dump(adev, STDOUT_FILENO);
+
+    if (capture.in != NULL)
+        adev->close_input_stream(adev, capture.in);
+    if (offload.out != NULL)
+        adev->close_output_stream(adev, offload.out);
+    if (deep_buffer.out != NULL)
+        adev->close_output_stream(adev, deep_buffer.out);
+    if (low_latency.out != NULL)
+        adev->close_output_stream(adev, low_latency.out);
+    device->close(device);
+
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+        free(streams[i]->buffer);
+        free(streams[i]->series.latency_ns);
+        free(streams[i]->series.cpu_ns);
+    }
+    return 0;
+}
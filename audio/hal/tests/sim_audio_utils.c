@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-ins for the audio_utils resampler and echo reference, which are
+ * only built for the target. The resampler interpolates linearly, with the
+ * buffer provider protocol of the speex one. The echo reference reads silence:
+ * the benchmark measures the HAL, not the preprocessing.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <audio_utils/echo_reference.h>
+#include <audio_utils/resampler.h>
+
+#define SIM_RESAMPLER_ONE (1ULL << 32)
+
+struct sim_resampler {
+    struct resampler_itfe itfe;
+    struct resampler_buffer_provider *provider;
+    uint32_t in_rate;
+    uint32_t channels;
+    uint64_t step;      /* input frames per output frame, Q32 */
+    uint64_t phase;     /* position between last and the next input frame, Q32 */
+    int16_t *last;      /* last input frame consumed */
+};
+
+struct sim_echo_reference {
+    struct echo_reference_itfe itfe;
+    uint32_t rd_channels;
+};
+
+/* Produces up to out_frames from in_frames, returns the output frames and
+ * sets *used to the input frames consumed.
+ */
+static size_t sim_resample(struct sim_resampler *rsmp, const int16_t *in, size_t in_frames,
+                           int16_t *out, size_t out_frames, size_t *used)
+{
+    size_t i = 0, o = 0;
+    uint32_t c;
+
+    while (o < out_frames) {
+        if (rsmp->phase >= SIM_RESAMPLER_ONE) {
+            if (i == in_frames)
+                break;
+            memcpy(rsmp->last, in + i * rsmp->channels, rsmp->channels * sizeof(int16_t));
+            i++;
+            rsmp->phase -= SIM_RESAMPLER_ONE;
+            continue;
+        }
+        if (i == in_frames)
+            break;
+        for (c = 0; c < rsmp->channels; c++) {
+            int32_t from = rsmp->last[c];
+            int32_t to = in[i * rsmp->channels + c];
+
+            out[o * rsmp->channels + c] =
+                    (int16_t)(from + (((int64_t)(to - from) * (int64_t)rsmp->phase) >> 32));
+        }
+        o++;
+        rsmp->phase += rsmp->step;
+    }
+    *used = i;
+    return o;
+}
+
+static void sim_resampler_reset(struct resampler_itfe *resampler)
+{
+    struct sim_resampler *rsmp = (struct sim_resampler *)resampler;
+
+    rsmp->phase = 0;
+    memset(rsmp->last, 0, rsmp->channels * sizeof(int16_t));
+}
+
+static int sim_resampler_from_provider(struct resampler_itfe *resampler, int16_t *out,
+                                       size_t *outFrameCount)
+{
+    struct sim_resampler *rsmp = (struct sim_resampler *)resampler;
+    struct resampler_buffer buffer;
+    size_t done = 0, used;
+
+    if (rsmp->provider == NULL) {
+        *outFrameCount = 0;
+        return -EINVAL;
+    }
+    while (done < *outFrameCount) {
+        buffer.frame_count = (*outFrameCount - done) * rsmp->step / SIM_RESAMPLER_ONE + 1;
+        if (rsmp->provider->get_next_buffer(rsmp->provider, &buffer) != 0 ||
+                buffer.frame_count == 0)
+            break;
+        done += sim_resample(rsmp, buffer.i16, buffer.frame_count,
+                             out + done * rsmp->channels, *outFrameCount - done, &used);
+        buffer.frame_count = used;
+        rsmp->provider->release_buffer(rsmp->provider, &buffer);
+    }
+    *outFrameCount = done;
+    return 0;
+}
+
+static int sim_resampler_from_input(struct resampler_itfe *resampler, int16_t *in,
+                                    size_t *inFrameCount, int16_t *out, size_t *outFrameCount)
+{
+    struct sim_resampler *rsmp = (struct sim_resampler *)resampler;
+
+    if (in == NULL || out == NULL)
+        return -EINVAL;
+    *outFrameCount = sim_resample(rsmp, in, *inFrameCount, out, *outFrameCount, inFrameCount);
+    return 0;
+}
+
+static int32_t sim_resampler_delay_ns(struct resampler_itfe *resampler)
+{
+    struct sim_resampler *rsmp = (struct sim_resampler *)resampler;
+
+    return (int32_t)(1000000000LL / rsmp->in_rate);
+}
+
+int create_resampler(uint32_t inSampleRate, uint32_t outSampleRate, uint32_t channelCount,
+                     uint32_t quality, struct resampler_buffer_provider *provider,
+                     struct resampler_itfe **resampler)
+{
+    struct sim_resampler *rsmp;
+
+    (void)quality;
+    if (resampler == NULL || inSampleRate == 0 || outSampleRate == 0 || channelCount == 0)
+        return -EINVAL;
+    rsmp = (struct sim_resampler *)calloc(1, sizeof(struct sim_resampler));
+    if (rsmp == NULL)
+        return -ENOMEM;
+    rsmp->last = (int16_t *)calloc(channelCount, sizeof(int16_t));
+    if (rsmp->last == NULL) {
+        free(rsmp);
+        return -ENOMEM;
+    }
+    rsmp->itfe.reset = sim_resampler_reset;
+    rsmp->itfe.resample_from_provider = sim_resampler_from_provider;
+    rsmp->itfe.resample_from_input = sim_resampler_from_input;
+    rsmp->itfe.delay_ns = sim_resampler_delay_ns;
+    rsmp->provider = provider;
+    rsmp->in_rate = inSampleRate;
+    rsmp->channels = channelCount;
+    rsmp->step = ((uint64_t)inSampleRate << 32) / outSampleRate;
+    *resampler = &rsmp->itfe;
+    return 0;
+}
+
+void release_resampler(struct resampler_itfe *resampler)
+{
+    struct sim_resampler *rsmp = (struct sim_resampler *)resampler;
+
+    if (rsmp == NULL)
+        return;
+    free(rsmp->last);
+    free(rsmp);
+}
+
+static int sim_echo_reference_read(struct echo_reference_itfe *echo_reference,
+                                   struct echo_reference_buffer *buffer)
+{
+    struct sim_echo_reference *ref = (struct sim_echo_reference *)echo_reference;
+
+    if (buffer == NULL || buffer->raw == NULL)
+        return -EINVAL;
+    memset(buffer->raw, 0, buffer->frame_count * ref->rd_channels * sizeof(int16_t));
+    buffer->delay_ns = 0;
+    return 0;
+}
+
+static int sim_echo_reference_write(struct echo_reference_itfe *echo_reference,
+                                    struct echo_reference_buffer *buffer)
+{
+    (void)echo_reference;
+    (void)buffer;
+    return 0;
+}
+
+int create_echo_reference(audio_format_t rdFormat, uint32_t rdChannelCount,
+                          uint32_t rdSamplingRate, audio_format_t wrFormat,
+                          uint32_t wrChannelCount, uint32_t wrSamplingRate,
+                          struct echo_reference_itfe **echo_reference)
+{
+    struct sim_echo_reference *ref;
+
+    (void)rdSamplingRate;
+    (void)wrChannelCount;
+    (void)wrSamplingRate;
+    if (echo_reference == NULL || rdFormat != AUDIO_FORMAT_PCM_16_BIT ||
+            wrFormat != AUDIO_FORMAT_PCM_16_BIT)
+        return -EINVAL;
+    ref = (struct sim_echo_reference *)calloc(1, sizeof(struct sim_echo_reference));
+    if (ref == NULL)
+        return -ENOMEM;
+    ref->itfe.read = sim_echo_reference_read;
+    ref->itfe.write = sim_echo_reference_write;
+    ref->rd_channels = rdChannelCount;
+    *echo_reference = &ref->itfe;
+    return 0;
+}
+
+void release_echo_reference(struct echo_reference_itfe *echo_reference)
+{
+    free(echo_reference);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_SIM_BACKEND_H
+#define FLOUNDER_SIM_BACKEND_H
+
+#include <stdint.h>
+
+/*
+ * Simulated tinyalsa and tinycompress for running the HAL on a host, see
+ * sim_tinyalsa.c and sim_tinycompress.c. They implement the library APIs the
+ * HAL links against, with devices that consume and produce frames on
+ * CLOCK_MONOTONIC:
+ * - a PCM device can only be opened once per direction at a time, a second
+ *   pcm_open() returns a PCM that is not ready.
+ * - a PCM starts at its start threshold, its hardware pointer then advances at
+ *   the sampling rate. Without PCM_NOIRQ it is only visible, and blocked
+ *   writers and readers only wake up, at period boundaries.
+ * - writes and reads block until the transfer fits the buffer.
+ * - a playback PCM underruns once the hardware pointer passes the application
+ *   pointer by more than the stop threshold allows, a capture PCM overruns
+ *   when the buffer is full. Like tinyalsa, a write with PCM_NORESTART then
+ *   fails with -EPIPE until pcm_prepare(), reads and other writes restart the
+ *   PCM silently.
+ * - pcm_get_htimestamp() reports the pointer and time of the last period
+ *   boundary, or of the call with PCM_NOIRQ.
+ * - a compressed stream consumes its buffer at the bit rate of its codec.
+ * - a mixer has the controls named in the mixer paths file of its card, enums
+ *   for those set to strings. Each write costs mixer_write_us, like a codec
+ *   register write over I2C.
+ */
+
+struct sim_params {
+    unsigned int pcm_open_us;           /* time spent in pcm_open() */
+    unsigned int mixer_write_us;        /* time spent per control written */
+    unsigned int compress_bit_rate;     /* used when the codec has none */
+    const char *mixer_paths;            /* mixer paths file, %d is the card */
+};
+
+/* counted with android_atomic_inc() */
+struct sim_stats {
+    int32_t pcm_opens;
+    int32_t pcm_busy;                   /* opens of a device already open */
+    int32_t pcm_underruns;              /* stop threshold reached */
+    int32_t pcm_starved;                /* played past the written data */
+    int32_t pcm_overruns;
+    int32_t mixer_writes;
+    int32_t compress_writes;
+};
+
+void sim_set_params(const struct sim_params *params);
+void sim_get_stats(struct sim_stats *stats);
+
+/* shared by the simulated libraries */
+extern struct sim_params sim_params;
+extern struct sim_stats sim_stats;
+
+int64_t sim_now_ns(void);
+void sim_sleep_until_ns(int64_t ns);
+
+#endif // FLOUNDER_SIM_BACKEND_H
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for the system properties of cutils. A property is read from
+ * the environment variable of the same name, e.g.
+ *   env audio_hal.period_size=480 audio_hw_benchmark_flounder
+ * and has its default value otherwise.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+    const char *found = getenv(key);
+    size_t len;
+
+    if (found == NULL)
+        found = default_value != NULL ? default_value : "";
+    len = strlen(found);
+    if (len >= PROPERTY_VALUE_MAX)
+        len = PROPERTY_VALUE_MAX - 1;
+    memcpy(value, found, len);
+    value[len] = '\0';
+    return len;
+}
@@ -0,0 +1,677 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Simulated tinyalsa PCMs and mixers, see sim_backend.h */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/atomic.h>
+#include <expat.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "sim_backend.h"
+
+#define SIM_MIXER_MAX_CTLS 512
+#define SIM_MIXER_CTL_VALUES 2
+#define SIM_MIXER_CTL_ENUMS 16
+#define SIM_MAX_PCMS 32
+
+struct sim_params sim_params;
+struct sim_stats sim_stats;
+
+/* A PCM device is opened by one client at a time */
+static pthread_mutex_t sim_pcm_open_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pcm *sim_pcm_open_list[SIM_MAX_PCMS];
+
+struct pcm {
+    pthread_mutex_t lock;
+    unsigned int card;
+    unsigned int device;
+    unsigned int flags;
+    struct pcm_config config;
+    unsigned int buffer_size;
+    unsigned int frame_size;
+    bool running;
+    bool xrun;
+    /* the hardware pointer was hw_base at start_ns */
+    int64_t start_ns;
+    int64_t hw_base;
+    int64_t hw;                 /* frames played or captured */
+    int64_t appl;               /* frames written or read */
+    char error[128];
+};
+
+struct mixer_ctl {
+    char *name;
+    int values[SIM_MIXER_CTL_VALUES];
+    char *enums[SIM_MIXER_CTL_ENUMS];
+    unsigned int num_enums;     /* an enum control when not 0 */
+};
+
+struct mixer {
+    unsigned int card;
+    struct mixer_ctl *ctls[SIM_MIXER_MAX_CTLS];
+    unsigned int num_ctls;
+};
+
+void sim_set_params(const struct sim_params *params)
+{
+    sim_params = *params;
+}
+
+void sim_get_stats(struct sim_stats *stats)
+{
+    stats->pcm_opens = android_atomic_acquire_load(&sim_stats.pcm_opens);
+    stats->pcm_busy = android_atomic_acquire_load(&sim_stats.pcm_busy);
+    stats->pcm_underruns = android_atomic_acquire_load(&sim_stats.pcm_underruns);
+    stats->pcm_starved = android_atomic_acquire_load(&sim_stats.pcm_starved);
+    stats->pcm_overruns = android_atomic_acquire_load(&sim_stats.pcm_overruns);
+    stats->mixer_writes = android_atomic_acquire_load(&sim_stats.mixer_writes);
+    stats->compress_writes = android_atomic_acquire_load(&sim_stats.compress_writes);
+}
+
+int64_t sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sim_sleep_until_ns(int64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static bool sim_pcm_is_capture(const struct pcm *pcm)
+{
+    return (pcm->flags & PCM_IN) != 0;
+}
+
+/* Time at which the running hardware pointer reaches hw */
+static int64_t sim_pcm_time_of(const struct pcm *pcm, int64_t hw)
+{
+    return pcm->start_ns +
+           ((hw - pcm->hw_base) * 1000000000LL + pcm->config.rate - 1) / pcm->config.rate;
+}
+
+/* Pointer as last reported by the driver: at the last period interrupt, or
+ * right now with PCM_NOIRQ where it is read from the DMA on each call.
+ */
+static int64_t sim_pcm_visible_hw(const struct pcm *pcm)
+{
+    if (!pcm->running || (pcm->flags & PCM_NOIRQ))
+        return pcm->hw;
+    return pcm->hw_base +
+           (pcm->hw - pcm->hw_base) / pcm->config.period_size * pcm->config.period_size;
+}
+
+/* First pointer at which a waiter on hw wakes up */
+static int64_t sim_pcm_wakeup_hw(const struct pcm *pcm, int64_t hw)
+{
+    int64_t period = pcm->config.period_size;
+
+    if (pcm->flags & PCM_NOIRQ)
+        return hw;
+    return pcm->hw_base + (hw - pcm->hw_base + period - 1) / period * period;
+}
+
+/* Advances the hardware pointer to now, stopping on xruns. Called with pcm->lock held. */
+static void sim_pcm_update_l(struct pcm *pcm, int64_t now)
+{
+    int64_t stop = pcm->config.stop_threshold;
+    int64_t hw;
+
+    if (!pcm->running)
+        return;
+    hw = pcm->hw_base + (now - pcm->start_ns) * pcm->config.rate / 1000000000LL;
+
+    if (!sim_pcm_is_capture(pcm)) {
+        /* ALSA stops once the free space reaches the stop threshold */
+        if (hw + (int64_t)pcm->buffer_size - pcm->appl >= stop) {
+            pcm->hw = pcm->appl + stop - pcm->buffer_size;
+            if (pcm->hw < pcm->hw_base)
+                pcm->hw = pcm->hw_base;
+            pcm->running = false;
+            pcm->xrun = true;
+            android_atomic_inc(&sim_stats.pcm_underruns);
+            return;
+        }
+    } else if (hw - pcm->appl >= stop) {
+        pcm->hw = pcm->appl + stop;
+        pcm->running = false;
+        pcm->xrun = true;
+        android_atomic_inc(&sim_stats.pcm_overruns);
+        return;
+    }
+    pcm->hw = hw;
+}
+
+static void sim_pcm_start_l(struct pcm *pcm, int64_t now)
+{
+    pcm->running = true;
+    pcm->start_ns = now;
+    pcm->hw_base = pcm->hw;
+}
+
+static void sim_pcm_prepare_l(struct pcm *pcm)
+{
+    pcm->running = false;
+    pcm->xrun = false;
+    pcm->appl = pcm->hw;
+}
+
+/* Handles an xrun found by sim_pcm_update_l() as tinyalsa does: pcm_write()
+ * returns -EPIPE with PCM_NORESTART, pcm_read() always restarts the PCM.
+ */
+static int sim_pcm_check_xrun_l(struct pcm *pcm)
+{
+    if (!pcm->xrun)
+        return 0;
+    if (!sim_pcm_is_capture(pcm) && (pcm->flags & PCM_NORESTART)) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot write stream data: Broken pipe");
+        return -EPIPE;
+    }
+    sim_pcm_prepare_l(pcm);
+    return 0;
+}
+
+/* Registers an opened PCM, fails if its device is already open */
+static bool sim_pcm_claim(struct pcm *pcm)
+{
+    struct pcm *other;
+    int free_slot = -1;
+    int i;
+
+    pthread_mutex_lock(&sim_pcm_open_lock);
+    for (i = 0; i < SIM_MAX_PCMS; i++) {
+        other = sim_pcm_open_list[i];
+        if (other == NULL) {
+            if (free_slot < 0)
+                free_slot = i;
+        } else if (other->card == pcm->card && other->device == pcm->device &&
+                   (other->flags & PCM_IN) == (pcm->flags & PCM_IN)) {
+            free_slot = -1;
+            break;
+        }
+    }
+    if (free_slot >= 0)
+        sim_pcm_open_list[free_slot] = pcm;
+    pthread_mutex_unlock(&sim_pcm_open_lock);
+    return free_slot >= 0;
+}
+
+static void sim_pcm_release(struct pcm *pcm)
+{
+    int i;
+
+    pthread_mutex_lock(&sim_pcm_open_lock);
+    for (i = 0; i < SIM_MAX_PCMS; i++) {
+        if (sim_pcm_open_list[i] == pcm)
+            sim_pcm_open_list[i] = NULL;
+    }
+    pthread_mutex_unlock(&sim_pcm_open_lock);
+}
+
+struct pcm *pcm_open(unsigned int card, unsigned int device, unsigned int flags,
+                     struct pcm_config *config)
+{
+    struct pcm *pcm = (struct pcm *)calloc(1, sizeof(struct pcm));
+
+    if (pcm == NULL)
+        return NULL;
+    if (sim_params.pcm_open_us > 0)
+        usleep(sim_params.pcm_open_us);
+    android_atomic_inc(&sim_stats.pcm_opens);
+
+    pthread_mutex_init(&pcm->lock, (const pthread_mutexattr_t *) NULL);
+    pcm->card = card;
+    pcm->device = device;
+    pcm->flags = flags;
+    if (!sim_pcm_claim(pcm)) {
+        android_atomic_inc(&sim_stats.pcm_busy);
+        snprintf(pcm->error, sizeof(pcm->error),
+                 "cannot open device '/dev/snd/pcmC%uD%u%c': Device or resource busy",
+                 card, device, flags & PCM_IN ? 'c' : 'p');
+        return pcm;
+    }
+    if (config == NULL || config->rate == 0 || config->channels == 0 ||
+            config->period_size == 0 || config->period_count == 0) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot set hw params for card %u device %u",
+                 card, device);
+        return pcm;
+    }
+    pcm->config = *config;
+    pcm->buffer_size = config->period_size * config->period_count;
+    pcm->frame_size = config->channels * pcm_format_to_bits(config->format) / 8;
+
+    /* defaults of tinyalsa */
+    if (pcm->config.start_threshold == 0)
+        pcm->config.start_threshold = sim_pcm_is_capture(pcm) ? 1 : pcm->buffer_size / 2;
+    if (pcm->config.stop_threshold == 0)
+        pcm->config.stop_threshold = sim_pcm_is_capture(pcm) ? pcm->buffer_size * 10 :
+                                                               pcm->buffer_size;
+    if (pcm->config.avail_min <= 0)
+        pcm->config.avail_min = 1;
+    if (pcm->config.start_threshold > pcm->buffer_size)
+        pcm->config.start_threshold = pcm->buffer_size;
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (pcm == NULL)
+        return -EINVAL;
+    sim_pcm_release(pcm);
+    pthread_mutex_destroy(&pcm->lock);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm != NULL && pcm->buffer_size != 0;
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return pcm->error;
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_format_to_bits(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+    case PCM_FORMAT_S24_LE:
+        return 32;
+    case PCM_FORMAT_S24_3LE:
+        return 24;
+    case PCM_FORMAT_S8:
+        return 8;
+    default:
+        return 16;
+    }
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->frame_size;
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / pcm->frame_size;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    pthread_mutex_lock(&pcm->lock);
+    sim_pcm_update_l(pcm, sim_now_ns());
+    sim_pcm_prepare_l(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    pthread_mutex_lock(&pcm->lock);
+    if (!pcm->running)
+        sim_pcm_start_l(pcm, sim_now_ns());
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    pthread_mutex_lock(&pcm->lock);
+    sim_pcm_update_l(pcm, sim_now_ns());
+    sim_pcm_prepare_l(pcm);
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    int64_t frames = count / pcm->frame_size;
+    int64_t now, hw, space, need;
+    int ret = 0;
+
+    (void)data;
+    if (sim_pcm_is_capture(pcm))
+        return -EINVAL;
+
+    pthread_mutex_lock(&pcm->lock);
+    while (frames > 0) {
+        now = sim_now_ns();
+        sim_pcm_update_l(pcm, now);
+        ret = sim_pcm_check_xrun_l(pcm);
+        if (ret != 0)
+            break;
+
+        /* without reaching the stop threshold, the device played stale data */
+        if (pcm->running && pcm->hw > pcm->appl) {
+            android_atomic_inc(&sim_stats.pcm_starved);
+            pcm->appl = pcm->hw;
+        }
+
+        hw = sim_pcm_visible_hw(pcm);
+        space = pcm->buffer_size - (pcm->appl - hw);
+        if (space > frames)
+            space = frames;
+        if (space > 0) {
+            pcm->appl += space;
+            frames -= space;
+        }
+        if (!pcm->running &&
+                (frames > 0 || pcm->appl - pcm->hw >= pcm->config.start_threshold))
+            sim_pcm_start_l(pcm, now);
+        if (frames == 0)
+            break;
+
+        /* wait for avail_min frames of space, or what is left to write */
+        need = frames < pcm->config.avail_min ? frames : pcm->config.avail_min;
+        hw = sim_pcm_wakeup_hw(pcm, pcm->appl - pcm->buffer_size + need);
+        now = sim_pcm_time_of(pcm, hw);
+        pthread_mutex_unlock(&pcm->lock);
+        sim_sleep_until_ns(now);
+        pthread_mutex_lock(&pcm->lock);
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_mmap_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    int ret = pcm_write(pcm, data, count);
+
+    return ret < 0 ? ret : (int)count;
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    int64_t frames = count / pcm->frame_size;
+    int64_t now, hw, avail, need;
+    int ret = 0;
+
+    if (!sim_pcm_is_capture(pcm))
+        return -EINVAL;
+    memset(data, 0, count);
+
+    pthread_mutex_lock(&pcm->lock);
+    while (frames > 0) {
+        now = sim_now_ns();
+        sim_pcm_update_l(pcm, now);
+        ret = sim_pcm_check_xrun_l(pcm);
+        if (ret != 0)
+            break;
+        if (!pcm->running)
+            sim_pcm_start_l(pcm, now);
+
+        hw = sim_pcm_visible_hw(pcm);
+        avail = hw - pcm->appl;
+        if (avail > frames)
+            avail = frames;
+        if (avail > 0) {
+            pcm->appl += avail;
+            frames -= avail;
+        }
+        if (frames == 0)
+            break;
+
+        need = frames < pcm->config.avail_min ? frames : pcm->config.avail_min;
+        hw = sim_pcm_wakeup_hw(pcm, pcm->appl + need);
+        now = sim_pcm_time_of(pcm, hw);
+        pthread_mutex_unlock(&pcm->lock);
+        sim_sleep_until_ns(now);
+        pthread_mutex_lock(&pcm->lock);
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    int64_t now = sim_now_ns();
+    int64_t hw;
+    int ret = -1;
+
+    pthread_mutex_lock(&pcm->lock);
+    sim_pcm_update_l(pcm, now);
+    if (pcm->running) {
+        hw = sim_pcm_visible_hw(pcm);
+        if (!(pcm->flags & PCM_NOIRQ))
+            now = sim_pcm_time_of(pcm, hw);
+        if (sim_pcm_is_capture(pcm))
+            *avail = hw - pcm->appl;
+        else
+            *avail = pcm->buffer_size - (pcm->appl - hw);
+        tstamp->tv_sec = now / 1000000000LL;
+        tstamp->tv_nsec = now % 1000000000LL;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+    return ret;
+}
+
+static struct mixer_ctl *sim_mixer_find_ctl(struct mixer *mixer, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < mixer->num_ctls; i++) {
+        if (strcmp(mixer->ctls[i]->name, name) == 0)
+            return mixer->ctls[i];
+    }
+    return NULL;
+}
+
+/* Adds the control of a <ctl> element, an enum if it is set to a string */
+static void sim_mixer_start_tag(void *data, const XML_Char *tag, const XML_Char **attr)
+{
+    struct mixer *mixer = (struct mixer *)data;
+    const char *name = NULL, *value = NULL;
+    struct mixer_ctl *ctl;
+    unsigned int i;
+
+    if (strcmp(tag, "ctl") != 0)
+        return;
+    for (i = 0; attr[i] != NULL; i += 2) {
+        if (strcmp(attr[i], "name") == 0)
+            name = attr[i + 1];
+        else if (strcmp(attr[i], "value") == 0)
+            value = attr[i + 1];
+    }
+    if (name == NULL)
+        return;
+
+    ctl = sim_mixer_find_ctl(mixer, name);
+    if (ctl == NULL) {
+        if (mixer->num_ctls == SIM_MIXER_MAX_CTLS)
+            return;
+        ctl = (struct mixer_ctl *)calloc(1, sizeof(struct mixer_ctl));
+        if (ctl == NULL)
+            return;
+        ctl->name = strdup(name);
+        if (ctl->name == NULL) {
+            free(ctl);
+            return;
+        }
+        mixer->ctls[mixer->num_ctls++] = ctl;
+    }
+    if (value == NULL || value[0] == '-' || (value[0] >= '0' && value[0] <= '9'))
+        return;
+    for (i = 0; i < ctl->num_enums; i++) {
+        if (strcmp(ctl->enums[i], value) == 0)
+            return;
+    }
+    if (ctl->num_enums < SIM_MIXER_CTL_ENUMS) {
+        ctl->enums[ctl->num_enums] = strdup(value);
+        if (ctl->enums[ctl->num_enums] != NULL)
+            ctl->num_enums++;
+    }
+}
+
+/* The card has the controls named in its mixer paths file */
+static void sim_mixer_load_ctls(struct mixer *mixer)
+{
+    char path[PATH_MAX];
+    char buf[4096];
+    XML_Parser parser;
+    FILE *file;
+    size_t bytes;
+
+    if (sim_params.mixer_paths == NULL)
+        return;
+    snprintf(path, sizeof(path), sim_params.mixer_paths, mixer->card);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "sim: cannot open %s\n", path);
+        return;
+    }
+    parser = XML_ParserCreate(NULL);
+    if (parser != NULL) {
+        XML_SetUserData(parser, mixer);
+        XML_SetElementHandler(parser, sim_mixer_start_tag, NULL);
+        do {
+            bytes = fread(buf, 1, sizeof(buf), file);
+            if (XML_Parse(parser, buf, bytes, bytes == 0) == XML_STATUS_ERROR) {
+                fprintf(stderr, "sim: cannot parse %s\n", path);
+                break;
+            }
+        } while (bytes != 0);
+        XML_ParserFree(parser);
+    }
+    fclose(file);
+}
+
+struct mixer *mixer_open(unsigned int card)
+{
+    struct mixer *mixer = (struct mixer *)calloc(1, sizeof(struct mixer));
+
+    if (mixer != NULL) {
+        mixer->card = card;
+        sim_mixer_load_ctls(mixer);
+    }
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    unsigned int i, j;
+
+    if (mixer == NULL)
+        return;
+    for (i = 0; i < mixer->num_ctls; i++) {
+        for (j = 0; j < mixer->ctls[i]->num_enums; j++)
+            free(mixer->ctls[i]->enums[j]);
+        free(mixer->ctls[i]->name);
+        free(mixer->ctls[i]);
+    }
+    free(mixer);
+}
+
+unsigned int mixer_get_num_ctls(struct mixer *mixer)
+{
+    return mixer->num_ctls;
+}
+
+struct mixer_ctl *mixer_get_ctl(struct mixer *mixer, unsigned int id)
+{
+    return id < mixer->num_ctls ? mixer->ctls[id] : NULL;
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    return sim_mixer_find_ctl(mixer, name);
+}
+
+const char *mixer_ctl_get_name(struct mixer_ctl *ctl)
+{
+    return ctl->name;
+}
+
+enum mixer_ctl_type mixer_ctl_get_type(struct mixer_ctl *ctl)
+{
+    return ctl->num_enums != 0 ? MIXER_CTL_TYPE_ENUM : MIXER_CTL_TYPE_INT;
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    (void)ctl;
+    return SIM_MIXER_CTL_VALUES;
+}
+
+unsigned int mixer_ctl_get_num_enums(struct mixer_ctl *ctl)
+{
+    return ctl->num_enums;
+}
+
+const char *mixer_ctl_get_enum_string(struct mixer_ctl *ctl, unsigned int enum_id)
+{
+    return enum_id < ctl->num_enums ? ctl->enums[enum_id] : NULL;
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    return id < SIM_MIXER_CTL_VALUES ? ctl->values[id] : -EINVAL;
+}
+
+int mixer_ctl_get_array(struct mixer_ctl *ctl, void *array, size_t count)
+{
+    if (count > sizeof(ctl->values))
+        count = sizeof(ctl->values);
+    memcpy(array, ctl->values, count);
+    return 0;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    if (id >= SIM_MIXER_CTL_VALUES)
+        return -EINVAL;
+    if (sim_params.mixer_write_us > 0)
+        usleep(sim_params.mixer_write_us);
+    android_atomic_inc(&sim_stats.mixer_writes);
+    ctl->values[id] = value;
+    return 0;
+}
+
+int mixer_ctl_set_array(struct mixer_ctl *ctl, const void *array, size_t count)
+{
+    if (sim_params.mixer_write_us > 0)
+        usleep(sim_params.mixer_write_us);
+    android_atomic_inc(&sim_stats.mixer_writes);
+    if (count > sizeof(ctl->values))
+        count = sizeof(ctl->values);
+    memcpy(ctl->values, array, count);
+    return 0;
+}
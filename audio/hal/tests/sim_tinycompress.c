@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Simulated tinycompress, see sim_backend.h. The DSP consumes the buffer at the
+ * bit rate of the codec while started and not paused. Waits are woken up by
+ * compress_stop(), as the driver does for a poll in progress.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/atomic.h>
+#include <tinycompress/tinycompress.h>
+#include "sound/compress_params.h"
+
+#include "sim_backend.h"
+
+#define SIM_COMPRESS_DEFAULT_BIT_RATE 128000
+
+struct compress {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct snd_codec codec;
+    unsigned int fragment_size;
+    int64_t buffer_size;
+    int64_t bytes_per_sec;
+    bool ready;
+    bool running;
+    bool paused;
+    bool nonblock;
+    unsigned int generation;    /* incremented by compress_stop() */
+    int64_t written;
+    /* the DSP had consumed consumed_base bytes at start_ns */
+    int64_t consumed_base;
+    int64_t start_ns;
+    int64_t consumed;
+    char error[128];
+};
+
+static void sim_compress_update_l(struct compress *compress, int64_t now)
+{
+    if (!compress->running || compress->paused)
+        return;
+    compress->consumed = compress->consumed_base +
+                         (now - compress->start_ns) * compress->bytes_per_sec / 1000000000LL;
+    if (compress->consumed >= compress->written) {
+        /* starved: the DSP resumes from the next write */
+        compress->consumed = compress->written;
+        compress->consumed_base = compress->written;
+        compress->start_ns = now;
+    }
+}
+
+/* Time at which the DSP will have consumed up to the given byte */
+static int64_t sim_compress_time_of(const struct compress *compress, int64_t consumed)
+{
+    return compress->start_ns +
+           ((consumed - compress->consumed_base) * 1000000000LL + compress->bytes_per_sec - 1) /
+           compress->bytes_per_sec;
+}
+
+/* Waits until deadline_ns, or forever if it is 0, for a state change or a stop */
+static void sim_compress_wait_l(struct compress *compress, int64_t deadline_ns)
+{
+    struct timespec ts;
+
+    if (deadline_ns == 0) {
+        pthread_cond_wait(&compress->cond, &compress->lock);
+        return;
+    }
+    ts.tv_sec = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    pthread_cond_timedwait(&compress->cond, &compress->lock, &ts);
+}
+
+/* Deadline for the DSP to consume up to the given byte, 0 if it is not playing */
+static int64_t sim_compress_deadline_l(const struct compress *compress, int64_t consumed)
+{
+    if (!compress->running || compress->paused)
+        return 0;
+    return sim_compress_time_of(compress, consumed);
+}
+
+struct compress *compress_open(unsigned int card, unsigned int device, unsigned int flags,
+                               struct compr_config *config)
+{
+    struct compress *compress = (struct compress *)calloc(1, sizeof(struct compress));
+    pthread_condattr_t attr;
+
+    (void)flags;
+    if (compress == NULL)
+        return NULL;
+    pthread_mutex_init(&compress->lock, (const pthread_mutexattr_t *) NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&compress->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (config == NULL || config->codec == NULL ||
+            config->fragment_size == 0 || config->fragments == 0) {
+        snprintf(compress->error, sizeof(compress->error),
+                 "cannot set codec params for card %u device %u", card, device);
+        return compress;
+    }
+    compress->codec = *config->codec;
+    compress->fragment_size = config->fragment_size;
+    compress->buffer_size = (int64_t)config->fragment_size * config->fragments;
+    compress->bytes_per_sec = (compress->codec.bit_rate != 0 ? compress->codec.bit_rate :
+                               sim_params.compress_bit_rate != 0 ? sim_params.compress_bit_rate :
+                               SIM_COMPRESS_DEFAULT_BIT_RATE) / 8;
+    if (compress->bytes_per_sec == 0)
+        compress->bytes_per_sec = 1;
+    compress->ready = true;
+    return compress;
+}
+
+void compress_close(struct compress *compress)
+{
+    if (compress == NULL)
+        return;
+    pthread_cond_destroy(&compress->cond);
+    pthread_mutex_destroy(&compress->lock);
+    free(compress);
+}
+
+bool is_compress_ready(struct compress *compress)
+{
+    return compress != NULL && compress->ready;
+}
+
+bool is_compress_running(struct compress *compress)
+{
+    return compress->running;
+}
+
+const char *compress_get_error(struct compress *compress)
+{
+    return compress->error;
+}
+
+void compress_nonblock(struct compress *compress, int nonblock)
+{
+    compress->nonblock = nonblock != 0;
+}
+
+int compress_write(struct compress *compress, const void *buf, unsigned int size)
+{
+    unsigned int generation;
+    int64_t space, need;
+    unsigned int done = 0;
+
+    (void)buf;
+    android_atomic_inc(&sim_stats.compress_writes);
+    pthread_mutex_lock(&compress->lock);
+    generation = compress->generation;
+    for (;;) {
+        sim_compress_update_l(compress, sim_now_ns());
+        space = compress->buffer_size - (compress->written - compress->consumed);
+        if (space > size - done)
+            space = size - done;
+        compress->written += space;
+        done += space;
+        /* a blocking write into a full buffer only returns once started */
+        if (done == size || compress->nonblock || !compress->running ||
+                generation != compress->generation)
+            break;
+        need = size - done < compress->fragment_size ? size - done : compress->fragment_size;
+        sim_compress_wait_l(compress, sim_compress_deadline_l(compress,
+                compress->written - compress->buffer_size + need));
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return done;
+}
+
+int compress_wait(struct compress *compress, int timeout_ms)
+{
+    int64_t deadline_ns, timeout_ns = 0;
+    unsigned int generation;
+    int ret = 0;
+
+    pthread_mutex_lock(&compress->lock);
+    if (timeout_ms >= 0)
+        timeout_ns = sim_now_ns() + (int64_t)timeout_ms * 1000000LL;
+    generation = compress->generation;
+    for (;;) {
+        int64_t now = sim_now_ns();
+
+        sim_compress_update_l(compress, now);
+        if (compress->buffer_size - (compress->written - compress->consumed) >=
+                compress->fragment_size)
+            break;
+        if (generation != compress->generation) {
+            ret = -EBADFD;
+            break;
+        }
+        if (timeout_ns != 0 && now >= timeout_ns) {
+            ret = -ETIME;
+            break;
+        }
+        deadline_ns = sim_compress_deadline_l(compress,
+                compress->written - compress->buffer_size + compress->fragment_size);
+        if (timeout_ns != 0 && (deadline_ns == 0 || deadline_ns > timeout_ns))
+            deadline_ns = timeout_ns;
+        sim_compress_wait_l(compress, deadline_ns);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return ret;
+}
+
+/* Waits for the DSP to consume everything written, or for a stop */
+static int sim_compress_drain(struct compress *compress)
+{
+    unsigned int generation;
+
+    pthread_mutex_lock(&compress->lock);
+    generation = compress->generation;
+    for (;;) {
+        sim_compress_update_l(compress, sim_now_ns());
+        if (compress->consumed == compress->written || generation != compress->generation)
+            break;
+        sim_compress_wait_l(compress, sim_compress_deadline_l(compress, compress->written));
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_drain(struct compress *compress)
+{
+    return sim_compress_drain(compress);
+}
+
+int compress_partial_drain(struct compress *compress)
+{
+    return sim_compress_drain(compress);
+}
+
+int compress_next_track(struct compress *compress)
+{
+    (void)compress;
+    return 0;
+}
+
+int compress_set_gapless_metadata(struct compress *compress, struct compr_gapless_mdata *mdata)
+{
+    (void)compress;
+    (void)mdata;
+    return 0;
+}
+
+int compress_start(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    if (!compress->running) {
+        compress->running = true;
+        compress->paused = false;
+        compress->consumed_base = compress->consumed;
+        compress->start_ns = sim_now_ns();
+        pthread_cond_broadcast(&compress->cond);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_stop(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    compress->running = false;
+    compress->paused = false;
+    compress->written = 0;
+    compress->consumed = 0;
+    compress->consumed_base = 0;
+    compress->generation++;
+    pthread_cond_broadcast(&compress->cond);
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_pause(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    sim_compress_update_l(compress, sim_now_ns());
+    compress->paused = true;
+    pthread_cond_broadcast(&compress->cond);
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_resume(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    if (compress->paused) {
+        compress->paused = false;
+        compress->consumed_base = compress->consumed;
+        compress->start_ns = sim_now_ns();
+        pthread_cond_broadcast(&compress->cond);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_get_hpointer(struct compress *compress, unsigned int *avail, struct timespec *tstamp)
+{
+    int64_t now = sim_now_ns();
+
+    pthread_mutex_lock(&compress->lock);
+    sim_compress_update_l(compress, now);
+    *avail = compress->buffer_size - (compress->written - compress->consumed);
+    pthread_mutex_unlock(&compress->lock);
+    tstamp->tv_sec = now / 1000000000LL;
+    tstamp->tv_nsec = now % 1000000000LL;
+    return 0;
+}
+
+/* Rendered samples, derived from the bytes consumed at the bit rate */
+int compress_get_tstamp(struct compress *compress, unsigned long *samples,
+                        unsigned int *sampling_rate)
+{
+    pthread_mutex_lock(&compress->lock);
+    sim_compress_update_l(compress, sim_now_ns());
+    *samples = compress->consumed * compress->codec.sample_rate / compress->bytes_per_sec;
+    *sampling_rate = compress->codec.sample_rate;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
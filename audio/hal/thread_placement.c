@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_thread_placement"
+/*#define LOG_NDEBUG 0*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <cutils/sched_policy.h>
+#include <system/thread_defs.h>
+
+#include "thread_placement.h"
+
+#define IRQ_AFFINITY_PATH "/proc/asound/irq_affinity"
+
+/* sched_policy of a thread whose scheduling is left to its creator */
+#define THREAD_SCHED_KEEP -1
+
+struct thread_policy {
+    const char *name;
+    int sched_policy;       /* SCHED_FIFO, SCHED_OTHER or THREAD_SCHED_KEEP */
+    int rt_priority;        /* for SCHED_FIFO */
+    int nice;               /* for SCHED_OTHER, or when SCHED_FIFO is refused */
+    SchedPolicy group;      /* SP_DEFAULT to keep the cgroup of the thread */
+    bool irq_cpu;           /* pinned to the CPU handling the audio interrupt */
+};
+
+static const struct thread_policy thread_policies[THREAD_ROLE_CNT] = {
+    [THREAD_ROLE_FAST_PLAYBACK] = {
+        "fast playback", THREAD_SCHED_KEEP, 0, 0, SP_DEFAULT, true },
+    [THREAD_ROLE_FAST_CAPTURE] = {
+        "fast capture", THREAD_SCHED_KEEP, 0, 0, SP_DEFAULT, true },
+    [THREAD_ROLE_PLAYBACK_WRITER] = {
+        "playback writer", SCHED_FIFO, 3, ANDROID_PRIORITY_URGENT_AUDIO, SP_DEFAULT, true },
+    [THREAD_ROLE_PLAYBACK_WORKER] = {
+        "playback worker", SCHED_OTHER, 0, ANDROID_PRIORITY_URGENT_AUDIO, SP_DEFAULT, false },
+    [THREAD_ROLE_OFFLOAD_CALLBACK] = {
+        "offload callback", SCHED_OTHER, 0, ANDROID_PRIORITY_AUDIO, SP_FOREGROUND, false },
+    [THREAD_ROLE_VISUALIZER_CAPTURE] = {
+        "visualizer capture", SCHED_OTHER, 0, ANDROID_PRIORITY_AUDIO, SP_FOREGROUND, false },
+    [THREAD_ROLE_SOUND_TRIGGER] = {
+        "sound trigger", SCHED_OTHER, 0, ANDROID_PRIORITY_AUDIO, SP_FOREGROUND, false },
+};
+
+struct placed_thread {
+    pid_t tid;
+    enum thread_role role;
+    unsigned int refs;
+    int cpu;                /* CPU it is pinned to, -1 if none */
+};
+
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+static int irq_fd = -1;
+static int irq_cpu = -1;
+static int64_t irq_checked_ns;
+static bool irq_checked;
+static struct placed_thread placed_threads[THREAD_PLACEMENT_MAX_THREADS];
+static unsigned int placed_count;
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The file is kept open, only read again from its start */
+static int irq_cpu_read_l(void)
+{
+    char buf[16];
+    ssize_t size;
+    char *end;
+    long cpu;
+
+    if (irq_fd < 0) {
+        irq_fd = open(IRQ_AFFINITY_PATH, O_RDONLY | O_CLOEXEC);
+        if (irq_fd < 0)
+            return -errno;
+    }
+    size = pread(irq_fd, buf, sizeof(buf) - 1, 0);
+    if (size <= 0)
+        return size < 0 ? -errno : -ENODATA;
+    buf[size] = '\0';
+    cpu = strtol(buf, &end, 10);
+    if (end == buf || cpu < 0 || cpu >= CPU_SETSIZE)
+        return -EINVAL;
+    return (int)cpu;
+}
+
+static int thread_pin_l(struct placed_thread *thread)
+{
+    cpu_set_t cpu_set;
+
+    if (irq_cpu < 0 || thread->cpu == irq_cpu)
+        return 0;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(irq_cpu, &cpu_set);
+    if (sched_setaffinity(thread->tid, sizeof(cpu_set), &cpu_set) != 0)
+        return -errno;
+    thread->cpu = irq_cpu;
+    return 0;
+}
+
+/* Reads the interrupt CPU if not done in the last THREAD_PLACEMENT_IRQ_RECHECK_MS
+ * and moves the pinned threads if it changed.
+ */
+static void irq_cpu_check_l(void)
+{
+    int64_t now_ns = monotonic_ns();
+    unsigned int i;
+    int cpu;
+
+    if (irq_checked &&
+            now_ns - irq_checked_ns < THREAD_PLACEMENT_IRQ_RECHECK_MS * 1000000LL)
+        return;
+
+    cpu = irq_cpu_read_l();
+    if (cpu < 0 && !irq_checked)
+        ALOGW("%s: cannot read %s (%d)", __func__, IRQ_AFFINITY_PATH, cpu);
+    irq_checked = true;
+    irq_checked_ns = now_ns;
+    if (cpu < 0 || cpu == irq_cpu)
+        return;
+
+    ALOGI("%s: audio interrupt on CPU %d, was %d", __func__, cpu, irq_cpu);
+    irq_cpu = cpu;
+    for (i = 0; i < placed_count; ) {
+        /* the thread may have exited without being removed */
+        if (thread_pin_l(&placed_threads[i]) == -ESRCH) {
+            placed_threads[i] = placed_threads[--placed_count];
+            continue;
+        }
+        i++;
+    }
+}
+
+static void thread_remember_l(pid_t tid, enum thread_role role, int cpu)
+{
+    unsigned int i;
+
+    for (i = 0; i < placed_count; i++) {
+        if (placed_threads[i].tid == tid) {
+            placed_threads[i].role = role;
+            placed_threads[i].refs++;
+            placed_threads[i].cpu = cpu;
+            return;
+        }
+    }
+    if (placed_count == THREAD_PLACEMENT_MAX_THREADS) {
+        ALOGW("%s: too many threads, tid %d will not follow the interrupt", __func__, tid);
+        return;
+    }
+    placed_threads[placed_count].tid = tid;
+    placed_threads[placed_count].role = role;
+    placed_threads[placed_count].refs = 1;
+    placed_threads[placed_count].cpu = cpu;
+    placed_count++;
+}
+
+int thread_placement_apply(enum thread_role role)
+{
+    const struct thread_policy *policy;
+    struct placed_thread thread;
+    struct sched_param param;
+    pid_t tid = gettid();
+    int ret = 0;
+
+    if (role < 0 || role >= THREAD_ROLE_CNT)
+        return -EINVAL;
+    policy = &thread_policies[role];
+
+    if (policy->sched_policy == SCHED_FIFO) {
+        param.sched_priority = policy->rt_priority;
+        if (sched_setscheduler(tid, SCHED_FIFO, &param) != 0) {
+            ALOGW("%s: %s tid %d: SCHED_FIFO refused (%d), using nice %d", __func__,
+                  policy->name, tid, errno, policy->nice);
+            setpriority(PRIO_PROCESS, tid, policy->nice);
+        }
+    } else if (policy->sched_policy == SCHED_OTHER) {
+        setpriority(PRIO_PROCESS, tid, policy->nice);
+    }
+    if (policy->group != SP_DEFAULT)
+        set_sched_policy(tid, policy->group);
+
+    if (!policy->irq_cpu) {
+        ALOGV("%s: %s tid %d", __func__, policy->name, tid);
+        return tid;
+    }
+
+    pthread_mutex_lock(&placement_lock);
+    irq_cpu_check_l();
+    thread.tid = tid;
+    thread.cpu = -1;
+    ret = thread_pin_l(&thread);
+    if (ret != 0)
+        ALOGW("%s: %s tid %d: cannot pin to CPU %d (%d)", __func__, policy->name, tid,
+              irq_cpu, ret);
+    thread_remember_l(tid, role, thread.cpu);
+    pthread_mutex_unlock(&placement_lock);
+
+    ALOGV("%s: %s tid %d on CPU %d", __func__, policy->name, tid, thread.cpu);
+    return tid;
+}
+
+void thread_placement_remove(pid_t tid)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&placement_lock);
+    for (i = 0; i < placed_count; i++) {
+        if (placed_threads[i].tid == tid) {
+            if (--placed_threads[i].refs == 0)
+                placed_threads[i] = placed_threads[--placed_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&placement_lock);
+}
+
+void thread_placement_refresh(void)
+{
+    pthread_mutex_lock(&placement_lock);
+    if (placed_count != 0)
+        irq_cpu_check_l();
+    pthread_mutex_unlock(&placement_lock);
+}
+
+void thread_placement_dump(int fd)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&placement_lock);
+    dprintf(fd, "Thread placement: audio interrupt on CPU %d\n", irq_cpu);
+    for (i = 0; i < placed_count; i++)
+        dprintf(fd, "  tid %d (%s): CPU %d\n", placed_threads[i].tid,
+                thread_policies[placed_threads[i].role].name, placed_threads[i].cpu);
+    pthread_mutex_unlock(&placement_lock);
+}
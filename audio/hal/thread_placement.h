@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOUNDER_THREAD_PLACEMENT_H
+#define FLOUNDER_THREAD_PLACEMENT_H
+
+#include <sys/types.h>
+
+/*
+ * Scheduling class, priority and CPU affinity of the audio threads, taken from
+ * a table indexed by the role of the thread.
+ *
+ * Threads of a role pinned to the CPU handling the audio interrupt are
+ * remembered until thread_placement_remove(). The CPU is read from
+ * /proc/asound/irq_affinity once, checked again at most every
+ * THREAD_PLACEMENT_IRQ_RECHECK_MS by thread_placement_apply() and
+ * thread_placement_refresh(), and the remembered threads are moved when it
+ * changes.
+ *
+ * Thread safe. Compiled in each audio library using it, which then has its own
+ * copy of the state.
+ */
+
+enum thread_role {
+    THREAD_ROLE_FAST_PLAYBACK,      /* AudioFlinger thread writing the primary output */
+    THREAD_ROLE_FAST_CAPTURE,       /* AudioFlinger thread reading the primary input */
+    THREAD_ROLE_PLAYBACK_WRITER,    /* asynchronous writer of the primary output */
+    THREAD_ROLE_PLAYBACK_WORKER,    /* fan-out writer of a secondary PCM device */
+    THREAD_ROLE_OFFLOAD_CALLBACK,
+    THREAD_ROLE_VISUALIZER_CAPTURE,
+    THREAD_ROLE_SOUND_TRIGGER,
+    THREAD_ROLE_CNT
+};
+
+#define THREAD_PLACEMENT_IRQ_RECHECK_MS 1000
+/* threads remembered for a move of the interrupt */
+#define THREAD_PLACEMENT_MAX_THREADS 16
+
+/* Places the calling thread, returns its tid or a negative errno */
+int thread_placement_apply(enum thread_role role);
+
+/* Forgets a thread placed by thread_placement_apply(), once per call to it */
+void thread_placement_remove(pid_t tid);
+
+/* Checks if the audio interrupt moved, cheap when called again before the recheck delay */
+void thread_placement_refresh(void);
+
+void thread_placement_dump(int fd);
+
+#endif // FLOUNDER_THREAD_PLACEMENT_H
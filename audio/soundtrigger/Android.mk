@@ -24,8 +24,8 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := sound_trigger.primary.flounder
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SRC_FILES := sound_trigger_hw.c
-LOCAL_C_INCLUDES += external/tinyalsa/include
+LOCAL_SRC_FILES := sound_trigger_hw.c ../hal/thread_placement.c
+LOCAL_C_INCLUDES += external/tinyalsa/include $(LOCAL_PATH)/../hal
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa
 LOCAL_MODULE_TAGS := optional
 # LOCAL_32_BIT_ONLY := true
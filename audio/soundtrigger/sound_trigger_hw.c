@@ -31,6 +31,7 @@
 #include <system/sound_trigger.h>
 #include <hardware/sound_trigger.h>
 #include <tinyalsa/asoundlib.h>
+#include "thread_placement.h"
 
 #define FLOUNDER_MIXER_VAD	0
 #define FLOUNDER_CTRL_DSP	"VAD Mode"
@@ -259,6 +260,7 @@ static void *callback_thread_loop(void *context)
 
     ALOGI("%s", __func__);
     prctl(PR_SET_NAME, (unsigned long)"sound trigger callback", 0, 0, 0);
+    thread_placement_apply(THREAD_ROLE_SOUND_TRIGGER);
 
     pthread_mutex_lock(&stdev->lock);
     if (stdev->recognition_callback == NULL)
@@ -2,7 +2,9 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := nv_offload_visualizer.c
+LOCAL_SRC_FILES := \
+	nv_offload_visualizer.c \
+	../hal/thread_placement.c
 
 LOCAL_CFLAGS += -O2 -fvisibility=hidden
 
@@ -15,6 +17,7 @@ LOCAL_MODULE_RELATIVE_PATH := soundfx
 LOCAL_MODULE := libnvvisualizer
 
 LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../hal \
 	external/tinyalsa/include \
 	$(call include-path-for, audio-effects)
 
@@ -28,6 +28,7 @@
 #include <system/thread_defs.h>
 #include <tinyalsa/asoundlib.h>
 #include <audio_effects/effect_visualizer.h>
+#include "thread_placement.h"
 
 
 enum {
@@ -290,6 +291,7 @@ void *effects_capture_thread_loop(void *arg __unused)
     int retry_num = 0;
 
     prctl(PR_SET_NAME, (unsigned long)"visualizer capture", 0, 0, 0);
+    thread_placement_apply(THREAD_ROLE_VISUALIZER_CAPTURE);
 
     pthread_mutex_lock(&lock);
 